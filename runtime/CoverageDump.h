@@ -0,0 +1,179 @@
+#ifndef OPENCLBC_RUNTIME_COVERAGE_DUMP_H
+#define OPENCLBC_RUNTIME_COVERAGE_DUMP_H
+
+// Binary coverage dumps (see dump_format in src/Constants.h), merged across runs by openclbc-merge:
+//     openclbc::writeCoverageDump<openclbc_metadata::yourkernelfile_cl>("dumps/yourkernelfile.cl", buffer);
+//     openclbc-merge -o merged.ocbd dumps/*.ocbd
+// or merged straight into one accumulation file per kernel, like .gcda files, by every process at exit:
+//     openclbc::accumulateCoverageDump<openclbc_metadata::yourkernelfile_cl>("yourkernelfile.cl.ocbd", buffer);
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#define OPENCLBC_GETPID _getpid
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define OPENCLBC_GETPID getpid
+#endif
+
+#include "../src/Constants.h"
+
+namespace openclbc{
+
+// Unique per process and per dump, so that concurrent runs can dump into the same directory
+inline std::string dumpFileName(const std::string& prefix){
+    static unsigned int numDumps = 0;
+    return prefix + "." + std::to_string((long)OPENCLBC_GETPID()) + "." + std::to_string(numDumps++) + ".ocbd";
+}
+
+// buffer is the host copy of the instrumentation buffer, starting with its layout header
+inline bool writeCoverageDump(const std::string& path, unsigned long long kernelHash, unsigned int wideKinds, const unsigned int* buffer){
+    if (buffer[0] != recorder_layout::MAGIC) return false;
+    FILE* dumpFile = fopen(path.c_str(), "wb");
+    if (!dumpFile) return false;
+    unsigned int header[dump_format::HEADER_WORDS] = {dump_format::FILE_MAGIC, dump_format::VERSION,
+        (unsigned int)kernelHash, (unsigned int)(kernelHash >> 32), wideKinds, buffer[1]};
+    bool written = fwrite(header, sizeof(unsigned int), dump_format::HEADER_WORDS, dumpFile) == dump_format::HEADER_WORDS
+        && fwrite(buffer, sizeof(unsigned int), buffer[1], dumpFile) == buffer[1];
+    return fclose(dumpFile) == 0 && written;
+}
+
+template <typename Metadata>
+bool writeCoverageDump(const std::string& prefix, const unsigned int* buffer){
+    return writeCoverageDump(dumpFileName(prefix), Metadata::kernelHash, Metadata::wideKinds, buffer);
+}
+
+enum DumpMergeOp{
+    KEEP_FIRST,
+    MERGE_OR,
+    MERGE_MAX,
+    MERGE_SUM32,
+    MERGE_SUM64     // Pairs of words, low word first
+};
+
+// A run of buffer words merged the same way
+struct DumpSpan{
+    DumpMergeOp op;
+    size_t begin;
+    size_t end;
+};
+
+// Spans of every recorder, from the layout header at the start of a buffer. Flags and heatmap bitmaps are
+// ORed, counters and timers summed, the trace of the first dump is kept.
+inline std::vector<DumpSpan> planDumpMerge(const unsigned int* buffer, unsigned int wideKinds){
+    std::vector<DumpSpan> spans;
+    spans.push_back({KEEP_FIRST, 0, recorder_layout::HEADER_WORDS});
+    for (int kind = 0; kind < recorder_layout::NUM_KINDS; kind++){
+        size_t offset = buffer[2 + 2 * kind];
+        size_t numElements = buffer[3 + 2 * kind];
+        if (numElements == 0) continue;
+        bool wide = (wideKinds >> kind) & 1u;
+        size_t end = offset + numElements * (wide ? 2 : 1);
+        switch (kind){
+            case recorder_layout::BRANCH:
+            case recorder_layout::BARRIER:
+                spans.push_back({MERGE_OR, offset, end});
+                break;
+            case recorder_layout::HEATMAP:
+                // Work-group counts and bins are the same in every dump where a work-group finished
+                spans.push_back({MERGE_MAX, offset, std::min(end, offset + heatmap_format::HEADER_WORDS)});
+                if (end > offset + heatmap_format::HEADER_WORDS){
+                    spans.push_back({MERGE_OR, offset + heatmap_format::HEADER_WORDS, end});
+                }
+                break;
+            case recorder_layout::TRACE:
+                spans.push_back({KEEP_FIRST, offset, end});
+                break;
+            default:
+                spans.push_back({wide ? MERGE_SUM64 : MERGE_SUM32, offset, end});
+                break;
+        }
+    }
+    return spans;
+}
+
+// Merge a buffer into another of the same layout, in place. 32-bit counters saturate.
+inline void mergeCoverageBuffer(unsigned int* into, const unsigned int* from, unsigned int wideKinds){
+    for (const DumpSpan& span : planDumpMerge(into, wideKinds)){
+        for (size_t i = span.begin; i < span.end; i++){
+            switch (span.op){
+                case KEEP_FIRST: break;
+                case MERGE_OR: into[i] |= from[i]; break;
+                case MERGE_MAX: into[i] = std::max(into[i], from[i]); break;
+                case MERGE_SUM32:
+                    into[i] = into[i] + from[i] < into[i] ? 0xffffffffu : into[i] + from[i];
+                    break;
+                case MERGE_SUM64:{
+                    unsigned long long sum = (into[i] | ((unsigned long long)into[i + 1] << 32))
+                        + (from[i] | ((unsigned long long)from[i + 1] << 32));
+                    into[i] = (unsigned int)sum;
+                    into[i + 1] = (unsigned int)(sum >> 32);
+                    i++;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Merge a buffer into the accumulation file at path, creating it on first use. Concurrent processes are
+// serialised by an exclusive lock on the file, and the file is mapped so the merge happens in place.
+// A file left by another kernel or configuration is not touched, false is returned.
+// Without mmap and flock (Windows), a per-process dump named after path is written instead.
+inline bool accumulateCoverageDump(const std::string& path, unsigned long long kernelHash, unsigned int wideKinds, const unsigned int* buffer){
+    if (buffer[0] != recorder_layout::MAGIC) return false;
+#ifdef _WIN32
+    return writeCoverageDump(dumpFileName(path), kernelHash, wideKinds, buffer);
+#else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) return false;
+    // Released when the file is closed, also if the process dies while merging
+    if (flock(fd, LOCK_EX) != 0){
+        close(fd);
+        return false;
+    }
+    size_t size = (dump_format::HEADER_WORDS + buffer[1]) * sizeof(unsigned int);
+    struct stat status;
+    bool merged = fstat(fd, &status) == 0 && (status.st_size == 0 || (size_t)status.st_size == size)
+        && (status.st_size != 0 || ftruncate(fd, size) == 0);
+    void* mapping = merged ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (mapping != MAP_FAILED){
+        unsigned int* words = (unsigned int*)mapping;
+        unsigned int header[dump_format::HEADER_WORDS] = {dump_format::FILE_MAGIC, dump_format::VERSION,
+            (unsigned int)kernelHash, (unsigned int)(kernelHash >> 32), wideKinds, buffer[1]};
+        if (words[0] == 0){
+            // New, or created by a process that died before filling it in
+            memcpy(words + dump_format::HEADER_WORDS, buffer, buffer[1] * sizeof(unsigned int));
+            memcpy(words, header, sizeof(header));
+        } else if (memcmp(words, header, sizeof(header)) == 0){
+            mergeCoverageBuffer(words + dump_format::HEADER_WORDS, buffer, wideKinds);
+        } else {
+            merged = false;
+        }
+        merged = msync(mapping, size, MS_SYNC) == 0 && merged;
+        munmap(mapping, size);
+    } else {
+        merged = false;
+    }
+    close(fd);
+    return merged;
+#endif
+}
+
+template <typename Metadata>
+bool accumulateCoverageDump(const std::string& path, const unsigned int* buffer){
+    return accumulateCoverageDump(path, Metadata::kernelHash, Metadata::wideKinds, buffer);
+}
+
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef OPENCLBC_RUNTIME_COVERAGE_REPORT_H
+#define OPENCLBC_RUNTIME_COVERAGE_REPORT_H
+
+// Report printed from the metadata header openclbc writes next to the instrumented kernel
+// (yourkernelfile.cl.h). The header describes every probe and the layout of the instrumentation buffer
+// as compile-time constants, so reporting is a loop over static tables with no file access:
+//     #include "yourkernelfile.cl.h"
+//     openclbc::reportCoverage<openclbc_metadata::yourkernelfile_cl>(host_copy_of_the_instrumentation_buffer);
+
+#include <cstdio>
+#include <cstring>
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "EdgeProfile.h"
+
+namespace openclbc{
+
+enum ProbeKind{
+    CONDITION_PROBE,
+    BARRIER_PROBE,
+    ATOMIC_PROBE,
+    BLOCK_PROBE,
+    REGION_PROBE
+};
+
+enum ProbeMode{
+    DYNAMIC_PROBE,          // Recorded by every work-item reaching it
+    UNIFORM_PROBE,          // Work-group uniform condition, recorded by one work-item per work-group
+    PROVEN_PROBE,           // Barrier proven free of divergence, not checked at runtime
+    CONSTANT_TRUE_PROBE,    // Condition folding to true, not instrumented
+    CONSTANT_FALSE_PROBE,   // Condition folding to false, not instrumented
+    DERIVED_PROBE           // Block counted by the host from the others, see reconstructBlockCounts
+};
+
+struct ProbeSite{
+    const char* file;
+    unsigned int line;
+    unsigned int column;
+    ProbeKind kind;
+    const char* text;       // Condition, atomic builtin, function of a block or name of a region
+    ProbeMode mode;
+};
+
+// Static cost of one execution of a block: global load/store bytes, local load/store bytes, flops
+struct BlockCost{
+    unsigned int function;  // Index in functionNames()
+    double weight[5];
+};
+
+inline void printSite(const ProbeSite& site, FILE* output){
+    fprintf(output, "Source code line: %s:%u:%u\n", site.file, site.line, site.column);
+}
+
+// Metadata is the struct of the generated header: sizes and offsets are constants, so every loop below
+// has a trip count known at compile time and empty sections are compiled out
+template <typename Metadata>
+void reportCoverage(const cl_uint* instrumentation, FILE* output = stdout){
+    unsigned int coveredBranches = 0;
+    if (Metadata::numConditions){
+        const int* branches = (const int*)(instrumentation + Metadata::branchOffset);
+        const ProbeSite* conditions = Metadata::conditions();
+        const unsigned char* coveredBefore = Metadata::coveredBefore();
+        fprintf(output, "\x1B[34mCondition coverage summary\x1B[0m\n");
+        for (unsigned int i = 0; i < Metadata::numConditions; i++){
+            fprintf(output, "Condition ID: %u\n", i);
+            printSite(conditions[i], output);
+            fprintf(output, "Condition: %s\n", conditions[i].text);
+            if (conditions[i].mode == UNIFORM_PROBE){
+                fprintf(output, "Uniform over work-groups, recorded by one work-item of each\n");
+            }
+            for (unsigned int side = 0; side < 2; side++){
+                const char* name = side ? "False" : "True";
+                if (branches[2 * i + side]){
+                    fprintf(output, "\x1B[32m%s branch covered\x1B[0m\n", name);
+                    coveredBranches++;
+                } else if (coveredBefore && coveredBefore[2 * i + side]){
+                    // Not probed, see prior_coverage
+                    fprintf(output, "\x1B[32m%s branch covered in a previous run\x1B[0m\n", name);
+                    coveredBranches++;
+                } else {
+                    fprintf(output, "\x1B[31m%s branch not covered\x1B[0m\n", name);
+                }
+            }
+        }
+    }
+    if (Metadata::numConstantConditions){
+        // Known at instrumentation time, so left out of the total
+        const ProbeSite* constantConditions = Metadata::constantConditions();
+        for (unsigned int i = 0; i < Metadata::numConstantConditions; i++){
+            fprintf(output, "Constant condition ID: %u\n", i);
+            printSite(constantConditions[i], output);
+            fprintf(output, "Condition: %s\n", constantConditions[i].text);
+            fprintf(output, "Always %s, the %s branch is never taken\n",
+                constantConditions[i].mode == CONSTANT_TRUE_PROBE ? "true" : "false",
+                constantConditions[i].mode == CONSTANT_TRUE_PROBE ? "false" : "true");
+        }
+    }
+    unsigned int faultyBarriers = 0;
+    if (Metadata::numBarriers){
+        const int* divergences = (const int*)(instrumentation + Metadata::barrierOffset);
+        const ProbeSite* barriers = Metadata::barriers();
+        for (unsigned int i = 0; i < Metadata::numBarriers; i++){
+            fprintf(output, "Barrier ID: %u\n", i);
+            printSite(barriers[i], output);
+            if (barriers[i].mode == PROVEN_PROBE){
+                fprintf(output, "\x1B[32mThis barrier is proven free of divergence\x1B[0m\n");
+            } else if (divergences[i]){
+                fprintf(output, "\x1B[31mThis barrier has got a divergence\x1B[0m\n");
+                faultyBarriers++;
+            } else {
+                fprintf(output, "\x1B[32mThis barrier worked fine\x1B[0m\n");
+            }
+        }
+    }
+    if (Metadata::numAtomics){
+        typedef typename Metadata::AtomicCounter AtomicCounter;
+        const AtomicCounter* counters = (const AtomicCounter*)(instrumentation + Metadata::atomicOffset);
+        const ProbeSite* atomics = Metadata::atomics();
+        fprintf(output, "\x1B[34mAtomic contention summary\x1B[0m\n");
+        for (unsigned int i = 0; i < Metadata::numAtomics; i++){
+            fprintf(output, "Atomic ID: %u\n", i);
+            printSite(atomics[i], output);
+            fprintf(output, "Atomic: %s\n", atomics[i].text);
+            if (counters[2 * i]){
+                fprintf(output, "Executions: %llu, contended: %llu, contention rate: %-4.2f\n", (unsigned long long)counters[2 * i],
+                    (unsigned long long)counters[2 * i + 1], (double)counters[2 * i + 1] / (double)counters[2 * i] * 100.0);
+            } else {
+                fprintf(output, "\x1B[31mThis atomic was never executed\x1B[0m\n");
+            }
+        }
+    }
+    if (Metadata::numBlocks){
+        // The last row of the totals is the whole kernel
+        const cl_ulong* executions = (const cl_ulong*)(instrumentation + Metadata::blockOffset);
+        const BlockCost* costs = Metadata::blockCosts();
+        double totals[Metadata::numFunctions + 1][5] = {{0}};
+        for (unsigned int i = 0; i < Metadata::numBlocks; i++){
+            for (int w = 0; w < 5; w++){
+                double cost = (double)executions[i] * costs[i].weight[w];
+                totals[costs[i].function][w] += cost;
+                totals[Metadata::numFunctions][w] += cost;
+            }
+        }
+        fprintf(output, "\x1B[34mRoofline summary\x1B[0m\n");
+        for (unsigned int f = 0; f <= Metadata::numFunctions; f++){
+            const double* total = totals[f];
+            double globalBytes = total[0] + total[1];
+            double localBytes = total[2] + total[3];
+            fprintf(output, "%s: global %.0f bytes (load %.0f, store %.0f), local %.0f bytes, %.0f flops\n",
+                f < Metadata::numFunctions ? Metadata::functionNames()[f] : "Total", globalBytes, total[0], total[1], localBytes, total[4]);
+            fprintf(output, "  Arithmetic intensity: %.4f flops/global byte, %.4f flops/byte including local memory\n",
+                globalBytes ? total[4] / globalBytes : 0.0,
+                (globalBytes + localBytes) ? total[4] / (globalBytes + localBytes) : 0.0);
+        }
+    }
+    if (Metadata::numRegions){
+        // Shares are relative to the time spent in kernel bodies, summed over all work-items
+        const cl_ulong* timers = (const cl_ulong*)(instrumentation + Metadata::regionTimerOffset);
+        const ProbeSite* regions = Metadata::regions();
+        double kernelTime = 0.0;
+        for (unsigned int i = 0; i < Metadata::numRegions; i++){
+            if (strncmp(regions[i].text, "kernel ", 7) == 0) kernelTime += (double)timers[i];
+        }
+        fprintf(output, "\x1B[34mRegion time summary\x1B[0m\n");
+        for (unsigned int i = 0; i < Metadata::numRegions; i++){
+            fprintf(output, "%s: %llu ticks (%.2f%% of kernel time)\n", regions[i].text, (unsigned long long)timers[i],
+                kernelTime ? (double)timers[i] / kernelTime * 100.0 : 0.0);
+        }
+    }
+    if (Metadata::numConditions){
+        fprintf(output, "Total branch coverage: %-4.2f\n", (double)coveredBranches / (double)(Metadata::numConditions * 2) * 100.0);
+    }
+    if (Metadata::numBarriers){
+        fprintf(output, "Faulty barrier rate: %-4.2f\n", (double)faultyBarriers / (double)Metadata::numBarriers * 100.0);
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,461 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "CoverageSession.h"
+#include "CoverageDump.h"
+#include "../src/Constants.h"
+
+namespace openclbc{
+
+CoverageSession::CoverageSession(cl_context context, cl_command_queue queue, const std::string& dataFilePath,
+    AccumulationMode mode) : context(context), queue(queue), mode(mode), buffer(NULL), numCollections(0), nextSnapshot(0), kernelHash(0){
+    snapshots[0] = snapshots[1] = NULL;
+    clRetainContext(context);
+    clRetainCommandQueue(queue);
+    loadMetadata(dataFilePath);
+}
+
+CoverageSession::~CoverageSession(){
+    foldCompleted(true);
+    if (buffer) clReleaseMemObject(buffer);
+    if (snapshots[0]) clReleaseMemObject(snapshots[0]);
+    if (snapshots[1]) clReleaseMemObject(snapshots[1]);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+}
+
+void CoverageSession::loadMetadata(const std::string& dataFilePath){
+    std::ifstream dataFile(dataFilePath);
+    if (!dataFile){
+        fprintf(stderr, "OpenCLBC data file %s not found\n", dataFilePath.c_str());
+        return;
+    }
+    const std::pair<const char*, std::vector<ProbeInfo>*> sections[] = {
+        {"Condition ID: ", &conditions}, {"Constant condition ID: ", &constantConditions}, {"Barrier ID: ", &barriers}, {"Atomic ID: ", &atomics},
+        {"Block ID: ", &blocks}, {"Region ID: ", &regions}};
+    const char* textKeys[] = {"Condition: ", "Atomic: ", "Function: ", "Region: "};
+    ProbeInfo* current = NULL;
+    std::string line;
+    bool inBlock = false;
+    bool hasEdges = false;
+    while (std::getline(dataFile, line)){
+        bool newEntry = false;
+        for (auto& section : sections){
+            if (line.compare(0, strlen(section.first), section.first) == 0){
+                section.second->push_back(ProbeInfo());
+                current = &section.second->back();
+                memset(current->weight, 0, sizeof(current->weight));
+                newEntry = true;
+                break;
+            }
+        }
+        if (line.compare(0, 13, "Kernel hash: ") == 0){
+            kernelHash = std::stoull(line.substr(13), NULL, 16);
+            continue;
+        }
+        if (newEntry){
+            inBlock = !blocks.empty() && current == &blocks.back();
+            ProfileEdge edge = {-1, -1, -1, true};
+            if (inBlock) profileEdges.push_back(edge);
+        }
+        if (newEntry || !current) continue;
+        if (inBlock && line.compare(0, 6, "Edge: ") == 0){
+            sscanf(line.c_str(), "Edge: %d %d", &profileEdges.back().from, &profileEdges.back().to);
+            hasEdges = true;
+        } else if (inBlock && line.compare(0, 8, "Branch: ") == 0){
+            profileEdges.back().branch = std::stoi(line.substr(8));
+            hasEdges = true;
+        } else if (line.compare(0, 18, "Source code line: ") == 0){
+            current->sourceLine = line.substr(18);
+        } else if (line.compare(0, 16, "Covered before: ") == 0){
+            current->coveredBefore = line.substr(16);
+        } else if (line.compare(0, 7, "Probe: ") == 0){
+            current->probe = line.substr(7);
+            if (inBlock && current->probe == "derived") profileEdges.back().counted = false;
+        } else if (line.compare(0, 8, "Weight: ") == 0){
+            sscanf(line.c_str(), "Weight: global load %lf bytes, global store %lf bytes, local load %lf bytes, local store %lf bytes, %lf flops",
+                &current->weight[0], &current->weight[1], &current->weight[2], &current->weight[3], &current->weight[4]);
+        } else {
+            for (const char* key : textKeys){
+                if (line.compare(0, strlen(key), key) == 0){
+                    current->text = line.substr(strlen(key));
+                    break;
+                }
+            }
+        }
+    }
+    if (!hasEdges) profileEdges.clear();
+}
+
+cl_int CoverageSession::addRecorder(RecorderKind kind, size_t numElements){
+    if (buffer) return CL_INVALID_VALUE;
+    Recorder recorder;
+    recorder.kind = kind;
+    recorder.numElements = numElements;
+    recorder.elementSize = (kind == BLOCK_RECORDER || kind == REGION_TIMER_RECORDER
+        || (kind == ATOMIC_RECORDER && mode == ACCUMULATE_ON_DEVICE)) ? sizeof(cl_ulong) : sizeof(cl_uint);
+    layout.add((recorder_layout::RecorderKind)kind, numElements, recorder.elementSize / sizeof(cl_uint));
+    recorder.offset = (size_t)layout.offset[kind] * sizeof(cl_uint);
+    recorder.accumulated.assign(numElements, 0);
+    recorder.delta.assign(numElements, 0);
+    recorder.base.assign(numElements, 0);
+    recorders.push_back(recorder);
+    return CL_SUCCESS;
+}
+
+cl_int CoverageSession::allocate(){
+    size_t size = (size_t)layout.totalWords * sizeof(cl_uint);
+    header.resize(recorder_layout::HEADER_WORDS);
+    layout.writeHeader(header.data());
+    cl_int status;
+    buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &status);
+    if (status != CL_SUCCESS) return status;
+    if (mode == ACCUMULATE_ON_DEVICE){
+        for (int i = 0; i < 2; i++){
+            snapshots[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &status);
+            if (status != CL_SUCCESS) return status;
+        }
+    }
+    // The header is kept in the session until the write has completed
+    status = clEnqueueWriteBuffer(queue, buffer, CL_FALSE, 0, header.size() * sizeof(cl_uint), header.data(), 0, NULL, NULL);
+    if (status != CL_SUCCESS) return status;
+    return clearRecorders(0, NULL);
+}
+
+// Everything but the header
+cl_int CoverageSession::clearRecorders(cl_uint numEventsInWaitList, const cl_event* eventWaitList){
+    cl_uint zero = 0;
+    size_t headerSize = recorder_layout::HEADER_WORDS * sizeof(cl_uint);
+    return clEnqueueFillBuffer(queue, buffer, &zero, sizeof(zero), headerSize,
+        (size_t)layout.totalWords * sizeof(cl_uint) - headerSize, numEventsInWaitList, eventWaitList, NULL);
+}
+
+cl_int CoverageSession::attach(cl_kernel kernel, cl_uint argumentIndex){
+    if (!buffer){
+        cl_int status = allocate();
+        if (status != CL_SUCCESS) return status;
+    }
+    return clSetKernelArg(kernel, argumentIndex, sizeof(cl_mem), &buffer);
+}
+
+cl_int CoverageSession::reset(){
+    if (!buffer) return CL_SUCCESS;
+    if (mode == ACCUMULATE_ON_DEVICE){
+        // Snapshots taken from now on count from zero again
+        cl_int status = foldCompleted(true);
+        if (status != CL_SUCCESS) return status;
+        for (auto& recorder : recorders){
+            recorder.base = recorder.accumulated;
+        }
+    }
+    return clearRecorders(0, NULL);
+}
+
+// The whole buffer is read with one command. On the host, it is cleared once read so the next launch starts
+// from zero. On the device, it is first copied into a snapshot: the copy only waits for the launches enqueued
+// before it, and the next launches only touch the instrumentation buffer, so reading the snapshot overlaps
+// them. Snapshots alternate so that a copy never waits for the read of the previous snapshot.
+cl_int CoverageSession::collect(cl_uint numEventsInWaitList, const cl_event* eventWaitList){
+    if (!buffer) return CL_SUCCESS;
+    cl_int status = foldCompleted(false);
+    if (status != CL_SUCCESS) return status;
+
+    size_t size = (size_t)layout.totalWords * sizeof(cl_uint);
+    pending.push_back(PendingCollection());
+    PendingCollection& collection = pending.back();
+    collection.staging.resize(size);
+    if (mode == ACCUMULATE_ON_DEVICE){
+        cl_event copyEvent;
+        status = clEnqueueCopyBuffer(queue, buffer, snapshots[nextSnapshot], 0, 0, size, numEventsInWaitList, eventWaitList, &copyEvent);
+        if (status == CL_SUCCESS){
+            status = clEnqueueReadBuffer(queue, snapshots[nextSnapshot], CL_FALSE, 0, size, collection.staging.data(), 1, &copyEvent, &collection.event);
+            clReleaseEvent(copyEvent);
+        }
+        nextSnapshot = 1 - nextSnapshot;
+    } else {
+        status = clEnqueueReadBuffer(queue, buffer, CL_FALSE, 0, size, collection.staging.data(), numEventsInWaitList, eventWaitList, &collection.event);
+        if (status == CL_SUCCESS){
+            cl_int clearStatus = clearRecorders(1, &collection.event);
+            if (clearStatus != CL_SUCCESS){
+                clWaitForEvents(1, &collection.event);
+                clReleaseEvent(collection.event);
+                status = clearStatus;
+            }
+        }
+    }
+    if (status != CL_SUCCESS){
+        pending.pop_back();
+        return status;
+    }
+    clFlush(queue);
+    numCollections++;
+    return CL_SUCCESS;
+}
+
+cl_int CoverageSession::finish(){
+    if (mode == ACCUMULATE_ON_DEVICE){
+        cl_int status = collect();
+        if (status != CL_SUCCESS) return status;
+    }
+    return foldCompleted(true);
+}
+
+// Collections are folded in the order they were collected, so the trace is the one of the latest launch
+cl_int CoverageSession::foldCompleted(bool wait){
+    cl_int result = CL_SUCCESS;
+    while (!pending.empty()){
+        PendingCollection& collection = pending.front();
+        cl_int collectionStatus = CL_SUCCESS;
+        if (wait){
+            collectionStatus = clWaitForEvents(1, &collection.event);
+        } else {
+            cl_int eventStatus = CL_COMPLETE;
+            clGetEventInfo(collection.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(eventStatus), &eventStatus, NULL);
+            if (eventStatus > CL_COMPLETE) return result;
+            if (eventStatus < 0) collectionStatus = eventStatus;
+        }
+        // A failed read loses its launch, later ones are still folded
+        if (collectionStatus == CL_SUCCESS){
+            if (!profileEdges.empty()){
+                reconstructBlockCounts((unsigned int*)collection.staging.data(), profileEdges.data(), profileEdges.size());
+            }
+            fold(collection);
+        } else {
+            result = collectionStatus;
+        }
+        clReleaseEvent(collection.event);
+        pending.pop_front();
+    }
+    return result;
+}
+
+void CoverageSession::fold(const PendingCollection& collection){
+    for (auto& recorder : recorders){
+        const unsigned char* data = collection.staging.data() + recorder.offset;
+        for (size_t j = 0; j < recorder.numElements; j++){
+            cl_ulong value;
+            if (recorder.elementSize == sizeof(cl_ulong)){
+                memcpy(&value, data + j * sizeof(cl_ulong), sizeof(cl_ulong));
+            } else {
+                cl_uint word;
+                memcpy(&word, data + j * sizeof(cl_uint), sizeof(cl_uint));
+                value = word;
+            }
+            // On the device the value is already the total since the recorder was cleared
+            cl_ulong total;
+            switch (recorder.kind){
+                case BRANCH_RECORDER:
+                case BARRIER_RECORDER:
+                case HEATMAP_RECORDER:
+                    total = (mode == ACCUMULATE_ON_DEVICE ? recorder.base[j] : recorder.accumulated[j]) | value;
+                    recorder.delta[j] = total & ~recorder.accumulated[j];
+                    break;
+                case TRACE_RECORDER:
+                    total = value;
+                    recorder.delta[j] = value;
+                    break;
+                default:
+                    total = (mode == ACCUMULATE_ON_DEVICE ? recorder.base[j] : recorder.accumulated[j]) + value;
+                    recorder.delta[j] = total - recorder.accumulated[j];
+                    break;
+            }
+            recorder.accumulated[j] = total;
+        }
+    }
+}
+
+const std::vector<cl_ulong>* CoverageSession::getRecorder(RecorderKind kind) const{
+    for (auto& recorder : recorders){
+        if (recorder.kind == kind) return &recorder.accumulated;
+    }
+    return NULL;
+}
+
+const std::vector<cl_ulong>* CoverageSession::getDelta(RecorderKind kind) const{
+    for (auto& recorder : recorders){
+        if (recorder.kind == kind) return &recorder.delta;
+    }
+    return NULL;
+}
+
+void CoverageSession::report(FILE* output) const{
+    const std::vector<cl_ulong>* branches = getRecorder(BRANCH_RECORDER);
+    const std::vector<cl_ulong>* barrierFlags = getRecorder(BARRIER_RECORDER);
+    const std::vector<cl_ulong>* atomicCounters = getRecorder(ATOMIC_RECORDER);
+    const std::vector<cl_ulong>* blockCounters = getRecorder(BLOCK_RECORDER);
+    const std::vector<cl_ulong>* regionTimers = getRecorder(REGION_TIMER_RECORDER);
+    fprintf(output, "OpenCLBC report over %lu %s\n", (unsigned long)numCollections,
+        mode == ACCUMULATE_ON_DEVICE ? "snapshots of recorders accumulated on the device" : "launches");
+
+    int coveredBranches = 0;
+    if (branches){
+        fprintf(output, "\x1B[34mCondition coverage summary\x1B[0m\n");
+        for (size_t i = 0; i < conditions.size() && 2 * i + 1 < branches->size(); i++){
+            fprintf(output, "Condition ID: %lu\nSource code line: %s\nCondition: %s\n", (unsigned long)i,
+                conditions[i].sourceLine.c_str(), conditions[i].text.c_str());
+            if (conditions[i].probe == "uniform"){
+                fprintf(output, "Uniform over work-groups, recorded by one work-item of each\n");
+            }
+            for (int side = 0; side < 2; side++){
+                const char* name = side ? "False" : "True";
+                if ((*branches)[2 * i + side]){
+                    fprintf(output, "\x1B[32m%s branch covered\x1B[0m\n", name);
+                    coveredBranches++;
+                } else if (conditions[i].coveredBefore == "both" || conditions[i].coveredBefore == (side ? "false" : "true")){
+                    fprintf(output, "\x1B[32m%s branch covered in a previous run\x1B[0m\n", name);
+                    coveredBranches++;
+                } else {
+                    fprintf(output, "\x1B[31m%s branch not covered\x1B[0m\n", name);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < constantConditions.size(); i++){
+        bool alwaysTrue = constantConditions[i].probe == "constant true";
+        fprintf(output, "Constant condition ID: %lu\nSource code line: %s\nCondition: %s\n", (unsigned long)i,
+            constantConditions[i].sourceLine.c_str(), constantConditions[i].text.c_str());
+        fprintf(output, "Always %s, the %s branch is never taken\n", alwaysTrue ? "true" : "false", alwaysTrue ? "false" : "true");
+    }
+    int faultyBarriers = 0;
+    if (barrierFlags){
+        for (size_t i = 0; i < barriers.size() && i < barrierFlags->size(); i++){
+            fprintf(output, "Barrier ID: %lu\nSource code line: %s\n", (unsigned long)i, barriers[i].sourceLine.c_str());
+            if (barriers[i].probe == "proven"){
+                fprintf(output, "\x1B[32mThis barrier is proven free of divergence\x1B[0m\n");
+            } else if ((*barrierFlags)[i]){
+                fprintf(output, "\x1B[31mThis barrier has got a divergence\x1B[0m\n");
+                faultyBarriers++;
+            } else {
+                fprintf(output, "\x1B[32mThis barrier worked fine\x1B[0m\n");
+            }
+        }
+    }
+    if (atomicCounters){
+        fprintf(output, "\x1B[34mAtomic contention summary\x1B[0m\n");
+        for (size_t i = 0; i < atomics.size() && 2 * i + 1 < atomicCounters->size(); i++){
+            fprintf(output, "Atomic ID: %lu\nSource code line: %s\nAtomic: %s\n", (unsigned long)i,
+                atomics[i].sourceLine.c_str(), atomics[i].text.c_str());
+            cl_ulong executions = (*atomicCounters)[2 * i], contended = (*atomicCounters)[2 * i + 1];
+            if (executions){
+                fprintf(output, "Executions: %llu, contended: %llu, contention rate: %-4.2f\n", (unsigned long long)executions,
+                    (unsigned long long)contended, (double)contended / (double)executions * 100.0);
+            } else {
+                fprintf(output, "\x1B[31mThis atomic was never executed\x1B[0m\n");
+            }
+        }
+    }
+    if (blockCounters){
+        // Functions in order of appearance, followed by the whole kernel
+        std::vector<std::string> functionNames;
+        std::map<std::string, size_t> functionIds;
+        for (auto& block : blocks){
+            if (functionIds.find(block.text) == functionIds.end()){
+                functionIds[block.text] = functionNames.size();
+                functionNames.push_back(block.text);
+            }
+        }
+        functionNames.push_back("Total");
+        std::vector<std::vector<double> > totals(functionNames.size(), std::vector<double>(5, 0.0));
+        for (size_t i = 0; i < blocks.size() && i < blockCounters->size(); i++){
+            for (int w = 0; w < 5; w++){
+                double cost = (double)(*blockCounters)[i] * blocks[i].weight[w];
+                totals[functionIds[blocks[i].text]][w] += cost;
+                totals.back()[w] += cost;
+            }
+        }
+        fprintf(output, "\x1B[34mRoofline summary\x1B[0m\n");
+        for (size_t f = 0; f < functionNames.size(); f++){
+            const std::vector<double>& total = totals[f];
+            double globalBytes = total[0] + total[1];
+            double localBytes = total[2] + total[3];
+            fprintf(output, "%s: global %.0f bytes (load %.0f, store %.0f), local %.0f bytes, %.0f flops\n",
+                functionNames[f].c_str(), globalBytes, total[0], total[1], localBytes, total[4]);
+            fprintf(output, "  Arithmetic intensity: %.4f flops/global byte, %.4f flops/byte including local memory\n",
+                globalBytes ? total[4] / globalBytes : 0.0,
+                (globalBytes + localBytes) ? total[4] / (globalBytes + localBytes) : 0.0);
+        }
+    }
+    if (regionTimers){
+        // Shares are relative to the time spent in kernel bodies, summed over all work-items
+        fprintf(output, "\x1B[34mRegion time summary\x1B[0m\n");
+        double kernelTime = 0.0;
+        for (size_t i = 0; i < regions.size() && i < regionTimers->size(); i++){
+            if (regions[i].text.compare(0, 7, "kernel ") == 0) kernelTime += (double)(*regionTimers)[i];
+        }
+        for (size_t i = 0; i < regions.size() && i < regionTimers->size(); i++){
+            fprintf(output, "%s: %llu ticks (%.2f%% of kernel time)\n", regions[i].text.c_str(),
+                (unsigned long long)(*regionTimers)[i], kernelTime ? (double)(*regionTimers)[i] / kernelTime * 100.0 : 0.0);
+        }
+    }
+    if (branches && !conditions.empty()){
+        fprintf(output, "Total branch coverage: %-4.2f\n", (double)coveredBranches / (double)(conditions.size() * 2) * 100.0);
+    }
+    if (barrierFlags && !barriers.empty()){
+        fprintf(output, "Faulty barrier rate: %-4.2f\n", (double)faultyBarriers / (double)barriers.size() * 100.0);
+    }
+}
+
+bool CoverageSession::writeTrace(const std::string& path, cl_uint numSlots, cl_uint capacity, cl_uint groupStride) const{
+    const std::vector<cl_ulong>* trace = getRecorder(TRACE_RECORDER);
+    if (!trace) return false;
+    FILE* traceFile = fopen(path.c_str(), "wb");
+    if (!traceFile) return false;
+    std::vector<cl_uint> words;
+    words.reserve(4 + trace->size());
+    words.push_back(trace_format::FILE_MAGIC);
+    words.push_back(numSlots);
+    words.push_back(capacity);
+    words.push_back(groupStride);
+    words.insert(words.end(), trace->begin(), trace->end());
+    bool written = fwrite(words.data(), sizeof(cl_uint), words.size(), traceFile) == words.size();
+    fclose(traceFile);
+    return written;
+}
+
+bool CoverageSession::writeHeatmap(const std::string& path) const{
+    const std::vector<cl_ulong>* heatmap = getRecorder(HEATMAP_RECORDER);
+    if (!heatmap) return false;
+    FILE* heatmapFile = fopen(path.c_str(), "wb");
+    if (!heatmapFile) return false;
+    std::vector<cl_uint> words;
+    words.reserve(2 + heatmap->size());
+    words.push_back(heatmap_format::FILE_MAGIC);
+    words.push_back(conditions.size());
+    words.insert(words.end(), heatmap->begin(), heatmap->end());
+    bool written = fwrite(words.data(), sizeof(cl_uint), words.size(), heatmapFile) == words.size();
+    fclose(heatmapFile);
+    return written;
+}
+
+// Accumulated recorders as an instrumentation buffer, 32-bit counters saturated
+std::vector<cl_uint> CoverageSession::packRecorders() const{
+    std::vector<cl_uint> words(layout.totalWords, 0);
+    layout.writeHeader(words.data());
+    for (auto& recorder : recorders){
+        cl_uint* data = words.data() + recorder.offset / sizeof(cl_uint);
+        for (size_t j = 0; j < recorder.numElements; j++){
+            cl_ulong value = recorder.accumulated[j];
+            if (recorder.elementSize == sizeof(cl_ulong)){
+                data[2 * j] = (cl_uint)value;
+                data[2 * j + 1] = (cl_uint)(value >> 32);
+            } else {
+                data[j] = value > 0xffffffffull ? 0xffffffffu : (cl_uint)value;
+            }
+        }
+    }
+    return words;
+}
+
+bool CoverageSession::writeDump(const std::string& pathPrefix) const{
+    return writeCoverageDump(dumpFileName(pathPrefix), kernelHash, layout.wideKinds(), packRecorders().data());
+}
+
+bool CoverageSession::accumulateDump(const std::string& path) const{
+    return accumulateCoverageDump(path, kernelHash, layout.wideKinds(), packRecorders().data());
+}
+
+}
@@ -0,0 +1,166 @@
+#ifndef OPENCLBC_RUNTIME_COVERAGE_SESSION_H
+#define OPENCLBC_RUNTIME_COVERAGE_SESSION_H
+
+// Host-side runtime for kernels rewritten by openclbc.
+// A CoverageSession owns the instrumentation buffer appended to the kernel parameters, clears it on the device,
+// reads them back without blocking the command queue, accumulates them over any number of launches and
+// prints the report from the .dat file, which is loaded once when the session is created.
+//
+// Typical use, as printed in hostcode.txt:
+//     openclbc::CoverageSession session(context, queue, "kernel.cl.dat");
+//     session.addRecorder(openclbc::BRANCH_RECORDER, 8);
+//     session.attach(kernel, 3);
+//     for (...) { clEnqueueNDRangeKernel(queue, kernel, ...); session.collect(); }
+//     session.finish();
+//     session.report();
+//
+// The command queue is expected to be in-order: recorders are cleared and read back in the order of the
+// launches they belong to.
+//
+// With ACCUMULATE_ON_DEVICE (kernels rewritten with accumulate_launches: true) the recorders are cleared once
+// and keep accumulating over all launches. collect() is then only needed for periodic results: it copies the
+// instrumentation buffer into one of two snapshot buffers on the device and reads the snapshot back while the next launches
+// run, and finish() takes the final snapshot.
+
+#include <cstdio>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "../src/RecorderLayout.h"
+#include "EdgeProfile.h"
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+namespace openclbc{
+
+// Recorders in the order the rewriter packs them into the instrumentation buffer
+enum RecorderKind{
+    BRANCH_RECORDER = recorder_layout::BRANCH,              // int per branch, set when the branch was taken
+    BARRIER_RECORDER = recorder_layout::BARRIER,            // int per barrier, set when the barrier was divergent
+    ATOMIC_RECORDER = recorder_layout::ATOMIC,              // int pair per atomic call site: executions and contended executions, ulong on the device
+    BLOCK_RECORDER = recorder_layout::BLOCK,                // ulong per block: executions
+    TRACE_RECORDER = recorder_layout::TRACE,                // uint words of the event trace
+    HEATMAP_RECORDER = recorder_layout::HEATMAP,            // uint words of the divergence heatmap
+    REGION_TIMER_RECORDER = recorder_layout::REGION_TIMER   // ulong per region: elapsed ticks
+};
+
+enum AccumulationMode{
+    ACCUMULATE_ON_HOST,     // Read back and clear after every launch
+    ACCUMULATE_ON_DEVICE    // Recorders stay resident, only snapshots are read back
+};
+
+// What the .dat file tells about one condition, barrier, atomic call site, block or region
+struct ProbeInfo{
+    std::string sourceLine;
+    std::string text;       // Condition, atomic builtin, function of a block or name of a region
+    double weight[5];       // Blocks only: global load/store bytes, local load/store bytes, flops
+    std::string probe;      // How the probe was simplified, e.g. "uniform"; empty if it was not
+    std::string coveredBefore;  // Conditions only: "true", "false" or "both" sides covered in a previous run, not probed
+};
+
+class CoverageSession{
+public:
+    CoverageSession(cl_context context, cl_command_queue queue, const std::string& dataFilePath,
+        AccumulationMode mode = ACCUMULATE_ON_HOST);
+    ~CoverageSession();
+
+    // Recorders have to be added in the order of RecorderKind, skipping those the kernel does not have
+    cl_int addRecorder(RecorderKind kind, size_t numElements);
+
+    // Set the instrumentation buffer as the argument added to an instrumented kernel.
+    // The first call creates the buffer, writes its layout header and clears the recorders.
+    cl_int attach(cl_kernel kernel, cl_uint argumentIndex);
+
+    // Clear all recorders on the device, discarding whatever the last launches recorded
+    cl_int reset();
+
+    // Read back what the launches enqueued so far recorded: on the host, the recorders are then cleared for the
+    // next launches; on the device, a snapshot is taken.
+    // Nothing waits here: results are folded in when the reads complete, at the latest in finish().
+    cl_int collect(cl_uint numEventsInWaitList = 0, const cl_event* eventWaitList = NULL);
+
+    // Wait for outstanding reads and fold them in. On the device, a final snapshot is collected first.
+    cl_int finish();
+
+    // Accumulated values of a recorder, NULL if the kernel has none of this kind.
+    // Flags are ORed, counters and timers summed, the trace is the one of the last collected launch.
+    const std::vector<cl_ulong>* getRecorder(RecorderKind kind) const;
+
+    // What the last folded collection added: counts since the previous one, flags set for the first time
+    const std::vector<cl_ulong>* getDelta(RecorderKind kind) const;
+
+    void report(FILE* output = stdout) const;
+
+    // Files read by openclbc-trace2json and openclbc-heatmap
+    bool writeTrace(const std::string& path, cl_uint numSlots, cl_uint capacity, cl_uint groupStride) const;
+    bool writeHeatmap(const std::string& path) const;
+
+    // Binary dump of the accumulated recorders for openclbc-merge, named after the prefix, the process and
+    // the number of dumps. 32-bit counters saturate.
+    bool writeDump(const std::string& pathPrefix) const;
+
+    // Merge the accumulated recorders into a per-kernel accumulation file shared by concurrent processes,
+    // see accumulateCoverageDump
+    bool accumulateDump(const std::string& path) const;
+
+    size_t getNumCollections() const { return numCollections; }
+
+private:
+    struct Recorder{
+        RecorderKind kind;
+        size_t numElements;
+        size_t elementSize;
+        size_t offset;                      // In bytes from the start of the instrumentation buffer
+        std::vector<cl_ulong> accumulated;
+        std::vector<cl_ulong> delta;
+        std::vector<cl_ulong> base;         // On the device only: accumulated when the recorder was last cleared
+    };
+    struct PendingCollection{
+        cl_event event;
+        std::vector<unsigned char> staging;
+    };
+
+    cl_context context;
+    cl_command_queue queue;
+    AccumulationMode mode;
+    RecorderLayout layout;
+    std::vector<cl_uint> header;
+    cl_mem buffer;                          // NULL until the first attach
+    cl_mem snapshots[2];                    // On the device only
+    std::vector<Recorder> recorders;
+    std::list<PendingCollection> pending;
+    size_t numCollections;
+    int nextSnapshot;
+
+    std::vector<ProbeInfo> conditions;
+    std::vector<ProbeInfo> constantConditions;  // Not instrumented, probe is "constant true" or "constant false"
+    std::vector<ProbeInfo> barriers;
+    std::vector<ProbeInfo> atomics;
+    std::vector<ProbeInfo> blocks;
+    std::vector<ProbeInfo> regions;
+    std::vector<ProfileEdge> profileEdges;      // Per block, empty unless the kernel was rewritten with edge_profiling
+    unsigned long long kernelHash;
+
+    CoverageSession(const CoverageSession&);
+    CoverageSession& operator=(const CoverageSession&);
+
+    void loadMetadata(const std::string& dataFilePath);
+    cl_int allocate();
+    cl_int clearRecorders(cl_uint numEventsInWaitList, const cl_event* eventWaitList);
+    cl_int foldCompleted(bool wait);
+    cl_int enqueueSnapshot(PendingCollection& collection, cl_uint numEventsInWaitList, const cl_event* eventWaitList);
+    void fold(const PendingCollection& collection);
+    std::vector<cl_uint> packRecorders() const;
+};
+
+}
+
+#endif
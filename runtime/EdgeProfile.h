@@ -0,0 +1,88 @@
+#ifndef OPENCLBC_RUNTIME_EDGE_PROFILE_H
+#define OPENCLBC_RUNTIME_EDGE_PROFILE_H
+
+// Block counts of kernels rewritten with edge_profiling. Every block is an edge of the control flow graph of
+// its function, and only the blocks off a spanning tree of each graph are counted on the device. The others
+// follow from flow conservation, and both sides of every condition are covered when their blocks ran:
+//     openclbc::reconstructBlockCounts(buffer, openclbc_metadata::yourkernelfile_cl::profileEdges(),
+//         openclbc_metadata::yourkernelfile_cl::numBlocks);
+// The generated host code, openclbc::CoverageSession and the fuzzing tools do this before anything reads the
+// buffer, so dumps always hold every count.
+
+#include <algorithm>
+#include <vector>
+
+#include "../src/Constants.h"
+
+namespace openclbc{
+
+// Edge standing for a block, as written in the .dat file
+struct ProfileEdge{
+    int from;           // Node of the graph of the function, -1 if the block is in no graph
+    int to;
+    int branch;         // Branch this block is the side of (2 * condition ID, + 1 for else), -1 if none
+    bool counted;       // Counted on the device
+};
+
+// buffer is the host copy of the instrumentation buffer, starting with its layout header; edge i is block i
+inline void reconstructBlockCounts(unsigned int* buffer, const ProfileEdge* edges, unsigned int numEdges){
+    if (!edges || buffer[0] != recorder_layout::MAGIC) return;
+    numEdges = std::min(numEdges, buffer[3 + 2 * recorder_layout::BLOCK]);
+    unsigned long long* counts = (unsigned long long*)(buffer + buffer[2 + 2 * recorder_layout::BLOCK]);
+
+    // Derived edges are the edges of a tree: peel it from its leaves, where one edge is left to find
+    int numNodes = 0;
+    for (unsigned int i = 0; i < numEdges; i++){
+        if (edges[i].from >= 0) numNodes = std::max(numNodes, std::max(edges[i].from, edges[i].to) + 1);
+    }
+    std::vector<long long> balance(numNodes, 0);   // Known flow entering the node minus known flow leaving it
+    std::vector<std::vector<unsigned int> > unknown(numNodes);
+    std::vector<unsigned int> numUnknown(numNodes, 0);
+    std::vector<bool> derived(numEdges, false);
+    for (unsigned int i = 0; i < numEdges; i++){
+        const ProfileEdge& edge = edges[i];
+        if (edge.from < 0) continue;
+        if (edge.counted || edge.from == edge.to){
+            balance[edge.to] += counts[i];
+            balance[edge.from] -= counts[i];
+        } else {
+            derived[i] = true;
+            unknown[edge.from].push_back(i);
+            unknown[edge.to].push_back(i);
+            numUnknown[edge.from]++;
+            numUnknown[edge.to]++;
+        }
+    }
+    std::vector<int> leaves;
+    for (int node = 0; node < numNodes; node++){
+        if (numUnknown[node] == 1) leaves.push_back(node);
+    }
+    while (!leaves.empty()){
+        int node = leaves.back();
+        leaves.pop_back();
+        if (numUnknown[node] != 1) continue;
+        for (unsigned int i : unknown[node]){
+            if (!derived[i]) continue;
+            const ProfileEdge& edge = edges[i];
+            long long count = edge.to == node ? -balance[node] : balance[node];
+            if (count < 0) count = 0;   // Only when counts of different runs were mixed
+            counts[i] = count;
+            derived[i] = false;
+            balance[edge.to] += count;
+            balance[edge.from] -= count;
+            if (--numUnknown[edge.from] == 1) leaves.push_back(edge.from);
+            if (--numUnknown[edge.to] == 1) leaves.push_back(edge.to);
+            break;
+        }
+    }
+
+    int* branches = (int*)(buffer + buffer[2 + 2 * recorder_layout::BRANCH]);
+    int numBranches = buffer[3 + 2 * recorder_layout::BRANCH];
+    for (unsigned int i = 0; i < numEdges; i++){
+        if (edges[i].branch >= 0 && edges[i].branch < numBranches && counts[i]) branches[edges[i].branch] = 1;
+    }
+}
+
+}
+
+#endif
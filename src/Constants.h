@@ -9,6 +9,8 @@ namespace kernel_rewriter_constants{
     const char* const FAKE_HEADER_MACRO = "OPENCLBC_FAKE_HEADER_FOR_LIBTOOLING_";
     const char* const NEW_BARRIER_MACRO = "#define OCL_NEW_BARRIER(barrierid,arg)\\\n"\
         "{\\\n"\
+        "  OCL_TRACE_EVENT(OCL_TRACE_BARRIER_ENTRY | (barrierid));\\\n"\
+        "  OCL_TIMER_BARRIER_ENTRY(barrierid);\\\n"\
         "  atom_inc(&ocl_kernel_barrier_count[barrierid]);\\\n"\
         "  barrier(arg);\\\n"\
         "  if (ocl_kernel_barrier_count[barrierid]!=ocl_get_general_size()) {\\\n"\
@@ -17,14 +19,111 @@ namespace kernel_rewriter_constants{
         "  barrier(arg);\\\n"\
         "  ocl_kernel_barrier_count[barrierid]=0;\\\n"\
         "  barrier(arg);\\\n"\
-        "}\n"\
-        "int ocl_get_general_size(){\n"\
-        "  int result = 1;\\\n"\
+        "  OCL_TIMER_BARRIER_EXIT(barrierid);\\\n"\
+        "  OCL_TRACE_EVENT(OCL_TRACE_BARRIER_EXIT | (barrierid));\\\n"\
+        "}\n";
+    // Barriers proven free of divergence are not counted; they keep their trace events and timers, if any
+    const char* const PROVEN_BARRIER_MACRO = "#define OCL_PROVEN_BARRIER(barrierid,arg)\\\n"\
+        "{\\\n"\
+        "  OCL_TRACE_EVENT(OCL_TRACE_BARRIER_ENTRY | (barrierid));\\\n"\
+        "  OCL_TIMER_BARRIER_ENTRY(barrierid);\\\n"\
+        "  barrier(arg);\\\n"\
+        "  OCL_TIMER_BARRIER_EXIT(barrierid);\\\n"\
+        "  OCL_TRACE_EVENT(OCL_TRACE_BARRIER_EXIT | (barrierid));\\\n"\
+        "}\n";
+    const char* const WORK_ITEM_HELPERS = "int ocl_get_general_size(){\n"\
+        "  int result = 1;\n"\
         "  for (int i=0; i<get_work_dim(); i++){\n"\
         "    result*=get_local_size(i);\n"\
         "  }\n"\
         "  return result;\n"\
+        "}\n"\
+        "int ocl_get_local_linear_id(){\n"\
+        "  return (get_local_id(2) * get_local_size(1) + get_local_id(1)) * get_local_size(0) + get_local_id(0);\n"\
         "}\n";
+    // Atomic contention profiling
+    // Each call site owns two counters: [2*siteid] executions and [2*siteid+1] contended executions.
+    // An execution is contended when the previous work-item of the same work-group that went through
+    // this call site targeted the same address. The probe is given the slot of the call site in the
+    // __local recorders of the kernel, see RecorderSlots, and a probe function per pointer type wraps the address.
+    const char* const LOCAL_ATOMIC_ADDRESS_TABLE_NAME = "ocl_atomic_last_address";
+    const char* const LOCAL_ATOMIC_COUNTER_NAME = "my_ocl_atomic_contention_recorder";
+    const char* const GLOBAL_ATOMIC_COUNTER_NAME = "ocl_atomic_contention_recorder";
+    // Roofline profiling: executions of each block, counted per work-group in 32 bits and summed in 64 bits
+    const char* const LOCAL_BLOCK_COUNTER_NAME = "my_ocl_block_execution_recorder";
+    const char* const GLOBAL_BLOCK_COUNTER_NAME = "ocl_block_execution_recorder";
+    const char* const INT64_ATOMICS_PRAGMA = "#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable\n";
+    // Event tracing: see trace_format for the layout of the buffer
+    const char* const GLOBAL_TRACE_BUFFER_NAME = "ocl_trace_buffer";
+    const char* const TRACE_EVENT_KINDS = "#define OCL_TRACE_BARRIER_ENTRY 0x40000000u\n"\
+        "#define OCL_TRACE_BARRIER_EXIT 0x80000000u\n";
+    const char* const NO_TRACE_EVENT_MACRO = "#define OCL_TRACE_EVENT(event)\n";
+    // Divergence heatmap: see heatmap_format for the layout of the buffer
+    const char* const GLOBAL_HEATMAP_NAME = "ocl_divergence_heatmap";
+    // Region timers: elapsed timestamps per region, accumulated per work-group and summed in global memory
+    const char* const LOCAL_REGION_TIMER_NAME = "my_ocl_region_timer";
+    const char* const GLOBAL_REGION_TIMER_NAME = "ocl_region_timer";
+    const char* const REGION_BEGIN_VARIABLE = "ocl_region_begin";
+    const char* const SEGMENT_BEGIN_VARIABLE = "ocl_segment_begin";
+    const char* const RETURN_VALUE_VARIABLE = "ocl_return_value";
+    const char* const NO_TIMER_BARRIER_MACROS = "#define OCL_TIMER_BARRIER_ENTRY(barrierid)\n"\
+        "#define OCL_TIMER_BARRIER_EXIT(barrierid)\n";
+    // Single buffer carrying every recorder, see recorder_layout
+    const char* const GLOBAL_INSTRUMENTATION_BUFFER_NAME = "ocl_instrumentation_buffer";
+    // OpenCL C 2.0 targets: the recorders of a kernel, passed to helper functions as one pointer
+    const char* const RECORDER_CONTEXT_TYPE = "ocl_recorder_context";
+    const char* const RECORDER_CONTEXT_NAME = "ocl_recorders";
+}
+
+// Layout of the divergence heatmap buffer and of the .heatmap file the host code writes from it
+// File: magic, number of conditions, then the buffer
+// Buffer: number of work-groups in dimensions 0, 1 and 2, number of bins,
+//   then one bitmap of bins bits for each branch (2 * condition ID for true, 2 * condition ID + 1 for false)
+// Bit b of a bitmap is set when a work-group of bin b took the branch. Work-groups are binned by linear ID,
+// one bin per work-group when there are no more work-groups than bins.
+namespace heatmap_format{
+    const unsigned int FILE_MAGIC = 0x4d48434f; // "OCHM"
+    const unsigned int HEADER_WORDS = 4;
+}
+
+// Layout of the trace buffer and of the .trace file the host code writes from it
+// File: magic, number of slots, slot capacity, work-group stride, then the buffer
+// Buffer: one slot per sampled work-group, each made of
+//   [0] number of events appended, [1] number of events dropped because the slot was full,
+//   then capacity events of EVENT_WORDS words: event, local linear ID of the work-item, sequence number
+// Event: branch probe ID, or barrier ID combined with BARRIER_ENTRY / BARRIER_EXIT
+namespace trace_format{
+    const unsigned int FILE_MAGIC = 0x5442434f; // "OCBT"
+    const unsigned int SLOT_HEADER_WORDS = 2;
+    const unsigned int EVENT_WORDS = 3;
+    const unsigned int BARRIER_ENTRY = 0x40000000u;
+    const unsigned int BARRIER_EXIT = 0x80000000u;
+    const unsigned int EVENT_ID_MASK = 0x3fffffffu;
+}
+
+// Layout of the instrumentation buffer, the only argument added to kernels
+// Buffer: 32-bit words, starting with a header of magic, total number of words, then for every recorder kind
+//   its offset in words and its number of elements (0 when the kernel has none).
+//   Recorders follow in the order of the kinds, 64-bit ones aligned to two words.
+namespace recorder_layout{
+    enum RecorderKind{
+        BRANCH, BARRIER, ATOMIC, BLOCK, TRACE, HEATMAP, REGION_TIMER, NUM_KINDS
+    };
+    const unsigned int MAGIC = 0x4c52434f; // "OCRL"
+    const unsigned int HEADER_WORDS = 2 + 2 * NUM_KINDS;
+}
+
+// Binary coverage dump written by the host after a run, merged by openclbc-merge
+// File: magic, version, kernel hash (low word first), bitmask of recorder kinds with 64-bit elements,
+//   number of words of the instrumentation buffer, then the buffer with its layout header
+// The kernel hash is FNV-1a over the kernel source and the layout header, so dumps of different kernels
+// or of different instrumentation settings are never merged.
+namespace dump_format{
+    const unsigned int FILE_MAGIC = 0x4442434f; // "OCBD"
+    const unsigned int VERSION = 1;
+    const unsigned int HEADER_WORDS = 6;
+    const unsigned long long FNV_OFFSET_BASIS = 0xcbf29ce484222325ull;
+    const unsigned long long FNV_PRIME = 0x100000001b3ull;
 }
 
 namespace error_code{
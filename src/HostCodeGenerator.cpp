@@ -1,7 +1,9 @@
+#include <cctype>
 #include <sstream>
 #include <string>
 #include <map>
 #include <iostream>
+#include <vector>
 
 #include "HostCodeGenerator.h"
 #include "Constants.h"
@@ -11,125 +13,235 @@ HostCodeGenerator::HostCodeGenerator(){
     setArgumentPartHostCode << "Part 2 - set argument to kernel function\n";
 }
 
-void HostCodeGenerator::initialise(UserConfig* userConfig, int newNumConditions, int newNumBarriers){
+void HostCodeGenerator::initialise(UserConfig* userConfig, int newNumConditions, int newNumBarriers, int newNumAtomics, int newNumBlocks){
+    // Prefix of the host arrays, which are shared by all kernels of the file
     kernelFunctionName = userConfig->getValue("kernel_function_name");
+    if (kernelFunctionName.empty()) kernelFunctionName = "openclbc";
     branchRecorderArrayName = kernelFunctionName + "_branch_coverage_recorder";
     barrierRecorderArrayName = kernelFunctionName + "_barrier_divergence_recorder";
+    atomicRecorderArrayName = kernelFunctionName + "_atomic_contention_recorder";
+    blockRecorderArrayName = kernelFunctionName + "_block_execution_recorder";
+    traceBufferArrayName = kernelFunctionName + "_trace_buffer";
+    heatmapArrayName = kernelFunctionName + "_divergence_heatmap";
+    regionTimerArrayName = kernelFunctionName + "_region_timer";
+    instrumentationArrayName = kernelFunctionName + "_instrumentation";
+    layoutHeaderArrayName = kernelFunctionName + "_layout_header";
     clContext = userConfig->getValue("cl_context");
     errorCodeVariable = userConfig->getValue("error_code_variable");
     clCommandQueue = userConfig->getValue("cl_command_queue");
     numConditions = newNumConditions;
     numBarriers = newNumBarriers;
+    numAtomics = newNumAtomics;
+    numBlocks = newNumBlocks;
+    numTraceWords = 0;
+    numHeatmapWords = 0;
+    useRuntime = userConfig->isEnabled("host_runtime");
+    accumulateLaunches = userConfig->isEnabled("accumulate_launches");
+    edgeProfiling = userConfig->isEnabled("roofline") && userConfig->isEnabled("edge_profiling");
+    atomicCounterType = accumulateLaunches ? "cl_ulong" : "int";
+    accumulationFilePath = userConfig->getValue("accumulation_file");
 }
 
-void HostCodeGenerator::setArgument(std::string functionName, int argumentLocation){
-    if(numConditions){
-        setArgumentPartHostCode 
-            << errorCodeVariable << " = clSetKernelArg(" << functionName << ", " << argumentLocation++ << ", sizeof(cl_mem), &d_" << branchRecorderArrayName << ");\n";
+void HostCodeGenerator::setTrace(int newTraceSlots, int newTraceCapacity, int newTraceGroupStride){
+    traceSlots = newTraceSlots;
+    traceCapacity = newTraceCapacity;
+    traceGroupStride = newTraceGroupStride;
+    numTraceWords = traceSlots * (trace_format::SLOT_HEADER_WORDS + trace_format::EVENT_WORDS * traceCapacity);
+}
+
+void HostCodeGenerator::setHeatmap(int heatmapBins){
+    numHeatmapWords = heatmap_format::HEADER_WORDS + numConditions * 2 * ((heatmapBins + 31) / 32);
+}
+
+void HostCodeGenerator::setRegions(std::map<int, std::string> newRegionNames){
+    regionNames = newRegionNames;
+}
+
+void HostCodeGenerator::setLayout(const RecorderLayout& newLayout){
+    layout = newLayout;
+}
+
+void HostCodeGenerator::setArgument(std::string functionName, int argumentLocation, int localRecorderBytes){
+    if (localRecorderBytes){
+        setArgumentPartHostCode << "// " << functionName << " uses " << localRecorderBytes << " bytes of __local memory for its recorders\n";
     }
-    if(numBarriers){
-        setArgumentPartHostCode 
-            << errorCodeVariable << " = clSetKernelArg(" << functionName << ", " << argumentLocation << ", sizeof(cl_mem), &d_" << barrierRecorderArrayName << ");\n";
+    if (useRuntime){
+        setArgumentPartHostCode
+            << errorCodeVariable << " = openclbc_session.attach(" << functionName << ", " << argumentLocation << ");\n";
+        return;
     }
+    setArgumentPartHostCode 
+        << errorCodeVariable << " = clSetKernelArg(" << functionName << ", " << argumentLocation << ", sizeof(cl_mem), &d_" << instrumentationArrayName << ");\n";
+}
+
+// Typed view of one recorder in the host copy of the instrumentation buffer
+void HostCodeGenerator::declRecorderView(recorder_layout::RecorderKind kind, std::string type, std::string name){
+    if (!layout.has(kind)) return;
+    generatedHostCode << type << " *" << name << " = (" << type << "*)(" << instrumentationArrayName << " + " << layout.offset[kind] << ");\n";
 }
 
 void HostCodeGenerator::generateHostCode(std::string dataFilePath){
+    if (useRuntime){
+        generateRuntimeHostCode(dataFilePath);
+        return;
+    }
     // Introduction
     generatedHostCode << "Generated host code as following can be used as a guide line to "
         << "initialise and manage data elements for checking code coverage and print out the "
         << "coverage report. Please use it as a reference \n\n";
 
-    // Host code part 1 - declare branch coverage recorder array
-    generatedHostCode << "Part 1: recorder array declaration\n";
-    if (numConditions){
-        generatedHostCode << "int " << branchRecorderArrayName << "[" << numConditions*2 << "] = {0};\n" // Branch coverage checker
-            << "cl_mem d_" << branchRecorderArrayName << " = clCreateBuffer(" << clContext << ", CL_MEM_READ_WRITE, sizeof(int)*" << numConditions*2 << ", NULL, &" << errorCodeVariable << ");\n"
-            << errorCodeVariable << " = clEnqueueWriteBuffer(" << clCommandQueue << ", d_" << branchRecorderArrayName << ", CL_TRUE, 0, " << numConditions*2 << "*sizeof(int)," << branchRecorderArrayName << ", 0, NULL ,NULL);\n\n";
-    }
-    if (numBarriers){
-        generatedHostCode << "int " << barrierRecorderArrayName << "[" << numBarriers << "] = {0};\n" // Barrier divergence checker
-            << "cl_mem d_" << barrierRecorderArrayName << " = clCreateBuffer(" << clContext << ", CL_MEM_READ_WRITE, sizeof(int)*" << numBarriers << ", NULL, &" << errorCodeVariable << ");\n"
-            << errorCodeVariable << " = clEnqueueWriteBuffer(" << clCommandQueue << ", d_" << barrierRecorderArrayName << ", CL_TRUE, 0, " << numBarriers << "*sizeof(int)," << barrierRecorderArrayName << ", 0, NULL ,NULL);\n\n";
+    // Host code part 0 - the metadata header declares namespaces and templates, so it cannot go in a function body
+    std::string filePathPrefix = dataFilePath.substr(0, dataFilePath.find_last_of('.'));
+    std::string headerFilePath = filePathPrefix + ".h";
+    generatedHostCode << "Part 0: at file scope\n"
+        << "#include \"" << headerFilePath << "\" // with runtime/ in the include path\n"
+        << "#include \"CoverageDump.h\"\n\n";
+
+    // Host code part 1 - declare the instrumentation buffer, whose header is the layout of the recorders
+    unsigned int header[recorder_layout::HEADER_WORDS];
+    layout.writeHeader(header);
+    generatedHostCode << "Part 1: instrumentation buffer declaration\n"
+        << "const cl_uint " << layoutHeaderArrayName << "[" << recorder_layout::HEADER_WORDS << "] = {";
+    for (unsigned int i = 0; i < recorder_layout::HEADER_WORDS; i++){
+        generatedHostCode << (i ? ", " : "") << header[i] << (i ? "" : "u");
     }
+    generatedHostCode << "};\n"
+        << "cl_uint *" << instrumentationArrayName << " = (cl_uint*)calloc(" << layout.totalWords << ", sizeof(cl_uint));\n"
+        << "memcpy(" << instrumentationArrayName << ", " << layoutHeaderArrayName << ", sizeof(" << layoutHeaderArrayName << "));\n"
+        << "cl_mem d_" << instrumentationArrayName << " = clCreateBuffer(" << clContext << ", CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(cl_uint)*" << layout.totalWords << ", " << instrumentationArrayName << ", &" << errorCodeVariable << ");\n";
+    declRecorderView(recorder_layout::BRANCH, "int", branchRecorderArrayName); // Branch coverage checker
+    declRecorderView(recorder_layout::BARRIER, "int", barrierRecorderArrayName); // Barrier divergence checker
+    declRecorderView(recorder_layout::ATOMIC, atomicCounterType, atomicRecorderArrayName); // Atomic contention counters
+    declRecorderView(recorder_layout::BLOCK, "cl_ulong", blockRecorderArrayName); // Block execution counters
+    declRecorderView(recorder_layout::TRACE, "cl_uint", traceBufferArrayName); // Event trace
+    declRecorderView(recorder_layout::HEATMAP, "cl_uint", heatmapArrayName); // Divergence heatmap
+    declRecorderView(recorder_layout::REGION_TIMER, "cl_ulong", regionTimerArrayName); // Region timers
+    generatedHostCode << "\n";
+
     // Host code part 2 - set argument to kernel function
     generatedHostCode << setArgumentPartHostCode.str() << "\n";
 
     // Host code part 3 - get data back from GPU
-    generatedHostCode << "Part 3: get back from GPU\n";
-    if (numConditions){
+    if (accumulateLaunches){
+        // Recorders are initialised once in part 1 and accumulate over every launch until they are read back
+        generatedHostCode << "Part 3: get back from GPU once, after the last launch of the kernel\n";
+    } else {
+        generatedHostCode << "Part 3: get back from GPU\n";
+    }
+    generatedHostCode
+        << errorCodeVariable << " = clEnqueueReadBuffer(" << clCommandQueue << ", d_" << instrumentationArrayName << ", CL_TRUE, 0, sizeof(cl_uint)*" << layout.totalWords << ", " << instrumentationArrayName << ", 0, NULL, NULL);\n\n";
+    if (numTraceWords){
+        // The trace is written as it is, openclbc-trace2json turns it into a timeline
+        std::string traceFilePath = dataFilePath.substr(0, dataFilePath.find_last_of('.')) + ".trace";
         generatedHostCode
-            << errorCodeVariable << " = clEnqueueReadBuffer(" << clCommandQueue << ", d_" << branchRecorderArrayName << ", CL_TRUE, 0, sizeof(int)*" << numConditions*2 << ", " << branchRecorderArrayName << ", 0, NULL, NULL);\n";
+            << "FILE *openclbc_trace_fp = fopen(\"" << traceFilePath << "\", \"wb\");\n"
+            << "if (openclbc_trace_fp){\n"
+            << "  cl_uint openclbc_trace_header[4] = {" << trace_format::FILE_MAGIC << "u, " << traceSlots << ", " << traceCapacity << ", " << traceGroupStride << "};\n"
+            << "  fwrite(openclbc_trace_header, sizeof(cl_uint), 4, openclbc_trace_fp);\n"
+            << "  fwrite(" << traceBufferArrayName << ", sizeof(cl_uint), " << numTraceWords << ", openclbc_trace_fp);\n"
+            << "  fclose(openclbc_trace_fp);\n"
+            << "}\n\n";
     }
-    if (numBarriers){
+    if (numHeatmapWords){
+        // Rendered by openclbc-heatmap
+        std::string heatmapFilePath = dataFilePath.substr(0, dataFilePath.find_last_of('.')) + ".heatmap";
         generatedHostCode
-            << errorCodeVariable << " = clEnqueueReadBuffer(" << clCommandQueue << ", d_" << barrierRecorderArrayName << ", CL_TRUE, 0, sizeof(int)*" << numBarriers << ", " << barrierRecorderArrayName << ", 0, NULL, NULL);\n\n";
+            << "FILE *openclbc_heatmap_fp = fopen(\"" << heatmapFilePath << "\", \"wb\");\n"
+            << "if (openclbc_heatmap_fp){\n"
+            << "  cl_uint openclbc_heatmap_header[2] = {" << heatmap_format::FILE_MAGIC << "u, " << numConditions << "};\n"
+            << "  fwrite(openclbc_heatmap_header, sizeof(cl_uint), 2, openclbc_heatmap_fp);\n"
+            << "  fwrite(" << heatmapArrayName << ", sizeof(cl_uint), " << numHeatmapWords << ", openclbc_heatmap_fp);\n"
+            << "  fclose(openclbc_heatmap_fp);\n"
+            << "}\n\n";
+    }
+    // Host code part 4 - print result from the metadata header included in part 0
+    generatedHostCode << "Part 4: print converage result\n";
+    if (edgeProfiling){
+        generatedHostCode << "openclbc::reconstructBlockCounts(" << instrumentationArrayName
+            << ", openclbc_metadata::" << metadataStructName(headerFilePath) << "::profileEdges(), openclbc_metadata::"
+            << metadataStructName(headerFilePath) << "::numBlocks);\n";
     }
+    generatedHostCode << "openclbc::reportCoverage<openclbc_metadata::" << metadataStructName(headerFilePath) << ">(" << instrumentationArrayName << ");\n"
+        << "openclbc::" << (accumulationFilePath.empty() ? "writeCoverageDump" : "accumulateCoverageDump")
+        << "<openclbc_metadata::" << metadataStructName(headerFilePath) << ">(\""
+        << (accumulationFilePath.empty() ? filePathPrefix : accumulationFilePath) << "\", " << instrumentationArrayName << ");\n"
+        << "free(" << instrumentationArrayName << ");\n\n";
+}
 
-    // Host code part 4 - print result
-    generatedHostCode << "Part 4: print converage result\n"
-        << "FILE *openclbc_fp;\n"
-        << "char *line = NULL;\n"
-        << "size_t len = 0;\n"
-        << "openclbc_fp = fopen(\"" << dataFilePath << "\", \"r\");\n"
-        << "if (!openclbc_fp){\n"
-        << "printf(\"OpenCLBC data file not found\\n\");\n"
-        << "}else{\n";
-    if (numConditions){
-        generatedHostCode 
-            << "int openclbc_total_branches = " << numConditions*2 << ", openclbc_covered_branches = 0;\n"
-            << "double openclbc_result;\n"
-            << "printf(\"\\x1B[34mCondition coverage summary\\x1B[0m\\n\");\n"
-            << "for (int cov_test_i = 0; cov_test_i < " << numConditions*2 << "; cov_test_i+=2){\n"
-            << "  getline(&line, &len, openclbc_fp);\n"
-            << "  printf(\"%s\", line);\n"
-            << "  getline(&line, &len, openclbc_fp);\n"
-            << "  printf(\"%s\", line);\n"
-            << "  getline(&line, &len, openclbc_fp);\n"
-            << "  printf(\"%s\", line);\n"
-            << "  if (" << branchRecorderArrayName << "[cov_test_i]) {\n" 
-            << "    printf(\"\\x1B[32mTrue branch covered\\x1B[0m\\n\");\n"
-            << "    openclbc_covered_branches++;\n"
-            << "  } else { \n"
-            << "    printf(\"\\x1B[31mTrue branch not covered\\x1B[0m\\n\");\n"
-            << "  }\n"
-            << "  if (" << branchRecorderArrayName << "[cov_test_i + 1]) {\n" 
-            << "    printf(\"\\x1B[32mFalse branch covered\\x1B[0m\\n\");\n"
-            << "    openclbc_covered_branches++;\n"
-            << "  } else { \n"
-            << "    printf(\"\\x1B[31mFalse branch not covered\\x1B[0m\\n\");\n"
-            << "  }\n"
-            << "}\n";
+// Name of the struct describing a kernel file in its metadata header
+std::string HostCodeGenerator::metadataStructName(std::string kernelFilePath){
+    std::string fileName = kernelFilePath.substr(kernelFilePath.find_last_of('/') + 1);
+    if (fileName.size() > 2 && fileName.compare(fileName.size() - 2, 2, ".h") == 0){
+        fileName = fileName.substr(0, fileName.size() - 2);
     }
-    if (numBarriers){
-        generatedHostCode
-            << "int openclbc_total_barriers = " << numBarriers << ", openclbc_faulty_barriers = 0;\n"
-            << "double openclbc_barrier_result;\n"
-            << "for (int cov_test_i = 0; cov_test_i < " << numBarriers << "; ++cov_test_i){\n"
-            << "  getline(&line, &len, openclbc_fp);\n"
-            << "  printf(\"%s\", line);\n"
-            << "  getline(&line, &len, openclbc_fp);\n"
-            << "  printf(\"%s\", line);\n"
-            << "  if (" << barrierRecorderArrayName << "[cov_test_i]) {\n" 
-            << "    printf(\"\\x1B[31mThis barrier has got a divergence\\x1B[0m\\n\");\n"
-            << "    ++openclbc_faulty_barriers;\n"
-            << "  } else { \n"
-            << "    printf(\"\\x1B[32mThis barrier worked fine\\x1B[0m\\n\");\n"
-            << "  }\n"
-            << "}\n";
+    std::string structName;
+    for (char c : fileName){
+        structName.push_back(isalnum((unsigned char)c) ? c : '_');
+    }
+    if (structName.empty() || isdigit((unsigned char)structName[0])){
+        structName = "_" + structName;
     }
+    return structName;
+}
+
+// The session owns the recorders, so only their sizes are left to generate
+void HostCodeGenerator::generateRuntimeHostCode(std::string dataFilePath){
+    generatedHostCode << "Generated host code as following uses the OpenCLBC runtime in the runtime folder. "
+        << "Compile runtime/CoverageSession.cpp with your program\n\n";
+
+    generatedHostCode << "Part 0: at file scope\n"
+        << "#include \"CoverageSession.h\" // with runtime/ in the include path\n\n";
+
+    generatedHostCode << "Part 1: create the coverage session after the context and the command queue\n"
+        << "openclbc::CoverageSession openclbc_session(" << clContext << ", " << clCommandQueue << ", \"" << dataFilePath << "\""
+        << (accumulateLaunches ? ", openclbc::ACCUMULATE_ON_DEVICE" : "") << ");\n";
     if (numConditions){
-        generatedHostCode
-            << "openclbc_result = (double)openclbc_covered_branches / (double)openclbc_total_branches *100.0;\n"
-            << "printf(\"Total branch coverage: %-4.2f\\n\", openclbc_result);\n";
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::BRANCH_RECORDER, " << numConditions*2 << ");\n";
     }
     if (numBarriers){
-        generatedHostCode
-            << "openclbc_barrier_result = (double)openclbc_faulty_barriers / (double)openclbc_total_barriers *100.0;\n"
-            << "printf(\"Faulty barrier rate: %-4.2f\\n\", openclbc_barrier_result);\n";
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::BARRIER_RECORDER, " << numBarriers << ");\n";
     }
-    generatedHostCode
-        << "}\n\n";
+    if (numAtomics){
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::ATOMIC_RECORDER, " << numAtomics*2 << ");\n";
+    }
+    if (numBlocks){
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::BLOCK_RECORDER, " << numBlocks << ");\n";
+    }
+    if (numTraceWords){
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::TRACE_RECORDER, " << numTraceWords << ");\n";
+    }
+    if (numHeatmapWords){
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::HEATMAP_RECORDER, " << numHeatmapWords << ");\n";
+    }
+    if (!regionNames.empty()){
+        generatedHostCode << errorCodeVariable << " = openclbc_session.addRecorder(openclbc::REGION_TIMER_RECORDER, " << regionNames.size() << ");\n";
+    }
+    generatedHostCode << "\n";
+
+    // Host code part 2 - set argument to kernel function
+    generatedHostCode << setArgumentPartHostCode.str() << "\n";
 
+    if (accumulateLaunches){
+        generatedHostCode << "Part 3: only for results while the kernel is still being launched, e.g. every 100 launches\n";
+    } else {
+        generatedHostCode << "Part 3: after every launch of the kernel\n";
+    }
+    generatedHostCode << errorCodeVariable << " = openclbc_session.collect();\n\n";
+
+    std::string filePathPrefix = dataFilePath.substr(0, dataFilePath.find_last_of('.'));
+    generatedHostCode << "Part 4: print converage result\n"
+        << errorCodeVariable << " = openclbc_session.finish();\n"
+        << "openclbc_session.report();\n"
+        << (accumulationFilePath.empty() ? "openclbc_session.writeDump(\"" + filePathPrefix
+            : "openclbc_session.accumulateDump(\"" + accumulationFilePath) << "\");\n";
+    if (numTraceWords){
+        generatedHostCode << "openclbc_session.writeTrace(\"" << filePathPrefix << ".trace\", "
+            << traceSlots << ", " << traceCapacity << ", " << traceGroupStride << ");\n";
+    }
+    if (numHeatmapWords){
+        generatedHostCode << "openclbc_session.writeHeatmap(\"" << filePathPrefix << ".heatmap\");\n";
+    }
+    generatedHostCode << "\n";
 }
 
 std::string HostCodeGenerator::getGeneratedHostCode(){
@@ -142,7 +254,6 @@ bool HostCodeGenerator::isHostCodeComplete(){
     if (this->clCommandQueue.empty()) return false;
     if (this->clContext.empty()) return false;
     if (this->errorCodeVariable.empty()) return false;
-    if (this->kernelFunctionName.empty()) return false;
-    if (this->numBarriers==0 && this->numConditions==0) return false;
+    if (this->numBarriers==0 && this->numConditions==0 && this->numAtomics==0 && this->numBlocks==0 && this->regionNames.empty()) return false;
     return true;
 }
@@ -5,17 +5,48 @@
 #include <string>
 #include <map>
 #include "UserConfig.h"
+#include "RecorderLayout.h"
+
+// Static cost of one execution of an instrumented block
+struct BlockWeight{
+    int globalLoadBytes = 0;
+    int globalStoreBytes = 0;
+    int localLoadBytes = 0;
+    int localStoreBytes = 0;
+    int flops = 0;
+};
 
 class HostCodeGenerator{
 private:
     std::string kernelFunctionName;
     std::string branchRecorderArrayName;
     std::string barrierRecorderArrayName;
+    std::string atomicRecorderArrayName;
+    std::string blockRecorderArrayName;
+    std::string traceBufferArrayName;
+    std::string heatmapArrayName;
+    std::string regionTimerArrayName;
+    std::string instrumentationArrayName;
+    std::string layoutHeaderArrayName;
     std::string clContext;
     std::string errorCodeVariable;
     std::string clCommandQueue;
     int numConditions;
     int numBarriers;
+    int numAtomics;
+    int numBlocks;
+    int traceSlots;
+    int traceCapacity;
+    int traceGroupStride;
+    int numTraceWords;
+    int numHeatmapWords;
+    std::map<int, std::string> regionNames;
+    RecorderLayout layout;
+    bool useRuntime; // Generate calls to openclbc::CoverageSession instead of managing the buffers inline
+    bool accumulateLaunches; // Recorders are initialised once and read back after the last launch
+    bool edgeProfiling; // Block counts off the device are reconstructed before anything reads them
+    std::string accumulationFilePath; // Merged into by every process instead of writing a dump per process
+    std::string atomicCounterType;
 
     std::stringstream setArgumentPartHostCode;
     std::stringstream generatedHostCode;
@@ -23,15 +54,31 @@ private:
 public:
     HostCodeGenerator();
 
-    void initialise(UserConfig* userConfig, int newNumConditions, int newNumBarriers);
+    void initialise(UserConfig* userConfig, int newNumConditions, int newNumBarriers, int newNumAtomics, int newNumBlocks);
+
+    void setTrace(int newTraceSlots, int newTraceCapacity, int newTraceGroupStride);
+
+    void setHeatmap(int heatmapBins);
+
+    void setRegions(std::map<int, std::string> newRegionNames);
 
-    void setArgument(std::string functionName, int argumentLocation);
+    void setLayout(const RecorderLayout& newLayout);
+
+    // Once per kernel, with the size of its __local recorders if known
+    void setArgument(std::string functionName, int argumentLocation, int localRecorderBytes = 0);
 
     void generateHostCode(std::string dataFilePath);
 
     bool isHostCodeComplete();
 
     std::string getGeneratedHostCode();
+
+    static std::string metadataStructName(std::string kernelFilePath);
+
+private:
+    void generateRuntimeHostCode(std::string dataFilePath);
+
+    void declRecorderView(recorder_layout::RecorderKind kind, std::string type, std::string name);
 };
 
 #endif
\ No newline at end of file
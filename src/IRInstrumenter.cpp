@@ -0,0 +1,410 @@
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CallingConv.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "IRInstrumenter.h"
+#include "KernelMetadata.h"
+#include "Constants.h"
+
+using namespace llvm;
+
+namespace{
+
+// Address spaces of the SPIR target
+const unsigned int GLOBAL_ADDRESS_SPACE = 1;
+const unsigned int LOCAL_ADDRESS_SPACE = 3;
+const unsigned int CLK_LOCAL_MEM_FENCE = 1;
+
+bool isBarrier(const Function* callee){
+    if (!callee) return false;
+    StringRef name = callee->getName();
+    return name == "_Z7barrierj" || name.startswith("_Z18work_group_barrierj");
+}
+
+// Declaration of an OpenCL builtin, by its SPIR mangled name, resolved by the device compiler
+Function* getBuiltin(Module& module, StringRef name, Type* result, ArrayRef<Type*> parameters){
+    if (Function* builtin = module.getFunction(name)) return builtin;
+    Function* builtin = Function::Create(FunctionType::get(result, parameters, false), GlobalValue::ExternalLinkage, name, &module);
+    builtin->setCallingConv(CallingConv::SPIR_FUNC);
+    return builtin;
+}
+
+CallInst* callBuiltin(IRBuilder<>& builder, Function* builtin, ArrayRef<Value*> arguments){
+    CallInst* call = builder.CreateCall(builtin, arguments);
+    call->setCallingConv(builtin->getCallingConv());
+    return call;
+}
+
+Value* callBarrier(IRBuilder<>& builder, Module& module, unsigned int flags){
+    Function* barrier = getBuiltin(module, "_Z7barrierj", builder.getVoidTy(), {builder.getInt32Ty()});
+    barrier->addFnAttr(Attribute::Convergent);
+    return callBuiltin(builder, barrier, {builder.getInt32(flags)});
+}
+
+// get_local_id, get_local_size... returning size_t, as an int
+Value* callWorkItemBuiltin(IRBuilder<>& builder, Module& module, StringRef name, unsigned int dimension){
+    Type* sizeType = module.getDataLayout().getIntPtrType(module.getContext());
+    Function* builtin = getBuiltin(module, name, sizeType, {builder.getInt32Ty()});
+    return builder.CreateTrunc(callBuiltin(builder, builtin, {builder.getInt32(dimension)}), builder.getInt32Ty());
+}
+
+// ocl_get_general_size
+Value* workGroupSize(IRBuilder<>& builder, Module& module){
+    Value* size = callWorkItemBuiltin(builder, module, "_Z14get_local_sizej", 0);
+    size = builder.CreateMul(size, callWorkItemBuiltin(builder, module, "_Z14get_local_sizej", 1));
+    return builder.CreateMul(size, callWorkItemBuiltin(builder, module, "_Z14get_local_sizej", 2));
+}
+
+// ocl_get_local_linear_id
+Value* localLinearId(IRBuilder<>& builder, Module& module){
+    Value* id = callWorkItemBuiltin(builder, module, "_Z12get_local_idj", 2);
+    id = builder.CreateMul(id, callWorkItemBuiltin(builder, module, "_Z14get_local_sizej", 1));
+    id = builder.CreateAdd(id, callWorkItemBuiltin(builder, module, "_Z12get_local_idj", 1));
+    id = builder.CreateMul(id, callWorkItemBuiltin(builder, module, "_Z14get_local_sizej", 0));
+    return builder.CreateAdd(id, callWorkItemBuiltin(builder, module, "_Z12get_local_idj", 0));
+}
+
+// Emits for (i = begin; i < end; i += step) body(i) right before insertBefore
+void emitLoop(Instruction* insertBefore, Value* begin, Value* end, Value* step, const std::function<void(IRBuilder<>&, Value*)>& body){
+    BasicBlock* before = insertBefore->getParent();
+    Function* function = before->getParent();
+    BasicBlock* after = SplitBlock(before, insertBefore);
+    BasicBlock* header = BasicBlock::Create(function->getContext(), "ocl_recorder_loop", function, after);
+    BasicBlock* loopBody = BasicBlock::Create(function->getContext(), "ocl_recorder_loop_body", function, after);
+    before->getTerminator()->eraseFromParent();
+    IRBuilder<> builder(before);
+    builder.SetCurrentDebugLocation(insertBefore->getDebugLoc());
+    builder.CreateBr(header);
+    builder.SetInsertPoint(header);
+    PHINode* i = builder.CreatePHI(begin->getType(), 2);
+    builder.CreateCondBr(builder.CreateICmpSLT(i, end), loopBody, after);
+    builder.SetInsertPoint(loopBody);
+    body(builder, i);
+    Value* next = builder.CreateAdd(i, step);
+    builder.CreateBr(header);
+    i->addIncoming(begin, before);
+    i->addIncoming(next, builder.GetInsertBlock());
+}
+
+// file:line:column of an instruction from its debug location, else of its function
+std::string sourceLine(const Instruction* instruction){
+    if (const DILocation* location = instruction->getDebugLoc().get()){
+        return location->getFilename().str() + ":" + std::to_string(location->getLine()) + ":" + std::to_string(location->getColumn());
+    }
+    const Function* function = instruction->getFunction();
+    if (const DISubprogram* subprogram = function->getSubprogram()){
+        return subprogram->getFilename().str() + ":" + std::to_string(subprogram->getLine()) + ":0";
+    }
+    return function->getParent()->getSourceFileName() + ":0:0";
+}
+
+// There is no source text in the IR, so the condition is shown as the instruction computing it
+std::string conditionText(const Value* condition){
+    std::string text;
+    raw_string_ostream textStream(text);
+    condition->print(textStream);
+    textStream.flush();
+    size_t start = text.find_first_not_of(' ');
+    if (start == std::string::npos) return text;
+    return text.substr(start, text.find(", !") - start);
+}
+
+// Argument info of the instrumentation buffer, for runtimes reading it such as PoCL
+void addKernelArgumentInfo(Function* kernel){
+    LLVMContext& context = kernel->getContext();
+    const char* kinds[] = {"kernel_arg_addr_space", "kernel_arg_access_qual", "kernel_arg_type",
+        "kernel_arg_base_type", "kernel_arg_type_qual", "kernel_arg_name"};
+    Metadata* values[] = {ConstantAsMetadata::get(ConstantInt::get(Type::getInt32Ty(context), GLOBAL_ADDRESS_SPACE)),
+        MDString::get(context, "none"), MDString::get(context, "uint*"), MDString::get(context, "uint*"),
+        MDString::get(context, ""), MDString::get(context, kernel_rewriter_constants::GLOBAL_INSTRUMENTATION_BUFFER_NAME)};
+    for (int i = 0; i < 6; i++){
+        MDNode* node = kernel->getMetadata(kinds[i]);
+        if (!node) continue;
+        SmallVector<Metadata*, 8> operands(node->op_begin(), node->op_end());
+        operands.push_back(values[i]);
+        kernel->setMetadata(kinds[i], MDNode::get(context, operands));
+    }
+}
+
+bool isKernel(const Function* function){
+    return function->getCallingConv() == CallingConv::SPIR_KERNEL;
+}
+
+// Recorders a function is given or, for a kernel, declares
+struct FunctionRecorders{
+    Value* buffer;
+    Value* branches;    // __local branch flags, 2 per condition slot
+    Value* barriers;    // __local barrier counters
+};
+
+}
+
+char IRInstrumenter::ID = 0;
+
+IRInstrumenter::IRInstrumenter() : ModulePass(ID), kernelHash(0){
+}
+
+bool IRInstrumenter::runOnModule(Module& module){
+    LLVMContext& context = module.getContext();
+    Type* intType = Type::getInt32Ty(context);
+    PointerType* globalPointer = PointerType::get(intType, GLOBAL_ADDRESS_SPACE);
+    PointerType* localPointer = PointerType::get(intType, LOCAL_ADDRESS_SPACE);
+
+    std::vector<Function*> functions;
+    std::set<std::string> helpers;
+    for (Function& function : module){
+        if (function.isDeclaration()) continue;
+        functions.push_back(&function);
+        if (!isKernel(&function)) helpers.insert(function.getName().str());
+    }
+
+    // Number the probes in the order of the functions and of their blocks
+    std::vector<Instruction*> conditions; // Conditional branches and selects
+    std::vector<CallInst*> barriers;
+    slots = RecorderSlots();
+    for (Function* function : functions){
+        size_t firstCondition = conditions.size();
+        size_t firstBarrier = barriers.size();
+        slots.addFunction(function->getName().str(), isKernel(function));
+        for (BasicBlock& block : *function){
+            for (Instruction& instruction : block){
+                Value* condition = NULL;
+                if (BranchInst* branch = dyn_cast<BranchInst>(&instruction)){
+                    if (branch->isConditional()) condition = branch->getCondition();
+                } else if (SelectInst* select = dyn_cast<SelectInst>(&instruction)){
+                    if (!select->getCondition()->getType()->isVectorTy()) condition = select->getCondition();
+                } else if (CallInst* call = dyn_cast<CallInst>(&instruction)){
+                    if (isBarrier(call->getCalledFunction())){
+                        barrierLineMap[barriers.size()] = sourceLine(call);
+                        barriers.push_back(call);
+                    } else if (call->getCalledFunction() && !call->getCalledFunction()->isDeclaration()){
+                        slots.addCall(call->getCalledFunction()->getName().str());
+                    }
+                }
+                if (condition && !isa<Constant>(condition)){
+                    conditionLineMap[conditions.size()] = sourceLine(&instruction);
+                    conditionStringMap[conditions.size()] = (isa<SelectInst>(instruction) ? "select on " : "") + conditionText(condition);
+                    conditions.push_back(&instruction);
+                }
+            }
+        }
+        slots.addProbes(RecorderSlots::CONDITION, conditions.size() - firstCondition);
+        slots.addProbes(RecorderSlots::BARRIER, barriers.size() - firstBarrier);
+    }
+    slots.computeSlots(helpers);
+
+    layout = RecorderLayout();
+    layout.add(recorder_layout::BRANCH, 2 * conditions.size(), 1);
+    layout.add(recorder_layout::BARRIER, barriers.size(), 1);
+    std::string source;
+    raw_string_ostream sourceStream(source);
+    module.print(sourceStream, NULL);
+    sourceStream.flush();
+    kernelHash = hashKernel(source, layout);
+    kernels.clear();
+    if (layout.empty()) return false;
+
+    // Move every body into a function taking the recorders, as the rewriter adds them to the parameters in the source
+    std::map<Function*, Function*> instrumented;
+    std::map<Function*, FunctionRecorders> recorders;
+    for (Function* function : functions){
+        std::vector<Type*> parameters(function->getFunctionType()->param_begin(), function->getFunctionType()->param_end());
+        parameters.push_back(globalPointer);
+        if (!isKernel(function)){
+            parameters.push_back(localPointer);
+            parameters.push_back(localPointer);
+        }
+        Function* newFunction = Function::Create(FunctionType::get(function->getReturnType(), parameters, function->isVarArg()),
+            function->getLinkage(), "");
+        module.getFunctionList().insert(function->getIterator(), newFunction);
+        newFunction->takeName(function);
+        newFunction->copyAttributesFrom(function);
+        SmallVector<std::pair<unsigned int, MDNode*>, 8> metadata;
+        function->getAllMetadata(metadata);
+        for (auto& entry : metadata){
+            newFunction->addMetadata(entry.first, *entry.second);
+        }
+        newFunction->getBasicBlockList().splice(newFunction->begin(), function->getBasicBlockList());
+
+        auto newArgument = newFunction->arg_begin();
+        for (Argument& argument : function->args()){
+            newArgument->takeName(&argument);
+            argument.replaceAllUsesWith(&*newArgument);
+            newArgument++;
+        }
+        FunctionRecorders functionRecorders;
+        functionRecorders.buffer = &*newArgument;
+        functionRecorders.buffer->setName(kernel_rewriter_constants::GLOBAL_INSTRUMENTATION_BUFFER_NAME);
+        if (isKernel(newFunction)){
+            // Branch flags, then barrier counters, of the probes the kernel reaches in one __local array
+            std::string name = newFunction->getName().str();
+            int numBranchSlots = 2 * slots.getNumSlots(name, RecorderSlots::CONDITION);
+            int numLocalRecorders = numBranchSlots + slots.getNumSlots(name, RecorderSlots::BARRIER);
+            ArrayType* localArrayType = ArrayType::get(intType, std::max(1, numLocalRecorders));
+            GlobalVariable* localArray = new GlobalVariable(module, localArrayType, false, GlobalValue::InternalLinkage,
+                UndefValue::get(localArrayType), name + "." + kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME,
+                NULL, GlobalValue::NotThreadLocal, LOCAL_ADDRESS_SPACE);
+            Constant* branchIndices[] = {ConstantInt::get(intType, 0), ConstantInt::get(intType, 0)};
+            Constant* barrierIndices[] = {ConstantInt::get(intType, 0), ConstantInt::get(intType, numBranchSlots)};
+            functionRecorders.branches = ConstantExpr::getInBoundsGetElementPtr(localArrayType, localArray, branchIndices);
+            functionRecorders.barriers = ConstantExpr::getInBoundsGetElementPtr(localArrayType, localArray, barrierIndices);
+            kernels.push_back(std::make_pair(name, (int)function->arg_size()));
+            addKernelArgumentInfo(newFunction);
+        } else {
+            functionRecorders.branches = &*(++newArgument);
+            functionRecorders.branches->setName(kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME);
+            functionRecorders.barriers = &*(++newArgument);
+            functionRecorders.barriers->setName(kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME);
+        }
+        instrumented[function] = newFunction;
+        recorders[newFunction] = functionRecorders;
+    }
+
+    // Calls pass the recorders on; kernels give each helper its recorders from the offset of its component on
+    for (auto& entry : instrumented){
+        Function* caller = entry.second;
+        std::string callerName = caller->getName().str();
+        std::vector<CallInst*> calls;
+        for (BasicBlock& block : *caller){
+            for (Instruction& instruction : block){
+                CallInst* call = dyn_cast<CallInst>(&instruction);
+                if (call && instrumented.count(call->getCalledFunction())) calls.push_back(call);
+            }
+        }
+        for (CallInst* call : calls){
+            Function* callee = instrumented[call->getCalledFunction()];
+            std::vector<Value*> arguments(call->arg_begin(), call->arg_end());
+            const FunctionRecorders& callerRecorders = recorders[caller];
+            arguments.push_back(callerRecorders.buffer);
+            if (!isKernel(callee)){
+                Value* branches = callerRecorders.branches;
+                Value* barriers = callerRecorders.barriers;
+                if (isKernel(caller)){
+                    int component = slots.getComponent(callee->getName().str());
+                    IRBuilder<> builder(call);
+                    branches = builder.CreateInBoundsGEP(intType, branches,
+                        builder.getInt32(2 * slots.getComponentOffset(callerName, component, RecorderSlots::CONDITION)));
+                    barriers = builder.CreateInBoundsGEP(intType, barriers,
+                        builder.getInt32(slots.getComponentOffset(callerName, component, RecorderSlots::BARRIER)));
+                }
+                arguments.push_back(branches);
+                arguments.push_back(barriers);
+            }
+            CallInst* newCall = CallInst::Create(callee, arguments, "", call);
+            newCall->takeName(call);
+            newCall->setCallingConv(call->getCallingConv());
+            newCall->setAttributes(call->getAttributes());
+            newCall->setTailCallKind(call->getTailCallKind());
+            newCall->setDebugLoc(call->getDebugLoc());
+            call->replaceAllUsesWith(newCall);
+            call->eraseFromParent();
+        }
+    }
+    for (auto& entry : instrumented){
+        // Only left in module metadata such as opencl.kernels
+        if (!entry.first->use_empty()){
+            entry.first->replaceAllUsesWith(ConstantExpr::getBitCast(entry.second, entry.first->getType()));
+        }
+        entry.first->eraseFromParent();
+    }
+
+    // atomic_or(&my_ocl_kernel_branch_triggered_recorder[condition ? 2 * slot : 2 * slot + 1], 1)
+    Function* localAtomicOr = getBuiltin(module, "_Z9atomic_orPU3AS3Vii", intType, {localPointer, intType});
+    for (unsigned int id = 0; id < conditions.size(); id++){
+        Instruction* instruction = conditions[id];
+        Value* condition = isa<BranchInst>(instruction) ? cast<BranchInst>(instruction)->getCondition() : cast<SelectInst>(instruction)->getCondition();
+        int slot = slots.getSlot(instruction->getFunction()->getName().str(), RecorderSlots::CONDITION, id);
+        IRBuilder<> builder(instruction);
+        Value* recorder = builder.CreateSelect(condition, builder.getInt32(2 * slot), builder.getInt32(2 * slot + 1));
+        Value* localRecorders = recorders[instruction->getFunction()].branches;
+        callBuiltin(builder, localAtomicOr, {builder.CreateGEP(intType, localRecorders, recorder), builder.getInt32(1)});
+    }
+
+    // OCL_NEW_BARRIER
+    Function* localAtomicInc = getBuiltin(module, "_Z10atomic_incPU3AS3Vi", intType, {localPointer});
+    for (unsigned int id = 0; id < barriers.size(); id++){
+        CallInst* barrier = barriers[id];
+        const FunctionRecorders& functionRecorders = recorders[barrier->getFunction()];
+        int slot = slots.getSlot(barrier->getFunction()->getName().str(), RecorderSlots::BARRIER, id);
+        IRBuilder<> builder(barrier);
+        Value* counter = builder.CreateGEP(intType, functionRecorders.barriers, builder.getInt32(slot));
+        callBuiltin(builder, localAtomicInc, {counter});
+
+        Instruction* next = barrier->getNextNode();
+        builder.SetInsertPoint(next);
+        LoadInst* count = builder.CreateLoad(intType, counter);
+        count->setVolatile(true);
+        Value* divergent = builder.CreateICmpNE(count, workGroupSize(builder, module));
+        Instruction* recheck = barrier->clone();
+        recheck->insertBefore(next);
+        builder.CreateStore(builder.getInt32(0), counter, true);
+        barrier->clone()->insertBefore(next);
+
+        builder.SetInsertPoint(SplitBlockAndInsertIfThen(divergent, recheck, false));
+        Value* divergenceRecorder = builder.CreateGEP(intType, functionRecorders.buffer,
+            builder.getInt32(layout.offset[recorder_layout::BARRIER] + id));
+        builder.CreateStore(builder.getInt32(1), divergenceRecorder);
+    }
+
+    Function* globalAtomicOr = getBuiltin(module, "_Z9atomic_orPU3AS1Vii", intType, {globalPointer, intType});
+    for (auto& entry : instrumented){
+        Function* kernel = entry.second;
+        if (!isKernel(kernel)) continue;
+        std::string name = kernel->getName().str();
+        Value* buffer = recorders[kernel].buffer;
+        Value* localRecorders = recorders[kernel].branches;
+        int numLocalRecorders = 2 * slots.getNumSlots(name, RecorderSlots::CONDITION) + slots.getNumSlots(name, RecorderSlots::BARRIER);
+
+        // __local memory is not initialised: clear the recorders of the work-group before the kernel body
+        BasicBlock::iterator start = kernel->getEntryBlock().getFirstInsertionPt();
+        while (isa<AllocaInst>(*start)) start++;
+        Instruction* body = &*start;
+        IRBuilder<> builder(body);
+        emitLoop(body, localLinearId(builder, module), builder.getInt32(numLocalRecorders), workGroupSize(builder, module),
+            [&](IRBuilder<>& loopBuilder, Value* i){
+                loopBuilder.CreateStore(loopBuilder.getInt32(0), loopBuilder.CreateGEP(intType, localRecorders, i), true);
+            });
+        builder.SetInsertPoint(body);
+        callBarrier(builder, module, CLK_LOCAL_MEM_FENCE);
+
+        // Update the global recorder before every return, a run of consecutive slots and IDs at a time
+        std::vector<RecorderSlots::Run> runs = slots.getRuns(name, RecorderSlots::CONDITION);
+        if (runs.empty()) continue;
+        std::vector<ReturnInst*> returns;
+        for (BasicBlock& block : *kernel){
+            if (ReturnInst* ret = dyn_cast<ReturnInst>(block.getTerminator())) returns.push_back(ret);
+        }
+        for (ReturnInst* ret : returns){
+            for (const RecorderSlots::Run& run : runs){
+                builder.SetInsertPoint(ret);
+                emitLoop(ret, builder.getInt32(0), builder.getInt32(2 * run.length), builder.getInt32(1),
+                    [&](IRBuilder<>& loopBuilder, Value* i){
+                        LoadInst* flag = loopBuilder.CreateLoad(intType, loopBuilder.CreateGEP(intType, localRecorders,
+                            loopBuilder.CreateAdd(i, loopBuilder.getInt32(2 * run.slot))));
+                        flag->setVolatile(true);
+                        Value* globalRecorder = loopBuilder.CreateGEP(intType, buffer,
+                            loopBuilder.CreateAdd(i, loopBuilder.getInt32(layout.offset[recorder_layout::BRANCH] + 2 * run.id)));
+                        callBuiltin(loopBuilder, globalAtomicOr, {globalRecorder, flag});
+                    });
+            }
+        }
+    }
+    return true;
+}
+
+int IRInstrumenter::getLocalRecorderBytes(const std::string& kernel) const{
+    return 4 * std::max(1, 2 * slots.getNumSlots(kernel, RecorderSlots::CONDITION) + slots.getNumSlots(kernel, RecorderSlots::BARRIER));
+}
@@ -0,0 +1,62 @@
+#ifndef OPENCLBC_IR_INSTRUMENTER_H
+#define OPENCLBC_IR_INSTRUMENTER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+#include "RecorderLayout.h"
+#include "RecorderSlots.h"
+
+// Branch coverage and barrier divergence probes inserted into the LLVM IR of a kernel file, run after the
+// control flow has been simplified, so probes follow the control flow the device compiler is given rather
+// than the source: ifs turned into selects are covered as selects, branches left by the optimiser as branches.
+// Both edges of a conditional branch (both values of a select) share one probe before it, which picks the
+// recorder of the edge taken from the condition, so no edge is split and the control flow is left as it is.
+// Barriers get the same dynamic check as OCL_NEW_BARRIER. Source lines come from the debug info.
+// Recorders are laid out as the source rewriter lays them out (see recorder_layout): kernels take the
+// instrumentation buffer as an extra last parameter, and keep their recorders in __local memory until they
+// return; the other functions defined in the module take the buffer and the __local branch flags and barrier
+// counters. As in the source rewriter, each kernel only keeps __local slots for the probes it can reach through
+// the call graph, see RecorderSlots.
+class IRInstrumenter : public llvm::ModulePass{
+public:
+    static char ID;
+
+    IRInstrumenter();
+
+    bool runOnModule(llvm::Module& module) override;
+
+    int getNumConditions() const { return conditionLineMap.size(); }
+    int getNumBarriers() const { return barrierLineMap.size(); }
+
+    // Probe sites in the order of their IDs, as file:line:column
+    std::map<int, std::string>& getConditionLines() { return conditionLineMap; }
+    std::map<int, std::string>& getConditionTexts() { return conditionStringMap; }
+    std::map<int, std::string>& getBarrierLines() { return barrierLineMap; }
+
+    // Kernels and the position of their instrumentation buffer parameter
+    const std::vector<std::pair<std::string, int> >& getKernels() const { return kernels; }
+
+    const RecorderLayout& getLayout() const { return layout; }
+
+    // __local memory a kernel takes for its recorders
+    int getLocalRecorderBytes(const std::string& kernel) const;
+
+    // Over the module as it was before probes were inserted
+    unsigned long long getKernelHash() const { return kernelHash; }
+
+private:
+    std::map<int, std::string> conditionLineMap;
+    std::map<int, std::string> conditionStringMap;
+    std::map<int, std::string> barrierLineMap;
+    std::vector<std::pair<std::string, int> > kernels;
+    RecorderLayout layout;
+    RecorderSlots slots;
+    unsigned long long kernelHash;
+};
+
+#endif
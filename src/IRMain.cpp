@@ -0,0 +1,205 @@
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <set>
+#include <memory>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Scalar.h"
+
+#include "HostCodeGenerator.h"
+#include "IRInstrumenter.h"
+#include "KernelMetadata.h"
+#include "Constants.h"
+#include "UserConfig.h"
+
+// openclbc-ir: the IR backend of openclbc, instrumenting the optimised LLVM IR of a kernel file, e.g.
+//     clang -cl-std=CL1.2 -target spir64 -O2 -g -emit-llvm -c yourkernelfile.cl -o yourkernelfile.bc
+//     openclbc-ir yourkernelfile.bc -o outputdirectory
+// writes yourkernelfile.cl.bc with the data file, metadata header and host code of the source rewriter.
+
+static llvm::cl::OptionCategory ToolCategory("OpenCL kernel branch coverage checker options");
+
+static llvm::cl::opt<std::string> inputFileName(
+    llvm::cl::Positional,
+    llvm::cl::desc("<kernel bitcode or IR>"),
+    llvm::cl::Required,
+    llvm::cl::cat(ToolCategory)
+);
+
+static llvm::cl::opt<std::string> outputDirectory(
+    "o",
+    llvm::cl::desc("Specify the output directory"),
+    llvm::cl::value_desc("directory"),
+    llvm::cl::Required,
+    llvm::cl::cat(ToolCategory)
+);
+
+static llvm::cl::opt<std::string> userConfigFileName(
+    "config",
+    llvm::cl::desc("Specify the user config file name"),
+    llvm::cl::value_desc("filename"),
+    llvm::cl::Optional, // Will be empty string if not specified
+    llvm::cl::cat(ToolCategory)
+);
+
+// Modes of the source rewriter the IR backend does not have
+const char* const UNSUPPORTED_OPTIONS[] = {"atomic_contention", "roofline", "trace", "heatmap", "region_timers",
+    "uniform_branches", "prove_barriers"};
+
+std::string dataFile(IRInstrumenter& instrumenter){
+    std::stringstream outputBuffer;
+    outputBuffer << "Kernel hash: 0x" << std::hex << instrumenter.getKernelHash() << std::dec << "\n";
+    unsigned int layoutHeader[recorder_layout::HEADER_WORDS];
+    instrumenter.getLayout().writeHeader(layoutHeader);
+    outputBuffer << "Layout:";
+    for (unsigned int word : layoutHeader){
+        outputBuffer << " " << word;
+    }
+    outputBuffer << "\n";
+    outputBuffer << "Wide kinds: " << instrumenter.getLayout().wideKinds() << "\n";
+    for (int i = 0; i < instrumenter.getNumConditions(); i++){
+        outputBuffer << "Condition ID: " << i << "\n";
+        outputBuffer << "Source code line: " << instrumenter.getConditionLines()[i] << "\n";
+        outputBuffer << "Condition: " << instrumenter.getConditionTexts()[i] << "\n";
+    }
+    for (int i = 0; i < instrumenter.getNumBarriers(); i++){
+        outputBuffer << "Barrier ID: " << i << "\n";
+        outputBuffer << "Source code line: " << instrumenter.getBarrierLines()[i] << "\n";
+    }
+    outputBuffer << "\n";
+    return outputBuffer.str();
+}
+
+// Same struct as the header of the source rewriter, with only branch and barrier recorders
+std::string metadataHeader(std::string headerFileName, IRInstrumenter& instrumenter){
+    std::stringstream ss;
+    std::string structName = HostCodeGenerator::metadataStructName(headerFileName);
+    const RecorderLayout& layout = instrumenter.getLayout();
+    ss << "// Generated by openclbc-ir, do not edit\n"
+        << "#ifndef OPENCLBC_METADATA_" << structName << "\n"
+        << "#define OPENCLBC_METADATA_" << structName << "\n\n"
+        << "#include \"CoverageReport.h\"\n\n"
+        << "namespace openclbc_metadata{\n\n"
+        << "struct " << structName << "{\n"
+        << "    typedef cl_uint AtomicCounter;\n"
+        << "    static constexpr unsigned int numConditions = " << instrumenter.getNumConditions() << ";\n"
+        << "    static constexpr unsigned int numConstantConditions = 0;\n"
+        << "    static constexpr unsigned int numBarriers = " << instrumenter.getNumBarriers() << ";\n"
+        << "    static constexpr unsigned int numAtomics = 0;\n"
+        << "    static constexpr unsigned int numBlocks = 0;\n"
+        << "    static constexpr unsigned int numFunctions = 0;\n"
+        << "    static constexpr unsigned int numRegions = 0;\n"
+        << "    static constexpr unsigned long long kernelHash = 0x" << std::hex << instrumenter.getKernelHash() << std::dec << "ull;\n"
+        << "    static constexpr unsigned int wideKinds = " << layout.wideKinds() << ";\n"
+        << "    static constexpr unsigned int layoutWords = " << layout.totalWords << ";\n"
+        << "    static constexpr unsigned int branchOffset = " << layout.offset[recorder_layout::BRANCH] << ";\n"
+        << "    static constexpr unsigned int barrierOffset = " << layout.offset[recorder_layout::BARRIER] << ";\n"
+        << "    static constexpr unsigned int atomicOffset = 0;\n"
+        << "    static constexpr unsigned int blockOffset = 0;\n"
+        << "    static constexpr unsigned int traceOffset = 0;\n"
+        << "    static constexpr unsigned int traceWords = 0;\n"
+        << "    static constexpr unsigned int heatmapOffset = 0;\n"
+        << "    static constexpr unsigned int heatmapWords = 0;\n"
+        << "    static constexpr unsigned int regionTimerOffset = 0;\n\n";
+    declProbeSites(ss, "conditions", instrumenter.getNumConditions(), instrumenter.getConditionLines(), "CONDITION_PROBE",
+        &instrumenter.getConditionTexts());
+    std::map<int, std::string> noLines;
+    declProbeSites(ss, "constantConditions", 0, noLines, "CONDITION_PROBE", NULL);
+    declCoveredBefore(ss, instrumenter.getNumConditions(), std::set<int>());
+    declProbeSites(ss, "barriers", instrumenter.getNumBarriers(), instrumenter.getBarrierLines(), "BARRIER_PROBE", NULL);
+    declProbeSites(ss, "atomics", 0, noLines, "ATOMIC_PROBE", NULL);
+    declProbeSites(ss, "blocks", 0, noLines, "BLOCK_PROBE", NULL);
+    declProbeSites(ss, "regions", 0, noLines, "REGION_PROBE", NULL);
+    ss << "    static const openclbc::BlockCost* blockCosts(){\n        return nullptr;\n    }\n"
+        << "    static const openclbc::ProfileEdge* profileEdges(){\n        return nullptr;\n    }\n"
+        << "    static const char* const* functionNames(){\n        return nullptr;\n    }\n"
+        << "};\n\n}\n\n#endif\n";
+    return ss.str();
+}
+
+int main(int argc, const char** argv){
+    llvm::cl::HideUnrelatedOptions(ToolCategory);
+    llvm::cl::ParseCommandLineOptions(argc, argv, "OpenCL kernel branch coverage checker, LLVM IR backend\n");
+
+    llvm::LLVMContext context;
+    llvm::SMDiagnostic error;
+    std::unique_ptr<llvm::Module> module = llvm::parseIRFile(inputFileName, error, context);
+    if (!module){
+        error.print(argv[0], llvm::errs());
+        return 1;
+    }
+
+    UserConfig userConfig(userConfigFileName.c_str());
+    for (const char* option : UNSUPPORTED_OPTIONS){
+        if (userConfig.isEnabled(option)){
+            std::cout << "\x1B[33m" << option << " is not supported by openclbc-ir and is ignored.\x1B[0m\n";
+        }
+    }
+
+    // Probes go on the control flow the device compiler is given: blocks merged, small ifs turned into selects
+    llvm::legacy::PassManager passes;
+    passes.add(llvm::createCFGSimplificationPass());
+    IRInstrumenter* instrumenter = new IRInstrumenter();
+    passes.add(instrumenter);
+    passes.run(*module);
+
+    if (instrumenter->getNumConditions() == 0 && instrumenter->getNumBarriers() == 0){
+        std::cout << "\x1B[31mNo branch or barrier found in this kernel. The tool will do nothing.\x1B[0m\n";
+        return 0;
+    }
+    if (llvm::verifyModule(*module, &llvm::errs())){
+        std::cout << "\x1B[31mThe instrumented module is broken, nothing has been written.\x1B[0m\n";
+        return 1;
+    }
+
+    // Outputs are named after the kernel source, as those of the source rewriter
+    std::string directory(outputDirectory.c_str());
+    if (directory.at(directory.size() - 1) != '/') directory.append("/");
+    std::string kernelFileName = module->getSourceFileName();
+    if (kernelFileName.empty()) kernelFileName = inputFileName.substr(0, inputFileName.find_last_of('.'));
+    std::string outputFileName = directory + kernelFileName.substr(kernelFileName.find_last_of('/') + 1);
+
+    llvm::SmallVector<char, 0> bitcode;
+    llvm::raw_svector_ostream bitcodeStream(bitcode);
+    llvm::WriteBitcodeToFile(*module, bitcodeStream);
+    std::ofstream fileWriter(outputFileName + ".bc", std::ios::binary);
+    fileWriter.write(bitcode.data(), bitcode.size());
+    fileWriter.close();
+
+    HostCodeGenerator hostCodeGenerator;
+    hostCodeGenerator.initialise(&userConfig, instrumenter->getNumConditions(), instrumenter->getNumBarriers(), 0, 0);
+    hostCodeGenerator.setLayout(instrumenter->getLayout());
+    for (auto& kernel : instrumenter->getKernels()){
+        hostCodeGenerator.setArgument(kernel.first, kernel.second, instrumenter->getLocalRecorderBytes(kernel.first));
+    }
+    std::string dataFileName = outputFileName + ".dat";
+    hostCodeGenerator.generateHostCode(dataFileName);
+    fileWriter.open(dataFileName);
+    fileWriter << dataFile(*instrumenter);
+    fileWriter.close();
+
+    std::string headerFileName = outputFileName + ".h";
+    fileWriter.open(headerFileName);
+    fileWriter << metadataHeader(headerFileName, *instrumenter);
+    fileWriter.close();
+
+    if (hostCodeGenerator.isHostCodeComplete()){
+        std::cout << "\x1B[32mReferable host code has been written in the output directory\x1B[0m\n";
+        fileWriter.open(directory + "hostcode.txt");
+        fileWriter << hostCodeGenerator.getGeneratedHostCode();
+        fileWriter.close();
+    }
+    std::cout << "\x1B[32mDone. Please find the instrumented kernel bitcode in the output directory.\x1B[0m\n";
+}
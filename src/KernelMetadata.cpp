@@ -0,0 +1,76 @@
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "KernelMetadata.h"
+#include "Constants.h"
+
+unsigned long long hashKernel(const std::string& source, const RecorderLayout& layout){
+    unsigned long long hash = dump_format::FNV_OFFSET_BASIS;
+    for (char c : source){
+        hash ^= (unsigned char)c;
+        hash *= dump_format::FNV_PRIME;
+    }
+    unsigned int header[recorder_layout::HEADER_WORDS];
+    layout.writeHeader(header);
+    for (unsigned int word : header){
+        for (int byte = 0; byte < 4; byte++){
+            hash ^= (word >> (8 * byte)) & 0xff;
+            hash *= dump_format::FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+std::string cStringLiteral(const std::string& text){
+    std::string literal = "\"";
+    for (char c : text){
+        if (c == '"' || c == '\\') literal.push_back('\\');
+        if (c == '\n' || c == '\r' || c == '\t') c = ' ';
+        literal.push_back(c);
+    }
+    return literal + "\"";
+}
+
+std::string probeSite(const std::string& sourceLine, const char* kind, const std::string& text, const char* mode){
+    std::stringstream ss;
+    size_t columnStart = sourceLine.find_last_of(':');
+    size_t lineStart = columnStart == std::string::npos || columnStart == 0 ? std::string::npos : sourceLine.find_last_of(':', columnStart - 1);
+    if (lineStart == std::string::npos){
+        ss << "{" << cStringLiteral(sourceLine) << ", 0, 0, openclbc::" << kind << ", " << cStringLiteral(text) << ", openclbc::" << mode << "}";
+    } else {
+        ss << "{" << cStringLiteral(sourceLine.substr(0, lineStart)) << ", " << sourceLine.substr(lineStart + 1, columnStart - lineStart - 1)
+            << ", " << sourceLine.substr(columnStart + 1) << ", openclbc::" << kind << ", " << cStringLiteral(text) << ", openclbc::" << mode << "}";
+    }
+    return ss.str();
+}
+
+void declProbeSites(std::stringstream& ss, const char* function, int count, std::map<int, std::string>& lineMap,
+    const char* kind, std::map<int, std::string>* textMap, const std::set<int>* staticIds, const char* staticMode,
+    const char* otherMode){
+    ss << "    static const openclbc::ProbeSite* " << function << "(){\n";
+    if (count == 0){
+        ss << "        return nullptr;\n    }\n";
+        return;
+    }
+    ss << "        static constexpr openclbc::ProbeSite sites[" << count << "] = {\n";
+    for (int i = 0; i < count; i++){
+        const char* mode = staticIds && staticIds->count(i) ? staticMode : otherMode;
+        ss << "            " << probeSite(lineMap[i], kind, textMap ? (*textMap)[i] : std::string(), mode) << (i + 1 < count ? ",\n" : "\n");
+    }
+    ss << "        };\n        return sites;\n    }\n";
+}
+
+void declCoveredBefore(std::stringstream& ss, int numConditions, const std::set<int>& coveredBranches){
+    ss << "    static const unsigned char* coveredBefore(){\n";
+    if (coveredBranches.empty()){
+        ss << "        return nullptr;\n    }\n";
+        return;
+    }
+    ss << "        static constexpr unsigned char branches[" << 2 * numConditions << "] = {";
+    for (int i = 0; i < 2 * numConditions; i++){
+        ss << (i ? ", " : "") << (coveredBranches.count(i) ? 1 : 0);
+    }
+    ss << "};\n        return branches;\n    }\n";
+}
@@ -0,0 +1,29 @@
+#ifndef OPENCLBC_KERNEL_METADATA_H
+#define OPENCLBC_KERNEL_METADATA_H
+
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "RecorderLayout.h"
+
+// Pieces of the files written next to an instrumented kernel, shared by the source rewriter and the IR backend
+
+// FNV-1a over the kernel as it was instrumented and the layout of the instrumentation buffer, see dump_format
+unsigned long long hashKernel(const std::string& source, const RecorderLayout& layout);
+
+std::string cStringLiteral(const std::string& text);
+
+// Entry of a probe table of the metadata header, from a source line recorded as file:line:column
+std::string probeSite(const std::string& sourceLine, const char* kind, const std::string& text, const char* mode);
+
+// Probes listed in staticIds are simplified as staticMode says, the others as otherMode
+void declProbeSites(std::stringstream& ss, const char* function, int count, std::map<int, std::string>& lineMap,
+    const char* kind, std::map<int, std::string>* textMap, const std::set<int>* staticIds = NULL, const char* staticMode = NULL,
+    const char* otherMode = "DYNAMIC_PROBE");
+
+// Table of the branches covered in a previous run, which were left without probes, see prior_coverage
+void declCoveredBefore(std::stringstream& ss, int numConditions, const std::set<int>& coveredBranches);
+
+#endif
@@ -0,0 +1,297 @@
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <thread>
+#include <utility>
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "KernelServer.h"
+#include "Constants.h"
+#include "OpenCLKernelRewriter.h"
+#include "UserConfig.h"
+
+// Precompiles the preamble given to every kernel, instead of the fake header of the tool
+class PreambleAction : public clang::GeneratePCHAction{
+public:
+    explicit PreambleAction(std::string pchFileName) : pchFileName(pchFileName) {}
+
+protected:
+    bool BeginInvocation(clang::CompilerInstance &ci) override {
+        ci.getFrontendOpts().OutputFile = pchFileName;
+        return true;
+    }
+
+private:
+    std::string pchFileName;
+};
+
+class PreambleActionFactory : public clang::tooling::FrontendActionFactory{
+public:
+    explicit PreambleActionFactory(std::string pchFileName) : pchFileName(pchFileName) {}
+
+    clang::FrontendAction* create() override {
+        return new PreambleAction(pchFileName);
+    }
+
+private:
+    std::string pchFileName;
+};
+
+// A client connection, read a line or a given number of bytes at a time
+class Connection{
+public:
+    explicit Connection(int fd) : fd(fd) {}
+
+    ~Connection(){
+        close(fd);
+    }
+
+    // Lines longer than maxLength are refused, so a client cannot make the server buffer without bound
+    bool readLine(std::string& line, size_t maxLength){
+        size_t end;
+        while ((end = buffer.find('\n')) == std::string::npos){
+            if (buffer.size() > maxLength || !fill()) return false;
+        }
+        line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        return true;
+    }
+
+    bool readBytes(size_t size, std::string& bytes){
+        while (buffer.size() < size){
+            if (!fill()) return false;
+        }
+        bytes = buffer.substr(0, size);
+        buffer.erase(0, size);
+        return true;
+    }
+
+    // MSG_NOSIGNAL: a client leaving early must not kill the server with SIGPIPE
+    bool writeAll(const std::string& bytes){
+        size_t written = 0;
+        while (written < bytes.size()){
+            ssize_t n = send(fd, bytes.data() + written, bytes.size() - written, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            written += n;
+        }
+        return true;
+    }
+
+private:
+    bool fill(){
+        char chunk[65536];
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+        return true;
+    }
+
+    int fd;
+    std::string buffer;
+};
+
+class KernelServer{
+public:
+    KernelServer(const clang::tooling::CompilationDatabase& compilations, std::string workDirectory, UserConfig* userConfig)
+        : compilations(compilations), workDirectory(workDirectory), userConfig(userConfig) {}
+
+    // Compiles opencl-c.h and the macros of the config file once, with the compilation flags of the kernels
+    bool warmUp(){
+        std::string preambleFileName = workDirectory + "preamble.cl";
+        pchFileName = workDirectory + "preamble.pch";
+        std::ofstream preambleWriter(preambleFileName);
+        preambleWriter << "#include <opencl-c.h>\n";
+        for (const std::string& macro : userConfig->getValues("macro")){
+            preambleWriter << "#define " << macro << "\n";
+        }
+        preambleWriter.close();
+        clang::tooling::ClangTool tool(compilations, {preambleFileName});
+        PreambleActionFactory preamble(pchFileName);
+        return tool.run(&preamble) == 0;
+    }
+
+    bool listen(std::string socketPath){
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)){
+            std::cerr << "Socket path too long: " << socketPath << "\n";
+            return false;
+        }
+        socketPath.copy(address.sun_path, socketPath.size());
+        unlink(socketPath.c_str()); // left by a previous server
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0 || bind(listenFd, (sockaddr*) &address, sizeof(address)) != 0 || ::listen(listenFd, SOMAXCONN) != 0){
+            std::cerr << "Cannot listen on " << socketPath << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Every thread takes the next connection and serves it to the end, with an output directory of its own.
+    // A thread stops on an error of accept other than an interruption or a lack of resources.
+    void serve(unsigned int numThreads){
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < numThreads; t++){
+            threads.push_back(std::thread([this, t](){
+                std::string outputDirectory = workDirectory + std::to_string(t) + "/";
+                mkdir(outputDirectory.c_str(), 0700);
+                takeFiles(outputDirectory); // left by a previous server
+                while (true){
+                    int fd = accept(listenFd, NULL, NULL);
+                    if (fd >= 0){
+                        serveConnection(fd, outputDirectory);
+                    } else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                        // Out of descriptors or memory: give the connections being served time to end
+                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    } else if (errno != EINTR && errno != ECONNABORTED){
+                        std::cerr << "Cannot accept connections: " << strerror(errno) << "\n";
+                        break;
+                    }
+                }
+            }));
+        }
+        for (auto& thread : threads){
+            thread.join();
+        }
+    }
+
+private:
+    void serveConnection(int fd, const std::string& outputDirectory){
+        Connection connection(fd);
+        std::string line, source;
+        while (connection.readLine(line, PATH_MAX + 32)){
+            size_t separator = line.find_last_of(' ');
+            if (separator == std::string::npos || separator == 0) return;
+            std::string kernelPath = line.substr(0, separator);
+            char* sizeEnd;
+            unsigned long sourceSize = strtoul(line.c_str() + separator + 1, &sizeEnd, 10);
+            if (*sizeEnd != '\0') return;
+            if (sourceSize > MAX_KERNEL_SOURCE_SIZE){
+                // The source is left unread, so the connection cannot go on
+                std::string message = "Kernel source of " + std::to_string(sourceSize) + " bytes, the server takes at most "
+                    + std::to_string(MAX_KERNEL_SOURCE_SIZE) + "\n";
+                connection.writeAll("ERROR 1\ndiagnostics.txt " + std::to_string(message.size()) + "\n" + message);
+                return;
+            }
+            if (!connection.readBytes(sourceSize, source)) return;
+
+            std::vector<std::pair<std::string, std::string> > files;
+            std::string status = instrument(kernelPath, source, outputDirectory, files);
+            std::stringstream response;
+            response << status << " " << files.size() << "\n";
+            for (auto& file : files){
+                response << file.first << " " << file.second.size() << "\n" << file.second;
+            }
+            if (!connection.writeAll(response.str())) return;
+        }
+    }
+
+    // The source is mapped over the kernel path, so the kernel is compiled with its includes and flags.
+    // ClangTool moves the whole process to the directory of the compile command and back. serveKernels starts
+    // the server in the only directory the database uses, so concurrent tools never move it anywhere else.
+    std::string instrument(const std::string& kernelPath, const std::string& source, const std::string& outputDirectory,
+        std::vector<std::pair<std::string, std::string> >& files){
+        std::string diagnostics;
+        llvm::raw_string_ostream diagnosticStream(diagnostics);
+        clang::TextDiagnosticPrinter diagnosticPrinter(diagnosticStream, new clang::DiagnosticOptions());
+        clang::tooling::ClangTool tool(compilations, {kernelPath});
+        tool.mapVirtualFile(kernelPath, source);
+        tool.appendArgumentsAdjuster(clang::tooling::getInsertArgumentAdjuster({"-include-pch", pchFileName},
+            clang::tooling::ArgumentInsertPosition::END));
+        tool.setDiagnosticConsumer(&diagnosticPrinter);
+
+        int status = rewriteOpenclKernel(&tool, outputDirectory, userConfig);
+        takeFiles(outputDirectory, &files);
+        if (diagnosticPrinter.getNumErrors() > 0){
+            files.clear();
+            files.push_back(std::make_pair("diagnostics.txt", diagnosticStream.str()));
+            return "ERROR";
+        }
+        return status == error_code::NO_NEED_TO_TEST_COVERAGE ? "NOTHING" : "OK";
+    }
+
+    // Reads and removes the files written in the directory
+    static void takeFiles(const std::string& directory, std::vector<std::pair<std::string, std::string> >* files = NULL){
+        DIR* dir = opendir(directory.c_str());
+        if (dir == NULL) return;
+        while (dirent* entry = readdir(dir)){
+            std::string fileName = entry->d_name;
+            if (fileName == "." || fileName == "..") continue;
+            if (files != NULL){
+                std::ifstream fileReader(directory + fileName, std::ios::binary);
+                std::stringstream content;
+                content << fileReader.rdbuf();
+                files->push_back(std::make_pair(fileName, content.str()));
+            }
+            unlink((directory + fileName).c_str());
+        }
+        closedir(dir);
+    }
+
+    const clang::tooling::CompilationDatabase& compilations;
+    std::string workDirectory;
+    std::string pchFileName;
+    UserConfig* userConfig;
+    int listenFd;
+};
+
+int serveKernels(const clang::tooling::CompilationDatabase& compilations, std::string socketPath, unsigned int numThreads,
+    UserConfig* userConfig){
+    // The working directory is per process, so compile commands from different directories cannot be served at once
+    std::set<std::string> directories;
+    for (const clang::tooling::CompileCommand& command : compilations.getAllCompileCommands()){
+        directories.insert(command.Directory);
+    }
+    if (directories.size() > 1){
+        std::cout << "\x1B[31mThe compile commands use " << directories.size()
+            << " directories. Serve the kernels of each directory with a server of its own.\x1B[0m\n";
+        return 1;
+    }
+    llvm::SmallString<256> absoluteSocketPath(socketPath);
+    llvm::sys::fs::make_absolute(absoluteSocketPath);
+    socketPath = absoluteSocketPath.str();
+    if (!directories.empty() && llvm::sys::fs::set_current_path(*directories.begin())){
+        std::cout << "\x1B[31mCannot move to " << *directories.begin() << "\x1B[0m\n";
+        return 1;
+    }
+
+    setServingKernels();
+
+    // The precompiled preamble and the output directories of the threads live next to the socket
+    std::string workDirectory = socketPath + ".d/";
+    mkdir(workDirectory.c_str(), 0700);
+    KernelServer server(compilations, workDirectory, userConfig);
+    if (!server.warmUp()){
+        std::cout << "\x1B[31mThe preamble could not be compiled with these compilation flags.\x1B[0m\n";
+        return 1;
+    }
+    if (!server.listen(socketPath)){
+        return 1;
+    }
+    std::cout << "\x1B[32mInstrumenting kernels sent to " << socketPath << " with " << numThreads << " threads\x1B[0m\n";
+    // Only returns once no thread can accept connections any more
+    server.serve(numThreads);
+    return 1;
+}
@@ -0,0 +1,28 @@
+#ifndef OPENCLBC_KERNEL_SERVER_H
+#define OPENCLBC_KERNEL_SERVER_H
+
+#include <string>
+
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "UserConfig.h"
+
+// Investigates and rewrites the kernels of the tool, see Main.cpp
+int rewriteOpenclKernel(clang::tooling::ClangTool* tool, std::string newOutputDirectory, UserConfig* userConfig);
+
+// openclbc --serve: instruments the kernels sent to a Unix socket, so that a runtime instrumenting kernels on the
+// fly neither starts a process nor parses opencl-c.h for each of them. opencl-c.h and the macros of the config
+// file are precompiled once, and numThreads kernels are instrumented at a time. A client sends
+//     <kernel path> <source size>\n<source>
+// and gets back
+//     <status> <file count>\n
+// then <file name> <size>\n<content> for each file. The status is OK with the instrumented kernel, its data file,
+// its metadata header and the host code, NOTHING with no file when there is no branch or barrier to instrument,
+// or ERROR with the diagnostics of the compilation in diagnostics.txt. The kernel is compiled as if it were at
+// its path, so its includes and compilation flags are found, and many kernels can be sent over one connection.
+// A source larger than MAX_KERNEL_SOURCE_SIZE is not read: the server answers ERROR and closes the connection.
+const unsigned long MAX_KERNEL_SOURCE_SIZE = 64ul << 20;
+int serveKernels(const clang::tooling::CompilationDatabase& compilations, std::string socketPath, unsigned int numThreads,
+    UserConfig* userConfig);
+
+#endif
@@ -3,11 +3,15 @@
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <algorithm>
+#include <thread>
 
 #include "llvm/Support/CommandLine.h"
 #include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Tooling/Tooling.h"
 
 #include "HostCodeGenerator.h"
+#include "KernelServer.h"
 #include "OpenCLKernelRewriter.h"
 #include "Constants.h"
 #include "UserConfig.h"
@@ -18,7 +22,7 @@ static llvm::cl::opt<std::string> outputDirectory(
     "o",
     llvm::cl::desc("Specify the output directory"),
     llvm::cl::value_desc("directory"),
-    llvm::cl::Required
+    llvm::cl::Optional // Required unless serving
 );
 
 static llvm::cl::opt<std::string> userConfigFileName(
@@ -28,8 +32,56 @@ static llvm::cl::opt<std::string> userConfigFileName(
     llvm::cl::Optional // Will be empty string if not specified
 );
 
+static llvm::cl::opt<std::string> serveSocketPath(
+    "serve",
+    llvm::cl::desc("Instrument the kernels sent to this Unix socket instead, see KernelServer.h"),
+    llvm::cl::value_desc("socket"),
+    llvm::cl::Optional
+);
+
+static llvm::cl::opt<unsigned int> serveThreads(
+    "j",
+    llvm::cl::desc("Number of kernels instrumented at a time with -serve"),
+    llvm::cl::value_desc("threads"),
+    llvm::cl::init(std::max(1u, std::thread::hardware_concurrency()))
+);
+
+class KernelActionFactory : public clang::tooling::FrontendActionFactory{
+public:
+    explicit KernelActionFactory(clang::FrontendAction* (*newAction)()) : newAction(newAction) {}
+
+    clang::FrontendAction* create() override {
+        return newAction();
+    }
+
+private:
+    clang::FrontendAction* (*newAction)();
+};
+
+int rewriteOpenclKernel(clang::tooling::ClangTool* tool, std::string newOutputDirectory, UserConfig* userConfig){
+    initialiseRewriter(newOutputDirectory, userConfig);
+    KernelActionFactory investigator(newInvestigatorAction);
+    tool->run(&investigator);
+    int status = prepareRewriting(userConfig);
+    if (status != error_code::STATUS_OK) return status;
+    KernelActionFactory rewriter(newRewriterAction);
+    tool->run(&rewriter);
+    writeHostCode();
+    return error_code::STATUS_OK;
+}
+
 int main(int argc, const char** argv){
-    clang::tooling::CommonOptionsParser optionsParser(argc, argv, ToolCategory);
+    clang::tooling::CommonOptionsParser optionsParser(argc, argv, ToolCategory, llvm::cl::ZeroOrMore);
+
+    if (!serveSocketPath.empty()){
+        UserConfig userConfig(userConfigFileName.c_str());
+        return serveKernels(optionsParser.getCompilations(), serveSocketPath, serveThreads, &userConfig);
+    }
+    if (optionsParser.getSourcePathList().empty() || outputDirectory.empty()){
+        std::cerr << "Usage: " << argv[0] << " yourkernelfile.cl -o outputdirectory [-config yourconfigfile]\n"
+            << "       " << argv[0] << " -serve socket [-j threads] [-config yourconfigfile] [-- compilation flags]\n";
+        return 1;
+    }
 
     auto it = optionsParser.getSourcePathList().begin();
     std::string kernelFileName(it->c_str());
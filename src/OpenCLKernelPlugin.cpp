@@ -0,0 +1,65 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "clang/AST/ASTConsumer.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendPluginRegistry.h"
+
+#include "OpenCLKernelRewriter.h"
+#include "UserConfig.h"
+
+using namespace clang;
+
+// openclbc as a Clang plugin: kernels are instrumented while clang compiles them, from the AST of the
+// compilation, instead of being parsed twice more by the openclbc tool:
+//     clang -cl-std=CL1.2 -target spir64 -emit-llvm -c yourkernelfile.cl -o yourkernelfile.bc \
+//         -Xclang -load -Xclang openclbc-plugin.so -Xclang -add-plugin -Xclang openclbc \
+//         -Xclang -plugin-arg-openclbc -Xclang -o -Xclang -plugin-arg-openclbc -Xclang outputdirectory
+// The arguments are those of the tool, -o directory and -config file. The compilation itself is left as it
+// is; the instrumented kernel and the files describing it are written to the output directory.
+class OpenCLKernelPluginAction : public PluginASTAction{
+protected:
+    std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &ci, StringRef file) override {
+        std::string directory = outputDirectory;
+        if (directory.at(directory.size() - 1) != '/') directory.append("/");
+        initialiseRewriter(directory, userConfig.get());
+        return newPluginConsumer(ci, file, userConfig.get());
+    }
+
+    bool ParseArgs(const CompilerInstance &ci, const std::vector<std::string> &args) override {
+        DiagnosticsEngine &diagnostics = ci.getDiagnostics();
+        std::string configFileName;
+        for (size_t i = 0; i < args.size(); i++){
+            if (args[i] == "-o" && i + 1 < args.size()){
+                outputDirectory = args[++i];
+            } else if (args[i] == "-config" && i + 1 < args.size()){
+                configFileName = args[++i];
+            } else {
+                diagnostics.Report(diagnostics.getCustomDiagID(DiagnosticsEngine::Error, "openclbc: invalid argument '%0'")) << args[i];
+                return false;
+            }
+        }
+        if (outputDirectory.empty()){
+            diagnostics.Report(diagnostics.getCustomDiagID(DiagnosticsEngine::Error, "openclbc: no output directory, add -o directory"));
+            return false;
+        }
+        userConfig.reset(new UserConfig(configFileName));
+        // No fake header is added to the kernel: the compilation has its own headers and -D flags
+        if (!userConfig->getValues("macro").empty()){
+            std::cout << "\x1B[33mmacro lines of the config file are ignored by the plugin, pass them to clang with -D.\x1B[0m\n";
+        }
+        return true;
+    }
+
+    ActionType getActionType() override {
+        return AddBeforeMainAction;
+    }
+
+private:
+    std::string outputDirectory;
+    std::unique_ptr<UserConfig> userConfig;
+};
+
+static FrontendPluginRegistry::Add<OpenCLKernelPluginAction> registration("openclbc", "instrument OpenCL kernels for branch coverage");
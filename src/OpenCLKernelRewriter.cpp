@@ -1,10 +1,14 @@
 
+#include <cstdlib>
 #include <sstream>
 #include <string>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <memory>
 
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
@@ -12,10 +16,8 @@
 #include "clang/Frontend/ASTConsumers.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Rewrite/Core/Rewriter.h"
-#include "clang/Tooling/CommonOptionsParser.h"
-#include "clang/Tooling/Tooling.h"
-#include "clang/Tooling/Core/Replacement.h"
 #include "llvm/Support/raw_ostream.h"
 #include "clang/Basic/LLVM.h"
 
@@ -23,43 +25,486 @@
 #include "Constants.h"
 #include "UserConfig.h"
 #include "HostCodeGenerator.h"
+#include "RecorderLayout.h"
+#include "UniformityAnalysis.h"
+#include "ProbePlacement.h"
+#include "RecorderSlots.h"
+#include "KernelMetadata.h"
 
 using namespace clang;
-using namespace clang::tooling;
-
-std::string outputFileName;
-std::string outputDirectory;
-std::string configFileName;
-std::string kernelSourceFile;
-int numAddedLines;
-int numConditions; // Used for labelling if-conditions when rewriting the kernel code
-int countConditions; // Used for counting if-conditions before rewriting the kernel code
-std::map<int, std::string> conditionLineMap; // Line number of each condition
-std::map<int, std::string> conditionStringMap; // Details of each condition
-std::set<std::string> setFunctions; // A set of user-defined functions
-
-int numBarriers;
-int countBarriers;
-std::map<int, std::string> barrierLineMap;
+
+// State of the kernel being instrumented. It is per thread, so openclbc --serve instruments kernels concurrently
+thread_local std::string outputFileName;
+thread_local std::string outputDirectory;
+thread_local std::string configFileName;
+thread_local std::string kernelSourceFile;
+bool servingKernels = false; // Set once by serveKernels, before its threads start
+thread_local int numAddedLines;
+thread_local int numConditions; // Used for labelling if-conditions when rewriting the kernel code
+thread_local int countConditions; // Used for counting if-conditions before rewriting the kernel code
+thread_local std::map<int, std::string> conditionLineMap; // Line number of each condition
+thread_local std::map<int, std::string> conditionStringMap; // Details of each condition
+thread_local std::set<std::string> setFunctions; // A set of user-defined functions
+thread_local RecorderSlots recorderSlots; // Slots of the probes each kernel can reach in its __local recorders
+thread_local bool recorderContext; // OpenCL C 2.0 targets: helper functions take one pointer to their recorders
+
+thread_local bool uniformBranches; // Conditions uniform over the work-group are recorded by one work-item of it
+thread_local std::set<int> uniformConditions;
+
+thread_local bool foldConstantConditions; // Conditions folding to a constant are reported statically, without probes
+thread_local int numConstantConditions;
+thread_local std::map<int, std::string> constantConditionLineMap;
+thread_local std::map<int, std::string> constantConditionStringMap;
+thread_local std::set<int> alwaysTrueConditions; // Constant conditions which are true, the others are false
+
+thread_local std::string priorCoverageFile; // Merged coverage dump of a previous run of the kernel
+thread_local std::set<int> coveredBranches; // Branches covered in it, left without probes
+
+thread_local int numBarriers;
+thread_local int countBarriers;
+thread_local std::map<int, std::string> barrierLineMap;
+thread_local bool proveBarriers; // Barriers which cannot diverge are left without the dynamic check
+thread_local std::set<int> provenBarriers;
+
+thread_local bool profileAtomics; // Count contended executions of atomic builtins
+thread_local int numAtomics;
+thread_local int countAtomics;
+thread_local std::map<int, std::string> atomicLineMap;
+thread_local std::map<int, std::string> atomicStringMap; // Name of the atomic builtin called at each site
+thread_local std::map<std::string, int> atomicProbeTypes; // Pointer types of the addresses of atomic call sites, one probe function each
+
+thread_local bool profileRoofline; // Count executions of statically weighted blocks
+thread_local int numBlocks;
+thread_local int countBlocks;
+thread_local std::map<int, std::string> blockLineMap;
+thread_local std::map<int, std::string> blockFunctionMap; // Function each block belongs to
+thread_local std::map<int, BlockWeight> blockWeightMap; // Bytes moved and floating-point operations per execution
+thread_local bool edgeProfiling; // Only count blocks off a spanning tree of the control flow graph, see ProbePlacement
+thread_local int numEdgeNodes;
+thread_local std::map<int, ProbePlacement::Edge> blockEdgeMap; // Edge of the graph of its function each block stands for
+thread_local std::map<int, int> blockBranchMap; // Branch each side of a condition stands for
+
+thread_local bool traceEvents; // Append branch probes and barrier entries/exits to a per-work-group trace buffer
+thread_local int traceCapacity; // Events kept per sampled work-group
+thread_local int traceGroupStride; // Every traceGroupStride-th work-group is sampled...
+thread_local int traceGroupSlots; // ...until traceGroupSlots work-groups are
+
+thread_local bool recordHeatmap; // Record which work-groups took each branch
+thread_local int heatmapBins; // Bits per branch bitmap
+
+thread_local bool timeRegions; // Accumulate elapsed timestamps per region, only when the user supplied a timestamp hook
+thread_local std::string timestampHook; // OpenCL C expression reading the device clock, e.g. a vendor cycle counter builtin
+thread_local int numTimedFunctions;
+thread_local int countTimedFunctions;
+thread_local std::map<int, std::string> regionNameMap;
+
+thread_local bool accumulateLaunches; // Recorders stay on the device over many launches, so counters that could overflow are 64-bit
+
+thread_local RecorderLayout recorderLayout; // Offsets of the recorders in the instrumentation buffer
+thread_local unsigned long long kernelHash; // Identifies the kernel and its instrumentation in coverage dumps
 
 // Variables below are used to generate host code
-HostCodeGenerator hostCodeGenerator;
+thread_local HostCodeGenerator hostCodeGenerator;
+
+// Conditions folding to a constant, e.g. feature flags set by the macros of the config file.
+// Both visitors leave them out of the condition IDs, so they take no recorder slots.
+bool isConstantCondition(const IfStmt* ifStatement, ASTContext& context, bool& value){
+    if (!foldConstantConditions) return false;
+    const Expr* condition = ifStatement->getCond();
+    return !condition->isValueDependent() && !condition->HasSideEffects(context) && condition->EvaluateAsBooleanCondition(value, context);
+}
+
+// Atomic builtins of OpenCL 1.x (atomic_*, atom_*) and OpenCL 2.0 (atomic_fetch_*, atomic_exchange...)
+// Initialisation and fences do not access a shared address concurrently so they are not profiled.
+// Builtins are declared by clang or by opencl-c.h, a system header, never by the kernel sources. Unlike the set
+// of user-defined functions, this does not depend on the definitions a visitor has reached yet.
+bool isAtomicBuiltin(CallExpr* functionCall, const std::string& functionName, SourceManager& sourceManager){
+    if (functionName.compare(0, 5, "atom_") != 0 && functionName.compare(0, 7, "atomic_") != 0) return false;
+    if (functionName == "atomic_init" || functionName == "atomic_work_item_fence") return false;
+    const FunctionDecl* callee = functionCall->getDirectCallee();
+    if (callee == NULL) return false;
+    callee = callee->getFirstDecl();
+    return callee->getBuiltinID() != 0 || callee->isImplicit() || sourceManager.isInSystemHeader(callee->getLocation());
+}
+
+// Atomic calls expanded from macros cannot be rewritten safely, so both visitors skip them
+bool isProfiledAtomicCall(CallExpr* functionCall, const std::string& functionName, SourceManager& sourceManager){
+    return profileAtomics
+        && isAtomicBuiltin(functionCall, functionName, sourceManager)
+        && functionCall->getNumArgs() > 0
+        && !functionCall->getLocStart().isMacroID();
+}
+
+// Appends an event to the slot of the current work-group, if this work-group is sampled
+// Events beyond the capacity of the slot are dropped and counted, so the first events of the work-group are kept
+std::string declTraceHelpers(){
+    std::stringstream ss;
+    ss << "#define OCL_TRACE_EVENT(event) ocl_trace_event(" << kernel_rewriter_constants::GLOBAL_TRACE_BUFFER_NAME << ", (event))\n"
+        << "void ocl_trace_event(__global uint* buffer, uint event){\n"
+        << "  uint group = (get_group_id(2) * get_num_groups(1) + get_group_id(1)) * get_num_groups(0) + get_group_id(0);\n"
+        << "  if (group % " << traceGroupStride << " != 0 || group / " << traceGroupStride << " >= " << traceGroupSlots << ") return;\n"
+        << "  __global uint* slot = buffer + (group / " << traceGroupStride << ") * "
+        << trace_format::SLOT_HEADER_WORDS + trace_format::EVENT_WORDS * traceCapacity << ";\n"
+        << "  uint sequence = atomic_inc(&slot[0]);\n"
+        << "  if (sequence >= " << traceCapacity << ") {\n"
+        << "    atomic_inc(&slot[1]);\n"
+        << "    return;\n"
+        << "  }\n"
+        << "  __global uint* entry = slot + " << trace_format::SLOT_HEADER_WORDS << " + " << trace_format::EVENT_WORDS << " * sequence;\n"
+        << "  entry[0] = event;\n"
+        << "  entry[1] = ocl_get_local_linear_id();\n"
+        << "  entry[2] = sequence;\n"
+        << "}\n";
+    return ss.str();
+}
+
+// Branch flags of the merged coverage dump of a previous run, see dump_format. Branches covered there are not
+// probed again. They keep their IDs and recorder slots, so the layout and the kernel hash do not change and
+// dumps of the new kernel keep merging with that one.
+void loadPriorCoverage(SourceManager& sourceManager){
+    coveredBranches.clear();
+    if (priorCoverageFile.empty()) return;
+    std::ifstream dumpReader(priorCoverageFile, std::ios::binary);
+    std::vector<unsigned int> words;
+    unsigned int word;
+    while (dumpReader.read((char*)&word, sizeof(word))){
+        words.push_back(word);
+    }
+    if (words.size() < dump_format::HEADER_WORDS || words[0] != dump_format::FILE_MAGIC || words[1] != dump_format::VERSION
+        || words.size() != dump_format::HEADER_WORDS + words[5]){
+        std::cout << "\x1B[33m" << priorCoverageFile << " is not a coverage dump, every branch is probed.\x1B[0m\n";
+        return;
+    }
+    unsigned long long hash = hashKernel(sourceManager.getBufferData(sourceManager.getMainFileID()).str(), recorderLayout);
+    if ((words[2] | ((unsigned long long)words[3] << 32)) != hash){
+        std::cout << "\x1B[33m" << priorCoverageFile << " was written by another kernel or configuration, every branch is probed.\x1B[0m\n";
+        return;
+    }
+    // Same hash, same layout
+    const unsigned int* branches = &words[dump_format::HEADER_WORDS + recorderLayout.offset[recorder_layout::BRANCH]];
+    for (int i = 0; i < 2 * countConditions; i++){
+        if (branches[i]) coveredBranches.insert(i);
+    }
+    std::cout << "\x1B[32m" << coveredBranches.size() << " of " << 2 * countConditions << " branches were covered before and are not probed.\x1B[0m\n";
+}
+
+// Recorders helper functions reach through their parameters: type and name, under which the probes use them
+std::vector<std::pair<std::string, std::string> > helperRecorders(){
+    std::vector<std::pair<std::string, std::string> > recorders;
+    if (countConditions){
+        recorders.push_back(std::make_pair("__local int*", kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME));
+    }
+    if (countBarriers){
+        recorders.push_back(std::make_pair("__global int*", kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME));
+        recorders.push_back(std::make_pair("__local int*", kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME));
+    }
+    if (countAtomics){
+        recorders.push_back(std::make_pair("__local ulong*", kernel_rewriter_constants::LOCAL_ATOMIC_ADDRESS_TABLE_NAME));
+        recorders.push_back(std::make_pair("__local int*", kernel_rewriter_constants::LOCAL_ATOMIC_COUNTER_NAME));
+    }
+    if (countBlocks){
+        recorders.push_back(std::make_pair("__local uint*", kernel_rewriter_constants::LOCAL_BLOCK_COUNTER_NAME));
+    }
+    if (traceEvents){
+        recorders.push_back(std::make_pair("__global uint*", kernel_rewriter_constants::GLOBAL_TRACE_BUFFER_NAME));
+    }
+    if (timeRegions){
+        recorders.push_back(std::make_pair("__local ulong*", kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME));
+    }
+    return recorders;
+}
+
+// Program-scope variables of OpenCL C 2.0 are __global and shared by all work-groups, so they cannot stand for
+// the __local recorders of a work-group. Kernels gather their recorders in a private context instead, and helpers
+// take a single pointer to it rather than one parameter per recorder.
+bool passRecorderContext(){
+    return recorderContext && !setFunctions.empty() && !helperRecorders().empty();
+}
+
+std::string declRecorderContextType(){
+    std::stringstream ss;
+    ss << "struct " << kernel_rewriter_constants::RECORDER_CONTEXT_TYPE << "{\n";
+    for (auto& recorder : helperRecorders()){
+        ss << "  " << recorder.first << " " << recorder.second << ";\n";
+    }
+    ss << "};\n";
+    return ss.str();
+}
+
+// Probe functions of atomic call sites, taking the address and returning it to the builtin so that it is evaluated once.
+// Whole addresses are compared, since 64-bit devices have distinct addresses with the same low 32 bits.
+std::string declAtomicProbes(){
+    std::stringstream ss;
+    for (auto it = atomicProbeTypes.begin(); it != atomicProbeTypes.end(); it++){
+        ss << it->first << " ocl_atomic_probe_" << it->second << "(__local int* counters, __local ulong* last_address, int siteid, "
+            << it->first << " addr){\n"
+            << "  atomic_inc(&counters[2 * siteid]);\n"
+            << "  if (atom_xchg(&last_address[siteid], (ulong)(size_t)addr) == (ulong)(size_t)addr) atomic_inc(&counters[2 * siteid + 1]);\n"
+            << "  return addr;\n"
+            << "}\n";
+    }
+    return ss.str();
+}
+
+// Regions are the body of every function, then for every barrier the code leading to it and the wait in it
+// Function regions come first, barrier i owns the two regions after them
+int barrierSegmentRegion(int barrierId){
+    return countTimedFunctions + 2 * barrierId;
+}
+
+// Needs every count from the investigator
+void computeRecorderLayout(){
+    recorderLayout = RecorderLayout();
+    recorderLayout.add(recorder_layout::BRANCH, 2 * countConditions, 1);
+    recorderLayout.add(recorder_layout::BARRIER, countBarriers, 1);
+    recorderLayout.add(recorder_layout::ATOMIC, 2 * countAtomics, accumulateLaunches ? 2 : 1);
+    recorderLayout.add(recorder_layout::BLOCK, countBlocks, 2);
+    if (traceEvents){
+        recorderLayout.add(recorder_layout::TRACE, traceGroupSlots * (trace_format::SLOT_HEADER_WORDS + trace_format::EVENT_WORDS * traceCapacity), 1);
+    }
+    if (recordHeatmap){
+        recorderLayout.add(recorder_layout::HEATMAP, countConditions ? heatmap_format::HEADER_WORDS + 2 * countConditions * ((heatmapBins + 31) / 32) : 0, 1);
+    }
+    if (timeRegions){
+        recorderLayout.add(recorder_layout::REGION_TIMER, countTimedFunctions + 2 * countBarriers, 2);
+    }
+}
+
+// C++ header describing the probes and the layout of the instrumentation buffer with compile-time constants,
+// read by openclbc::reportCoverage in runtime/CoverageReport.h
+std::string metadataHeader(std::string headerFileName){
+    std::stringstream ss;
+    std::string structName = HostCodeGenerator::metadataStructName(headerFileName);
+    int numRegions = regionNameMap.size();
+
+    // Functions in order of appearance
+    std::vector<std::string> functionNames;
+    std::map<std::string, int> functionIds;
+    for (auto it = blockFunctionMap.begin(); it != blockFunctionMap.end(); it++){
+        if (functionIds.find(it->second) == functionIds.end()){
+            functionIds[it->second] = functionNames.size();
+            functionNames.push_back(it->second);
+        }
+    }
+
+    ss << "// Generated by openclbc, do not edit\n"
+        << "#ifndef OPENCLBC_METADATA_" << structName << "\n"
+        << "#define OPENCLBC_METADATA_" << structName << "\n\n"
+        << "#include \"CoverageReport.h\"\n\n"
+        << "namespace openclbc_metadata{\n\n"
+        << "struct " << structName << "{\n"
+        << "    typedef " << (accumulateLaunches ? "cl_ulong" : "cl_uint") << " AtomicCounter;\n"
+        << "    static constexpr unsigned int numConditions = " << countConditions << ";\n"
+        << "    static constexpr unsigned int numConstantConditions = " << numConstantConditions << ";\n"
+        << "    static constexpr unsigned int numBarriers = " << countBarriers << ";\n"
+        << "    static constexpr unsigned int numAtomics = " << countAtomics << ";\n"
+        << "    static constexpr unsigned int numBlocks = " << countBlocks << ";\n"
+        << "    static constexpr unsigned int numFunctions = " << functionNames.size() << ";\n"
+        << "    static constexpr unsigned int numRegions = " << numRegions << ";\n"
+        << "    static constexpr unsigned long long kernelHash = 0x" << std::hex << kernelHash << std::dec << "ull;\n"
+        << "    static constexpr unsigned int wideKinds = " << recorderLayout.wideKinds() << ";\n"
+        << "    static constexpr unsigned int layoutWords = " << recorderLayout.totalWords << ";\n"
+        << "    static constexpr unsigned int branchOffset = " << recorderLayout.offset[recorder_layout::BRANCH] << ";\n"
+        << "    static constexpr unsigned int barrierOffset = " << recorderLayout.offset[recorder_layout::BARRIER] << ";\n"
+        << "    static constexpr unsigned int atomicOffset = " << recorderLayout.offset[recorder_layout::ATOMIC] << ";\n"
+        << "    static constexpr unsigned int blockOffset = " << recorderLayout.offset[recorder_layout::BLOCK] << ";\n"
+        << "    static constexpr unsigned int traceOffset = " << recorderLayout.offset[recorder_layout::TRACE] << ";\n"
+        << "    static constexpr unsigned int traceWords = " << recorderLayout.numElements[recorder_layout::TRACE] << ";\n"
+        << "    static constexpr unsigned int heatmapOffset = " << recorderLayout.offset[recorder_layout::HEATMAP] << ";\n"
+        << "    static constexpr unsigned int heatmapWords = " << recorderLayout.numElements[recorder_layout::HEATMAP] << ";\n"
+        << "    static constexpr unsigned int regionTimerOffset = " << recorderLayout.offset[recorder_layout::REGION_TIMER] << ";\n\n";
+
+    declProbeSites(ss, "conditions", countConditions, conditionLineMap, "CONDITION_PROBE", &conditionStringMap, &uniformConditions, "UNIFORM_PROBE");
+    declProbeSites(ss, "constantConditions", numConstantConditions, constantConditionLineMap, "CONDITION_PROBE", &constantConditionStringMap,
+        &alwaysTrueConditions, "CONSTANT_TRUE_PROBE", "CONSTANT_FALSE_PROBE");
+    declCoveredBefore(ss, countConditions, coveredBranches);
+    declProbeSites(ss, "barriers", countBarriers, barrierLineMap, "BARRIER_PROBE", NULL, &provenBarriers, "PROVEN_PROBE");
+    declProbeSites(ss, "atomics", countAtomics, atomicLineMap, "ATOMIC_PROBE", &atomicStringMap);
+    std::set<int> derivedBlocks;
+    for (auto it = blockEdgeMap.begin(); it != blockEdgeMap.end(); it++){
+        if (!it->second.counted) derivedBlocks.insert(it->first);
+    }
+    declProbeSites(ss, "blocks", countBlocks, blockLineMap, "BLOCK_PROBE", &blockFunctionMap, &derivedBlocks, "DERIVED_PROBE");
+    // Regions have no single source line
+    std::map<int, std::string> noLines;
+    declProbeSites(ss, "regions", numRegions, noLines, "REGION_PROBE", &regionNameMap);
+
+    ss << "    static const openclbc::BlockCost* blockCosts(){\n";
+    if (countBlocks){
+        ss << "        static constexpr openclbc::BlockCost costs[" << countBlocks << "] = {\n";
+        for (int i = 0; i < countBlocks; i++){
+            BlockWeight& weight = blockWeightMap[i];
+            ss << "            {" << functionIds[blockFunctionMap[i]] << ", {" << weight.globalLoadBytes << ", " << weight.globalStoreBytes
+                << ", " << weight.localLoadBytes << ", " << weight.localStoreBytes << ", " << weight.flops << "}}" << (i + 1 < countBlocks ? ",\n" : "\n");
+        }
+        ss << "        };\n        return costs;\n    }\n";
+    } else {
+        ss << "        return nullptr;\n    }\n";
+    }
+    // Edge of the control flow graph every block stands for, see runtime/EdgeProfile.h
+    ss << "    static const openclbc::ProfileEdge* profileEdges(){\n";
+    if (countBlocks && edgeProfiling){
+        ss << "        static constexpr openclbc::ProfileEdge edges[" << countBlocks << "] = {\n";
+        for (int i = 0; i < countBlocks; i++){
+            bool inGraph = blockEdgeMap.count(i) != 0;
+            ss << "            {" << (inGraph ? blockEdgeMap[i].from : -1) << ", " << (inGraph ? blockEdgeMap[i].to : -1)
+                << ", " << (blockBranchMap.count(i) ? blockBranchMap[i] : -1) << ", " << (inGraph && !blockEdgeMap[i].counted ? "false" : "true")
+                << "}" << (i + 1 < countBlocks ? ",\n" : "\n");
+        }
+        ss << "        };\n        return edges;\n    }\n";
+    } else {
+        ss << "        return nullptr;\n    }\n";
+    }
+    ss << "    static const char* const* functionNames(){\n";
+    if (!functionNames.empty()){
+        ss << "        static constexpr const char* names[" << functionNames.size() << "] = {";
+        for (size_t i = 0; i < functionNames.size(); i++){
+            ss << (i ? ", " : "") << cStringLiteral(functionNames[i]);
+        }
+        ss << "};\n        return names;\n    }\n";
+    } else {
+        ss << "        return nullptr;\n    }\n";
+    }
+    ss << "};\n\n}\n\n#endif\n";
+    return ss.str();
+}
+
+std::string declTimerHelpers(){
+    std::stringstream ss;
+    ss << "#define OCL_TIMESTAMP() ((ulong)(" << timestampHook << "))\n"
+        << "#define OCL_TIMER_REGION_END(regionid) atom_add(&" << kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME << "[regionid], OCL_TIMESTAMP() - "
+        << kernel_rewriter_constants::REGION_BEGIN_VARIABLE << ")\n"
+        << "#define OCL_TIMER_BARRIER_ENTRY(barrierid)\\\n"
+        << "  ulong ocl_barrier_entry = OCL_TIMESTAMP();\\\n"
+        << "  atom_add(&" << kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME << "[" << countTimedFunctions << " + 2 * (barrierid)], ocl_barrier_entry - "
+        << kernel_rewriter_constants::SEGMENT_BEGIN_VARIABLE << ")\n"
+        << "#define OCL_TIMER_BARRIER_EXIT(barrierid)\\\n"
+        << "  " << kernel_rewriter_constants::SEGMENT_BEGIN_VARIABLE << " = OCL_TIMESTAMP();\\\n"
+        << "  atom_add(&" << kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME << "[" << countTimedFunctions << " + 2 * (barrierid) + 1], "
+        << kernel_rewriter_constants::SEGMENT_BEGIN_VARIABLE << " - ocl_barrier_entry)\n";
+    return ss.str();
+}
+
+// Memory accesses through pointers and arrays; private scalars are assumed to live in registers
+bool isMemoryAccess(Expr* e){
+    e = e->IgnoreParens();
+    if (isa<ArraySubscriptExpr>(e)) return true;
+    if (UnaryOperator* unaryOperator = dyn_cast<UnaryOperator>(e)) return unaryOperator->getOpcode() == UO_Deref;
+    if (MemberExpr* memberExpr = dyn_cast<MemberExpr>(e)) return memberExpr->isArrow() || isMemoryAccess(memberExpr->getBase());
+    return false;
+}
+
+void addMemoryAccess(QualType type, bool isStore, ASTContext& context, BlockWeight& weight){
+    int bytes = context.getTypeSizeInChars(type).getQuantity();
+    if (type.getAddressSpace() == LangAS::opencl_global || type.getAddressSpace() == LangAS::opencl_constant){
+        if (isStore) weight.globalStoreBytes += bytes;
+        else weight.globalLoadBytes += bytes;
+    } else if (type.getAddressSpace() == LangAS::opencl_local){
+        if (isStore) weight.localStoreBytes += bytes;
+        else weight.localLoadBytes += bytes;
+    }
+}
+
+int floatingPointLanes(QualType type){
+    if (const VectorType* vectorType = type->getAs<VectorType>()){
+        return vectorType->getElementType()->isFloatingType() ? vectorType->getNumElements() : 0;
+    }
+    return type->isFloatingType() ? 1 : 0;
+}
+
+// Add the cost of one execution of s to weight, leaving out statements which are blocks of their own:
+// the sides of an if and the bodies of loops
+void addBlockWeight(Stmt* s, ASTContext& context, BlockWeight& weight){
+    if (!s) return;
+    if (IfStmt* ifStatement = dyn_cast<IfStmt>(s)){
+        addBlockWeight(ifStatement->getCond(), context, weight);
+        return;
+    }
+    if (ForStmt* forStatement = dyn_cast<ForStmt>(s)){
+        addBlockWeight(forStatement->getInit(), context, weight);
+        return;
+    }
+    if (isa<WhileStmt>(s) || isa<DoStmt>(s)) return;
+
+    if (ImplicitCastExpr* castExpr = dyn_cast<ImplicitCastExpr>(s)){
+        if (castExpr->getCastKind() == CK_LValueToRValue && isMemoryAccess(castExpr->getSubExpr())){
+            addMemoryAccess(castExpr->getSubExpr()->getType(), false, context, weight);
+        }
+    } else if (BinaryOperator* binaryOperator = dyn_cast<BinaryOperator>(s)){
+        BinaryOperatorKind opcode = binaryOperator->getOpcode();
+        if (binaryOperator->isAssignmentOp() && isMemoryAccess(binaryOperator->getLHS())){
+            addMemoryAccess(binaryOperator->getLHS()->getType(), true, context, weight);
+            if (binaryOperator->isCompoundAssignmentOp()){
+                addMemoryAccess(binaryOperator->getLHS()->getType(), false, context, weight);
+            }
+        }
+        if (opcode == BO_Add || opcode == BO_Sub || opcode == BO_Mul || opcode == BO_Div
+            || opcode == BO_AddAssign || opcode == BO_SubAssign || opcode == BO_MulAssign || opcode == BO_DivAssign){
+            weight.flops += floatingPointLanes(binaryOperator->getType());
+        }
+    } else if (UnaryOperator* unaryOperator = dyn_cast<UnaryOperator>(s)){
+        if (unaryOperator->isIncrementDecrementOp() && isMemoryAccess(unaryOperator->getSubExpr())){
+            addMemoryAccess(unaryOperator->getSubExpr()->getType(), false, context, weight);
+            addMemoryAccess(unaryOperator->getSubExpr()->getType(), true, context, weight);
+        }
+    } else if (CallExpr* functionCall = dyn_cast<CallExpr>(s)){
+        FunctionDecl* callee = functionCall->getDirectCallee();
+        if (callee && setFunctions.find(callee->getNameAsString()) == setFunctions.end()){
+            std::string calleeName = callee->getNameAsString();
+            if (calleeName.compare(0, 5, "vload") == 0 && functionCall->getNumArgs() == 2){
+                QualType pointeeType = functionCall->getArg(1)->getType()->getPointeeType();
+                addMemoryAccess(context.getAddrSpaceQualType(functionCall->getType(), pointeeType.getAddressSpace()), false, context, weight);
+            } else if (calleeName.compare(0, 6, "vstore") == 0 && functionCall->getNumArgs() == 3){
+                QualType pointeeType = functionCall->getArg(2)->getType()->getPointeeType();
+                addMemoryAccess(context.getAddrSpaceQualType(functionCall->getArg(0)->getType(), pointeeType.getAddressSpace()), true, context, weight);
+            } else if (calleeName.compare(0, 8, "convert_") != 0 && calleeName.compare(0, 3, "as_") != 0){
+                // Math builtins count as one operation per lane, fused multiply-add as two
+                int operations = (calleeName == "fma" || calleeName == "mad") ? 2 : 1;
+                weight.flops += operations * floatingPointLanes(functionCall->getType());
+            }
+        }
+    }
+
+    for (Stmt* child : s->children()){
+        addBlockWeight(child, context, weight);
+    }
+}
 
 // First AST visitor: counting if-conditions and user-defined functions
 class RecursiveASTVisitorForKernelInvastigator : public RecursiveASTVisitor<RecursiveASTVisitorForKernelInvastigator> {
 public:
-    explicit RecursiveASTVisitorForKernelInvastigator(Rewriter &r) : myRewriter(r) {}
+    explicit RecursiveASTVisitorForKernelInvastigator(Rewriter &r) : myRewriter(r), astContext(NULL) {}
 
     // count the number of if-conditions
     bool VisitStmt(Stmt *s) {
         if (isa<IfStmt>(s)){
-            countConditions++;
+            bool constantValue;
+            bool constant = isConstantCondition(cast<IfStmt>(s), *astContext, constantValue);
+            if (!constant){
+                countConditions++;
+                recorderSlots.addProbes(RecorderSlots::CONDITION, 1);
+            }
+            if (profileRoofline){
+                // With edge profiling, a missing else is a block too: it is one side of the flow
+                int blocks = cast<IfStmt>(s)->getElse() || (edgeProfiling && !constant) ? 2 : 1;
+                countBlocks += blocks;
+                recorderSlots.addProbes(RecorderSlots::BLOCK, blocks);
+            }
+        }else if (isa<ForStmt>(s) || isa<WhileStmt>(s) || isa<DoStmt>(s)){
+            if (profileRoofline){
+                countBlocks++;
+                recorderSlots.addProbes(RecorderSlots::BLOCK, 1);
+            }
         }else if (isa<CallExpr>(s)){
             CallExpr *functionCall = cast<CallExpr>(s);
             std::string functionName = myRewriter.getRewrittenText(functionCall->getCallee()->getSourceRange());
             if (functionName == "barrier") {
                 countBarriers++;
+            } else if (isProfiledAtomicCall(functionCall, functionName, myRewriter.getSourceMgr())) {
+                countAtomics++;
+                recorderSlots.addProbes(RecorderSlots::ATOMIC, 1);
             }
+            recorderSlots.addCall(functionName);
         }
         return true;
     }
@@ -74,16 +519,28 @@ public:
         sr.setEnd(locEnd);
         
         std::string typeString = myRewriter.getRewrittenText(sr);
+        astContext = &f->getASTContext();
         if (typeString != "__kernel"){
             if (f->hasBody()){
                 setFunctions.insert(f->getQualifiedNameAsString());
             }
         }
+        if (f->hasBody()){
+            recorderSlots.addFunction(f->getQualifiedNameAsString(), typeString == "__kernel");
+        }
+        if (profileRoofline && f->hasBody()){
+            countBlocks++;
+            recorderSlots.addProbes(RecorderSlots::BLOCK, 1);
+        }
+        if (timeRegions && f->hasBody()){
+            countTimedFunctions++;
+        }
         return true;
     }
 
 private:
     Rewriter &myRewriter;
+    ASTContext* astContext;
 };
 
 class ASTConsumerForKernelInvastigator : public ASTConsumer{
@@ -143,19 +600,50 @@ public:
             SourceRange conditionRange;
             conditionRange.setBegin(conditionStart);
             conditionRange.setEnd(conditionEnd);
-            // Insert to the hashmap of line numbers of conditions
-            // Line number needs to be adjusted due to possible added lines of fake header statements
-            conditionLineMap[numConditions] = correctSourceLine(locIfStatement, numAddedLines);
-            // Insert to the hashmap of text of conditions
-            conditionStringMap[numConditions] = myRewriter.getRewrittenText(conditionRange);
+            bool constantValue = false;
+            bool constant = isConstantCondition(IfStatement, *astContext, constantValue);
+            if (constant){
+                // Known without running the kernel: no probes and no added else
+                constantConditionLineMap[numConstantConditions] = correctSourceLine(locIfStatement, numAddedLines);
+                constantConditionStringMap[numConstantConditions] = myRewriter.getRewrittenText(conditionRange);
+                if (constantValue) alwaysTrueConditions.insert(numConstantConditions);
+                numConstantConditions++;
+            } else {
+                // Insert to the hashmap of line numbers of conditions
+                // Line number needs to be adjusted due to possible added lines of fake header statements
+                conditionLineMap[numConditions] = correctSourceLine(locIfStatement, numAddedLines);
+                // Insert to the hashmap of text of conditions
+                conditionStringMap[numConditions] = myRewriter.getRewrittenText(conditionRange);
+            }
+            bool uniform = !constant && !(edgeProfiling && !recordHeatmap) && uniformBranches && uniformity && uniformity->isUniformBranch(IfStatement);
+            if (uniform) uniformConditions.insert(numConditions);
 
             Stmt* Then = IfStatement->getThen();
+            int thenBlock = newBlock(Then, Then, IfStatement, 0);
+            int elseBlock = -1;
+            if (IfStatement->getElse()){
+                elseBlock = newBlock(IfStatement->getElse(), IfStatement->getElse(), IfStatement, 1);
+            } else if (edgeProfiling && !constant){
+                elseBlock = newBlock(IfStatement, NULL, IfStatement, 1);
+            }
+            if (edgeProfiling && !constant){
+                blockBranchMap[thenBlock] = 2 * numConditions;
+                blockBranchMap[elseBlock] = 2 * numConditions + 1;
+            }
+            std::string thenProbe = (constant ? "" : stmtRecordCoverage(2 * numConditions, uniform)) + stmtRecordBlock(thenBlock);
+            std::string elseProbe = (constant ? "" : stmtRecordCoverage(2 * numConditions + 1, uniform)) + stmtRecordBlock(elseBlock);
+            // A single return statement as then or else is rewritten together with the if,
+            // so the timer has to be stopped in the probe in front of it
+            thenProbe.append(stmtEndRegionBeforeReturn(Then));
+            if (IfStatement->getElse()){
+                elseProbe.append(stmtEndRegionBeforeReturn(IfStatement->getElse()));
+            }
             if(isa<CompoundStmt>(Then)) {
                 // Then is a compound statement
                 // Add coverage recorder to the end of the compound
                 myRewriter.InsertTextAfter(
                     Then->getLocStart().getLocWithOffset(1),
-                    stmtRecordCoverage(2 * numConditions)
+                    thenProbe
                     );
             } else {
                 // Then is a single statement
@@ -175,13 +663,13 @@ public:
                 bool hasElse = false;
                 if (IfStatement->getElse()) hasElse = true;
                 sourcestream << "{"
-                        << stmtRecordCoverage(2 * numConditions)
-                        << originalRewriter.getRewrittenText(newRange) 
+                        << thenProbe
+                        << textTimedReturn(Then, originalRewriter.getRewrittenText(newRange))
                         << ";\n}";
                 
-                if (!hasElse){
+                if (!hasElse && !elseProbe.empty()){
                     sourcestream << " else { "
-                        << stmtRecordCoverage(2 * numConditions + 1)
+                        << elseProbe
                         << "}\n";
                 }
                 myRewriter.ReplaceText(
@@ -189,8 +677,8 @@ public:
                     originalRewriter.getRewrittenText(newRange).length() + 1,
                     sourcestream.str()
                 );
-                if(!hasElse){
-                    numConditions++;
+                if(!IfStatement->getElse()){
+                    if (!constant) numConditions++;
                     return true;
                 }
             }
@@ -203,13 +691,13 @@ public:
                     // Add coverage recorder to the end of the compound
                     myRewriter.InsertTextAfter(
                         Else->getLocStart().getLocWithOffset(1),
-                        stmtRecordCoverage(2 * numConditions + 1)
+                        elseProbe
                         );
                 } else if (isa<IfStmt>(Else)) {
                     // Else is another condition (else if)
                     std::stringstream ss;
                     ss << "{\n"
-                        << stmtRecordCoverage(2 * numConditions + 1)
+                        << elseProbe
                         << "\n";
                     myRewriter.InsertTextAfter(
                         Else->getLocStart(),
@@ -232,8 +720,8 @@ public:
                 
                     std::stringstream sourcestream;
                     sourcestream << "{"
-                        << stmtRecordCoverage(2 * numConditions + 1)
-                        << myRewriter.getRewrittenText(newRange) 
+                        << elseProbe
+                        << textTimedReturn(Else, myRewriter.getRewrittenText(newRange))
                         << ";\n}";
                     myRewriter.ReplaceText(
                         newRange.getBegin(),
@@ -242,12 +730,12 @@ public:
                     );
                 }
                 
-            } else {
+            } else if (!elseProbe.empty()) {
                 // Else does not exist
                 // Add corresponding else and coverage recorder in it
                 std::stringstream newElse;
                 newElse << "else {\n" 
-                    << stmtRecordCoverage(2 * numConditions + 1)
+                    << elseProbe
                     << "}\n";
                 myRewriter.InsertTextBefore(
                     IfStatement->getSourceRange().getEnd().getLocWithOffset(2),
@@ -255,7 +743,43 @@ public:
                 );
             }
             
-            numConditions++;
+            if (!constant) numConditions++;
+        } else if (profileRoofline && (isa<ForStmt>(s) || isa<WhileStmt>(s) || isa<DoStmt>(s))){
+            // Deal with loops: the body is a block counted once per iteration
+            Stmt* body;
+            if (ForStmt* forStatement = dyn_cast<ForStmt>(s)) body = forStatement->getBody();
+            else if (WhileStmt* whileStatement = dyn_cast<WhileStmt>(s)) body = whileStatement->getBody();
+            else body = cast<DoStmt>(s)->getBody();
+
+            std::string loopProbe = stmtRecordBlock(newBlock(s, body));
+            if (isa<CompoundStmt>(body)){
+                myRewriter.InsertTextAfter(body->getLocStart().getLocWithOffset(1), loopProbe);
+            } else {
+                // Loop body is a single statement: decorate it with {} without touching its text
+                SourceManager& sourceManager = myRewriter.getSourceMgr();
+                SourceLocation bodyStart = sourceManager.getFileLoc(body->getLocStart());
+                SourceLocation bodyEnd = Lexer::findLocationAfterToken(
+                    sourceManager.getFileLoc(body->getLocEnd()), tok::semi, sourceManager, myRewriter.getLangOpts(), false);
+                if (bodyEnd.isInvalid()){
+                    bodyEnd = Lexer::getLocForEndOfToken(
+                        sourceManager.getFileLoc(body->getLocEnd()), 0, sourceManager, myRewriter.getLangOpts());
+                }
+                myRewriter.InsertTextBefore(bodyStart, "{" + loopProbe);
+                myRewriter.InsertTextAfter(bodyEnd, "}\n");
+            }
+        } else if (timeRegions && isa<ReturnStmt>(s) && returnsTimedByIf.find(s) == returnsTimedByIf.end()){
+            // Stop the timer of the function before leaving it, once the returned value is computed
+            ReturnStmt* returnStatement = cast<ReturnStmt>(s);
+            SourceManager& sourceManager = myRewriter.getSourceMgr();
+            SourceLocation returnEnd = Lexer::findLocationAfterToken(
+                sourceManager.getFileLoc(s->getLocEnd()), tok::semi, sourceManager, myRewriter.getLangOpts(), false);
+            if (returnEnd.isValid() && splitsReturn(returnStatement)){
+                myRewriter.ReplaceText(returnStatement->getReturnLoc(), 6, "{" + declReturnValue(returnStatement));
+                myRewriter.InsertTextAfter(returnEnd, "\n" + stmtReturnValue(returnStatement) + ";}");
+            } else if (returnEnd.isValid()){
+                myRewriter.InsertTextBefore(sourceManager.getFileLoc(s->getLocStart()), "{" + stmtEndRegion() + " ");
+                myRewriter.InsertTextAfter(returnEnd, "}");
+            }
         } else if (isa<CallExpr>(s)){
             CallExpr *functionCall = cast<CallExpr>(s);
             SourceLocation startLoc = myRewriter.getSourceMgr().getFileLoc(
@@ -270,7 +794,7 @@ public:
             if (setFunctions.find(functionName) != setFunctions.end()){
                 myRewriter.InsertTextAfter(
                     functionCall->getLocEnd().getLocWithOffset(0),
-                    localRecorderArgument()
+                    localRecorderArgument(functionName)
                 );
             }
             if (functionName == "barrier") {
@@ -279,17 +803,52 @@ public:
                 std::string locBarrierCall = functionCall->getLocStart().printToString(myRewriter.getSourceMgr());
                 barrierLineMap[numBarriers] = correctSourceLine(locBarrierCall, numAddedLines);
 
-                Expr* barrierArg = functionCall->getArg(0);
-                std::stringstream newBarrierCall;
-                SourceLocation barrierArgStartLoc = myRewriter.getSourceMgr().getFileLoc(barrierArg->getLocStart());
-                SourceLocation barrierArgEndLoc = myRewriter.getSourceMgr().getFileLoc(barrierArg->getLocEnd());
-                SourceRange barrierArgRange;
-                barrierArgRange.setBegin(barrierArgStartLoc);
-                barrierArgRange.setEnd(barrierArgEndLoc);
-                newBarrierCall << "OCL_NEW_BARRIER(" << numBarriers << "," << myRewriter.getRewrittenText(barrierArgRange) << ")";
-                myRewriter.ReplaceText(functionCall->getSourceRange(), newBarrierCall.str());
+                // Reached by the whole work-group or by none of it: the barrier cannot diverge. It keeps its ID
+                // and recorder slot, which stays clear, so the layout does not depend on what was proven.
+                // Without traces or timers, such a barrier is left untouched.
+                bool proven = proveBarriers && uniformity && uniformity->hasUniformControl(functionCall);
+                if (proven){
+                    provenBarriers.insert(numBarriers);
+                }
+
+                if (!proven || traceEvents || timeRegions){
+                    Expr* barrierArg = functionCall->getArg(0);
+                    std::stringstream newBarrierCall;
+                    SourceLocation barrierArgStartLoc = myRewriter.getSourceMgr().getFileLoc(barrierArg->getLocStart());
+                    SourceLocation barrierArgEndLoc = myRewriter.getSourceMgr().getFileLoc(barrierArg->getLocEnd());
+                    SourceRange barrierArgRange;
+                    barrierArgRange.setBegin(barrierArgStartLoc);
+                    barrierArgRange.setEnd(barrierArgEndLoc);
+                    newBarrierCall << (proven ? "OCL_PROVEN_BARRIER(" : "OCL_NEW_BARRIER(") << numBarriers << "," << myRewriter.getRewrittenText(barrierArgRange) << ")";
+                    myRewriter.ReplaceText(functionCall->getSourceRange(), newBarrierCall.str());
+                }
 
                 numBarriers++;
+            } else if (isProfiledAtomicCall(functionCall, functionName, myRewriter.getSourceMgr())) {
+                // Count executions of this call site and how many of them hit the same address
+                // as the work-item before them: atomic_xxx(ocl_atomic_probe_n(..., slot, addr), ...)
+                // The address is wrapped where it stands, so it is evaluated once and keeps its own rewriting.
+                SourceManager& sourceManager = myRewriter.getSourceMgr();
+                std::string locAtomicCall = functionCall->getLocStart().printToString(sourceManager);
+                atomicLineMap[numAtomics] = correctSourceLine(locAtomicCall, numAddedLines);
+                atomicStringMap[numAtomics] = functionName;
+
+                Expr* addressArg = functionCall->getArg(0);
+                std::string addressType = addressArg->IgnoreParenImpCasts()->getType().getCanonicalType().getAsString();
+                if (atomicProbeTypes.find(addressType) == atomicProbeTypes.end()){
+                    int probeIndex = atomicProbeTypes.size();
+                    atomicProbeTypes[addressType] = probeIndex;
+                }
+                SourceLocation addressStart = sourceManager.getExpansionLoc(addressArg->getLocStart());
+                SourceLocation addressEnd = Lexer::getLocForEndOfToken(
+                    sourceManager.getExpansionRange(addressArg->getLocEnd()).getEnd(), 0, sourceManager, myRewriter.getLangOpts());
+                std::stringstream atomicProbe;
+                atomicProbe << "ocl_atomic_probe_" << atomicProbeTypes[addressType] << "(" << kernel_rewriter_constants::LOCAL_ATOMIC_COUNTER_NAME
+                    << ", " << kernel_rewriter_constants::LOCAL_ATOMIC_ADDRESS_TABLE_NAME << ", " << slot(RecorderSlots::ATOMIC, numAtomics) << ", ";
+                myRewriter.InsertTextBefore(addressStart, atomicProbe.str());
+                myRewriter.InsertTextAfter(addressEnd, ")");
+
+                numAtomics++;
             }
         }
         
@@ -313,6 +872,26 @@ public:
         std::string typeString = myRewriter.getRewrittenText(sr);
         std::string functionName = f->getQualifiedNameAsString();
         bool needComma = f->getNumParams() == 0? false: true;
+        if (f->hasBody()){
+            currentFunctionName = functionName;
+            currentFunctionIsKernel = typeString == "__kernel";
+            astContext = &f->getASTContext();
+            // Helper functions may be called under divergent control flow, so only kernel bodies are analysed
+            uniformity.reset((uniformBranches || proveBarriers) && typeString == "__kernel"
+                ? new UniformityAnalysis(f, *astContext, setFunctions) : NULL);
+            if (edgeProfiling){
+                ASTContext* context = astContext;
+                placement.reset(new ProbePlacement(f, *astContext, [context](const IfStmt* ifStatement){
+                    bool value;
+                    return !isConstantCondition(ifStatement, *context, value);
+                }, numEdgeNodes));
+                numEdgeNodes += placement->getNumNodes();
+            }
+            if (timeRegions){
+                currentRegion = numTimedFunctions++;
+                regionNameMap[currentRegion] = (typeString == "__kernel" ? "kernel " : "function ") + functionName;
+            }
+        }
         if (typeString == "__kernel"){
             if (f->hasBody()){
                 // add global recorder array as argument to function definition
@@ -325,17 +904,21 @@ public:
 
                 // define recorder array as __local array
                 loc = f->getBody()->getLocStart().getLocWithOffset(1);
+                myRewriter.InsertTextAfter(loc, declGlobalRecorders());
                 myRewriter.InsertTextAfter(loc, declLocalRecorder());
+                myRewriter.InsertTextAfter(loc, declRecorderContext());
+                myRewriter.InsertTextAfter(loc, stmtInitLocalRecorder());
+                myRewriter.InsertTextAfter(loc, stmtRecordBlock(newBlock(f->getBody(), f->getBody())));
+                myRewriter.InsertTextAfter(loc, stmtBeginRegion());
                 
                 // update local recorder to global recorder array
-                if (countConditions){
-                    loc = f->getBody()->getLocEnd();
-                    myRewriter.InsertTextAfter(loc, stmtUpdateGlobalRecorder());
-                }
+                loc = f->getBody()->getLocEnd();
+                myRewriter.InsertTextAfter(loc, stmtEndRegion());
+                myRewriter.InsertTextAfter(loc, stmtUpdateGlobalRecorder());
 
                 // Host code generator part 2: Set argument
                 int argumentLocation = f->param_size();
-                hostCodeGenerator.setArgument(functionName, argumentLocation);
+                hostCodeGenerator.setArgument(functionName, argumentLocation, localRecorderBytes());
 
             }
             else {
@@ -353,6 +936,15 @@ public:
                 unsigned offset = funcFirstLine.find_last_of(')');
                 SourceLocation loc = f->getLocStart().getLocWithOffset(offset);
                 myRewriter.InsertTextAfter(loc, declLocalRecorderArgument(needComma));
+
+                loc = f->getBody()->getLocStart().getLocWithOffset(1);
+                myRewriter.InsertTextAfter(loc, stmtUnpackRecorderContext());
+                myRewriter.InsertTextAfter(loc, stmtRecordBlock(newBlock(f->getBody(), f->getBody())));
+                myRewriter.InsertTextAfter(loc, stmtBeginRegion());
+
+                // Only reached by functions returning void without a return statement
+                loc = f->getBody()->getLocEnd();
+                myRewriter.InsertTextAfter(loc, stmtEndRegion());
             } else {
                 // If it is a function declaration without definition
                 SourceLocation loc = f->getLocEnd();
@@ -365,83 +957,386 @@ public:
 private:
     Rewriter &myRewriter;
     Rewriter &originalRewriter;
+    std::string currentFunctionName; // Function whose body is being visited
+    bool currentFunctionIsKernel;
+    ASTContext* astContext;
+    int currentRegion; // Timer region of the function whose body is being visited
+    std::set<Stmt*> returnsTimedByIf; // Return statements already dealt with by the if they belong to
+    std::unique_ptr<UniformityAnalysis> uniformity; // Of the kernel being visited, for uniform branches and proven barriers
+    std::unique_ptr<ProbePlacement> placement; // Of the function being visited, for edge profiling
+
+    std::string stmtBeginRegion(){
+        if (!timeRegions) return "";
+        std::stringstream ss;
+        ss << "\nulong " << kernel_rewriter_constants::REGION_BEGIN_VARIABLE << " = OCL_TIMESTAMP();\n"
+            << "ulong " << kernel_rewriter_constants::SEGMENT_BEGIN_VARIABLE << " = " << kernel_rewriter_constants::REGION_BEGIN_VARIABLE << ";\n";
+        return ss.str();
+    }
+
+    std::string stmtEndRegion(){
+        if (!timeRegions) return "";
+        std::stringstream ss;
+        ss << "OCL_TIMER_REGION_END(" << currentRegion << ");\n";
+        return ss.str();
+    }
+
+    std::string stmtEndRegionBeforeReturn(Stmt* s){
+        if (!timeRegions || !isa<ReturnStmt>(s)) return "";
+        returnsTimedByIf.insert(s);
+        return splitsReturn(cast<ReturnStmt>(s)) ? "" : stmtEndRegion();
+    }
+
+    // A return with a value stops the timer once the value is computed:
+    //     { T ocl_return_value = value; OCL_TIMER_REGION_END(id); return ocl_return_value; }
+    // or { value; OCL_TIMER_REGION_END(id); return; } for a void value. Without a value, or when the return
+    // keyword comes from a macro, the timer is stopped in front of the return.
+    bool splitsReturn(ReturnStmt* returnStatement){
+        return timeRegions && returnStatement->getRetValue() && returnStatement->getReturnLoc().isFileID();
+    }
+
+    std::string declReturnValue(ReturnStmt* returnStatement){
+        QualType type = returnStatement->getRetValue()->getType();
+        if (type->isVoidType()) return "";
+        return type.getUnqualifiedType().getAsString() + " " + kernel_rewriter_constants::RETURN_VALUE_VARIABLE + " =";
+    }
+
+    std::string stmtReturnValue(ReturnStmt* returnStatement){
+        if (returnStatement->getRetValue()->getType()->isVoidType()) return stmtEndRegion() + "return";
+        return stmtEndRegion() + "return " + kernel_rewriter_constants::RETURN_VALUE_VARIABLE;
+    }
+
+    // Text of a single return statement rewritten together with the if it belongs to, without its semicolon
+    std::string textTimedReturn(Stmt* s, std::string text){
+        if (!isa<ReturnStmt>(s) || !splitsReturn(cast<ReturnStmt>(s))) return text;
+        ReturnStmt* returnStatement = cast<ReturnStmt>(s);
+        if (text.compare(0, 6, "return") != 0) return stmtEndRegion() + text;
+        return declReturnValue(returnStatement) + text.substr(6) + ";\n" + stmtReturnValue(returnStatement);
+    }
 
-    std::string stmtRecordCoverage(const int& id){
+    // Register a block entered at location of start whose statements are those of region
+    // owner and side tell which edge of the control flow graph the block stands for, see ProbePlacement
+    // Returns the block ID, or -1 if blocks are not profiled
+    int newBlock(Stmt* start, Stmt* region, const Stmt* owner = NULL, int side = 0){
+        if (!profileRoofline) return -1;
+        BlockWeight weight;
+        addBlockWeight(region, *astContext, weight);
+        if (ForStmt* forStatement = dyn_cast<ForStmt>(start)){
+            // Condition and increment are evaluated once per iteration as well
+            addBlockWeight(forStatement->getCond(), *astContext, weight);
+            addBlockWeight(forStatement->getInc(), *astContext, weight);
+        } else if (WhileStmt* whileStatement = dyn_cast<WhileStmt>(start)){
+            addBlockWeight(whileStatement->getCond(), *astContext, weight);
+        } else if (DoStmt* doStatement = dyn_cast<DoStmt>(start)){
+            addBlockWeight(doStatement->getCond(), *astContext, weight);
+        }
+        std::string locBlock = start->getLocStart().printToString(myRewriter.getSourceMgr());
+        blockLineMap[numBlocks] = correctSourceLine(locBlock, numAddedLines);
+        blockFunctionMap[numBlocks] = currentFunctionName;
+        blockWeightMap[numBlocks] = weight;
+        ProbePlacement::Edge edge;
+        if (placement && placement->getEdge(owner ? owner : start, side, edge)){
+            blockEdgeMap[numBlocks] = edge;
+        }
+        return numBlocks++;
+    }
+
+    std::string stmtRecordBlock(int id){
+        // Blocks on the spanning tree are counted by the host from the others
+        if (id < 0 || (blockEdgeMap.count(id) && !blockEdgeMap[id].counted)) return "";
         std::stringstream ss;
+        ss << "\natomic_inc(&" << kernel_rewriter_constants::LOCAL_BLOCK_COUNTER_NAME << "[" << slot(RecorderSlots::BLOCK, id) << "]);\n";
+        return ss.str();
+    }
+
+    std::string stmtRecordCoverage(const int& id, bool uniform = false){
+        std::stringstream ss;
+        int branchSlot = 2 * slot(RecorderSlots::CONDITION, id / 2) + id % 2;
         // old implementation
         // ss << kernel_rewriter_constants::COVERAGE_RECORDER_NAME << "[" << id << "] = true;\n";
         // replaced by atomic_or operation to avoid data race
-        ss << "\natomic_or(&" << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[" << id << "], 1);\n";
+        if (edgeProfiling && !recordHeatmap){
+            // The host sets the flag from the count of the block of this side
+        } else if (coveredBranches.count(id) && !recordHeatmap){
+            // Covered in a previous run: the flag would not add anything to the merged dump
+        } else if (uniform){
+            // The whole work-group takes this side or none of it does, so one work-item records it without an atomic
+            ss << "\nif (ocl_get_local_linear_id() == 0) " << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[" << branchSlot << "] = 1;\n";
+        } else {
+            ss << "\natomic_or(&" << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[" << branchSlot << "], 1);\n";
+        }
+        if (traceEvents){
+            ss << "OCL_TRACE_EVENT(" << id << ");\n";
+        }
         return ss.str();
     }
 
-    std::string declRecorder(bool needComma=true){
+    std::string joinParameters(const std::vector<std::string>& parameters, bool needComma){
         std::stringstream ss;
-        if (needComma) ss << ", ";
-        if (countConditions){
-            ss << "__global int* " << kernel_rewriter_constants::GLOBAL_COVERAGE_RECORDER_NAME;
-            if (countBarriers){
-                ss << ", __global int* " << kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME;
-            }
-        } else {
-            if (countBarriers){
-                ss << "__global int* " << kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME;
-            }
+        for (auto it = parameters.begin(); it != parameters.end(); it++){
+            if (needComma || it != parameters.begin()) ss << ", ";
+            ss << *it;
         }
         return ss.str();
     }
 
-    std::string declLocalRecorder(){
+    std::string declRecorder(bool needComma=true){
+        std::vector<std::string> parameters;
+        if (!recorderLayout.empty()){
+            parameters.push_back(std::string("__global uint* ") + kernel_rewriter_constants::GLOBAL_INSTRUMENTATION_BUFFER_NAME);
+        }
+        return joinParameters(parameters, needComma);
+    }
+
+    // Recorders are views into the instrumentation buffer, under the names the probes use
+    std::string declGlobalRecorders(){
         std::stringstream ss;
+        declGlobalRecorder(ss, recorder_layout::BRANCH, "int", kernel_rewriter_constants::GLOBAL_COVERAGE_RECORDER_NAME);
+        declGlobalRecorder(ss, recorder_layout::BARRIER, "int", kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME);
+        declGlobalRecorder(ss, recorder_layout::ATOMIC, accumulateLaunches ? "ulong" : "int", kernel_rewriter_constants::GLOBAL_ATOMIC_COUNTER_NAME);
+        declGlobalRecorder(ss, recorder_layout::BLOCK, "ulong", kernel_rewriter_constants::GLOBAL_BLOCK_COUNTER_NAME);
+        declGlobalRecorder(ss, recorder_layout::TRACE, "uint", kernel_rewriter_constants::GLOBAL_TRACE_BUFFER_NAME);
+        declGlobalRecorder(ss, recorder_layout::HEATMAP, "uint", kernel_rewriter_constants::GLOBAL_HEATMAP_NAME);
+        declGlobalRecorder(ss, recorder_layout::REGION_TIMER, "ulong", kernel_rewriter_constants::GLOBAL_REGION_TIMER_NAME);
+        return ss.str();
+    }
+
+    void declGlobalRecorder(std::stringstream& ss, recorder_layout::RecorderKind kind, std::string type, std::string name){
+        if (!recorderLayout.has(kind)) return;
+        ss << "__global " << type << "* " << name << " = (__global " << type << "*)(" 
+            << kernel_rewriter_constants::GLOBAL_INSTRUMENTATION_BUFFER_NAME << " + " << recorderLayout.offset[kind] << ");\n";
+    }
+
+    struct LocalRecorder{
+        std::string type;
+        std::string name;
+        int size;
+    };
+
+    // __local recorders of the kernel being visited, sized for the probes it can reach, see RecorderSlots
+    std::vector<LocalRecorder> localRecorders(){
+        std::vector<LocalRecorder> recorders;
         if (countConditions){
-            ss << "__local int " << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[" << 2 * countConditions << "];\n";
+            recorders.push_back({"int", kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME, 2 * numSlots(RecorderSlots::CONDITION)});
         }
         if (countBarriers){
-            ss << "__local int " << kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME << "[" << countBarriers << "];\n";
+            recorders.push_back({"int", kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME, countBarriers});
+        }
+        if (countAtomics){
+            recorders.push_back({"ulong", kernel_rewriter_constants::LOCAL_ATOMIC_ADDRESS_TABLE_NAME, numSlots(RecorderSlots::ATOMIC)});
+            recorders.push_back({"int", kernel_rewriter_constants::LOCAL_ATOMIC_COUNTER_NAME, 2 * numSlots(RecorderSlots::ATOMIC)});
+        }
+        if (countBlocks){
+            recorders.push_back({"uint", kernel_rewriter_constants::LOCAL_BLOCK_COUNTER_NAME, numSlots(RecorderSlots::BLOCK)});
+        }
+        if (timeRegions){
+            recorders.push_back({"ulong", kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME, numRegions()});
+        }
+        return recorders;
+    }
+
+    // Declared whenever the file has probes of their kind, since helpers take them as arguments
+    int numSlots(RecorderSlots::ProbeKind kind){
+        return std::max(1, recorderSlots.getNumSlots(currentFunctionName, kind));
+    }
+
+    int slot(RecorderSlots::ProbeKind kind, int id){
+        return recorderSlots.getSlot(currentFunctionName, kind, id);
+    }
+
+    std::string declLocalRecorder(){
+        std::stringstream ss;
+        for (const LocalRecorder& recorder : localRecorders()){
+            ss << "__local " << recorder.type << " " << recorder.name << "[" << recorder.size << "];\n";
         }
         return ss.str();
     }
 
+    int localRecorderBytes(){
+        int bytes = 0;
+        for (const LocalRecorder& recorder : localRecorders()){
+            bytes += recorder.size * (recorder.type == "ulong" ? 8 : 4);
+        }
+        return bytes;
+    }
+
     std::string declLocalRecorderArgument(bool needComma=true){
-        std::stringstream ss;
-        if (needComma){
-            ss << ", ";
+        std::vector<std::string> parameters;
+        if (passRecorderContext()){
+            parameters.push_back(std::string("struct ") + kernel_rewriter_constants::RECORDER_CONTEXT_TYPE + "* "
+                + kernel_rewriter_constants::RECORDER_CONTEXT_NAME);
+            return joinParameters(parameters, needComma);
+        }
+        for (auto& recorder : helperRecorders()){
+            parameters.push_back(recorder.first + " " + recorder.second);
         }
+        return joinParameters(parameters, needComma);
+    }
+
+    // Kernels pass their recorders from the offset of the component of the helper on
+    std::string localRecorderFrom(std::string name, int slot){
+        return slot ? name + " + " + std::to_string(slot) : name;
+    }
+
+    int componentOffset(int component, RecorderSlots::ProbeKind kind){
+        return component < 0 ? 0 : recorderSlots.getComponentOffset(currentFunctionName, component, kind);
+    }
+
+    // Recorders passed to the helpers of a component, in the order of helperRecorders; -1 passes them on unchanged
+    std::vector<std::string> localRecorderValues(int component){
+        std::vector<std::string> arguments;
+        int conditionSlot = componentOffset(component, RecorderSlots::CONDITION);
+        int atomicSlot = componentOffset(component, RecorderSlots::ATOMIC);
+        int blockSlot = componentOffset(component, RecorderSlots::BLOCK);
         if (countConditions){
-            ss << "__local int* " << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME;
-            if (countBarriers){
-                ss << ", __global int* " << kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME
-                    << ", __local int* " << kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME;
-            }
-        } else {
-            if (countBarriers){
-                ss << "__global int* " << kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME
-                    << ", __local int* " << kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME;
+            arguments.push_back(localRecorderFrom(kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME, 2 * conditionSlot));
+        }
+        if (countBarriers){
+            arguments.push_back(kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME);
+            arguments.push_back(kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME);
+        }
+        if (countAtomics){
+            arguments.push_back(localRecorderFrom(kernel_rewriter_constants::LOCAL_ATOMIC_ADDRESS_TABLE_NAME, atomicSlot));
+            arguments.push_back(localRecorderFrom(kernel_rewriter_constants::LOCAL_ATOMIC_COUNTER_NAME, 2 * atomicSlot));
+        }
+        if (countBlocks){
+            arguments.push_back(localRecorderFrom(kernel_rewriter_constants::LOCAL_BLOCK_COUNTER_NAME, blockSlot));
+        }
+        if (traceEvents){
+            arguments.push_back(kernel_rewriter_constants::GLOBAL_TRACE_BUFFER_NAME);
+        }
+        if (timeRegions){
+            arguments.push_back(kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME);
+        }
+        return arguments;
+    }
+
+    std::string recorderContextName(int component){
+        return std::string(kernel_rewriter_constants::RECORDER_CONTEXT_NAME) + "_" + std::to_string(component);
+    }
+
+    std::string localRecorderArgument(std::string callee){
+        int component = currentFunctionIsKernel ? recorderSlots.getComponent(callee) : -1;
+        if (passRecorderContext()){
+            std::string context = component < 0 ? std::string(kernel_rewriter_constants::RECORDER_CONTEXT_NAME) : "&" + recorderContextName(component);
+            return joinParameters({context}, true);
+        }
+        return joinParameters(localRecorderValues(component), true);
+    }
+
+    // One context per component of helpers the kernel reaches
+    std::string declRecorderContext(){
+        if (!passRecorderContext()) return "";
+        std::stringstream ss;
+        for (int component : recorderSlots.getComponents(currentFunctionName)){
+            std::vector<std::string> values = localRecorderValues(component);
+            ss << "struct " << kernel_rewriter_constants::RECORDER_CONTEXT_TYPE << " " << recorderContextName(component) << " = {";
+            for (auto it = values.begin(); it != values.end(); it++){
+                ss << (it == values.begin() ? "" : ", ") << *it;
             }
+            ss << "};\n";
         }
         return ss.str();
     }
 
-    std::string localRecorderArgument(){
+    // Helpers take their recorders out of the context, under the names the probes use
+    std::string stmtUnpackRecorderContext(){
+        if (!passRecorderContext()) return "";
         std::stringstream ss;
-        if (countConditions){
-            ss << ", " << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME;
+        ss << "\n";
+        for (auto& recorder : helperRecorders()){
+            ss << recorder.first << " " << recorder.second << " = " << kernel_rewriter_constants::RECORDER_CONTEXT_NAME << "->" << recorder.second << ";\n";
         }
-        if (countBarriers){
-            ss << ", " << kernel_rewriter_constants::GLOBAL_BARRIER_DIVERFENCE_RECORDER_NAME
-                    << ", " << kernel_rewriter_constants::LOCAL_BARRIER_COUNTER_NAME;
+        return ss.str();
+    }
+
+    // __local memory is not initialised, and recorders accumulated in it must start from zero in every work-group.
+    // The kernel entry is reached by all work-items, so the barrier here cannot diverge.
+    std::string stmtInitLocalRecorder(){
+        std::vector<LocalRecorder> recorders = localRecorders();
+        std::stringstream ss;
+        for (auto it = recorders.begin(); it != recorders.end(); it++){
+            ss << "for (int init_recorder_i = ocl_get_local_linear_id(); init_recorder_i < " << it->size << "; init_recorder_i += ocl_get_general_size()) {\n";
+            ss << "  " << it->name << "[init_recorder_i] = 0;\n";
+            ss << "}\n";
+        }
+        if (!recorders.empty()){
+            ss << "barrier(CLK_LOCAL_MEM_FENCE);\n";
         }
         return ss.str();
     }
 
+    // Element first + update_recorder_i of a recorder, in the loops copying the slots of a kernel to its probes
+    std::string loopIndex(int first){
+        return first ? std::to_string(first) + " + update_recorder_i" : "update_recorder_i";
+    }
+
     std::string stmtUpdateGlobalRecorder(){
         std::stringstream ss;
-        ss << "for (int update_recorder_i = 0; update_recorder_i < " << (countConditions*2) << "; update_recorder_i++) { \n";
-        ss << "  atomic_or(&" << kernel_rewriter_constants::GLOBAL_COVERAGE_RECORDER_NAME << "[update_recorder_i], " << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[update_recorder_i]); \n";
-        ss << "}\n";
+        std::vector<RecorderSlots::Run> conditionRuns = recorderSlots.getRuns(currentFunctionName, RecorderSlots::CONDITION);
+        for (const RecorderSlots::Run& run : conditionRuns){
+            ss << "for (int update_recorder_i = 0; update_recorder_i < " << (run.length*2) << "; update_recorder_i++) { \n";
+            ss << "  atomic_or(&" << kernel_rewriter_constants::GLOBAL_COVERAGE_RECORDER_NAME << "[" << loopIndex(2 * run.id) << "], "
+                << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[" << loopIndex(2 * run.slot) << "]); \n";
+            ss << "}\n";
+        }
+        if (recordHeatmap && !conditionRuns.empty()){
+            // The local recorder tells which branches this work-group took: set the bit of its bin in their bitmaps.
+            // Bits are read before the atomic so that only the first work-item of a bin pays for it
+            int wordsPerBitmap = (heatmapBins + 31) / 32;
+            ss << "{\n";
+            ss << "  __global uint* ocl_heatmap = " << kernel_rewriter_constants::GLOBAL_HEATMAP_NAME << ";\n";
+            ss << "  uint ocl_heatmap_groups = get_num_groups(0) * get_num_groups(1) * get_num_groups(2);\n";
+            ss << "  uint ocl_heatmap_group = (get_group_id(2) * get_num_groups(1) + get_group_id(1)) * get_num_groups(0) + get_group_id(0);\n";
+            ss << "  uint ocl_heatmap_bin = ocl_heatmap_groups <= " << heatmapBins << " ? ocl_heatmap_group : (uint)((ulong)ocl_heatmap_group * " << heatmapBins << " / ocl_heatmap_groups);\n";
+            ss << "  if (ocl_heatmap[3] != " << heatmapBins << ") {\n";
+            ss << "    ocl_heatmap[0] = get_num_groups(0);\n";
+            ss << "    ocl_heatmap[1] = get_num_groups(1);\n";
+            ss << "    ocl_heatmap[2] = get_num_groups(2);\n";
+            ss << "    ocl_heatmap[3] = " << heatmapBins << ";\n";
+            ss << "  }\n";
+            for (const RecorderSlots::Run& run : conditionRuns){
+                ss << "  for (int update_recorder_i = 0; update_recorder_i < " << (run.length*2) << "; update_recorder_i++) { \n";
+                ss << "    if (" << kernel_rewriter_constants::LOCAL_COVERAGE_RECORDER_NAME << "[" << loopIndex(2 * run.slot) << "]) {\n";
+                ss << "      __global uint* ocl_heatmap_word = ocl_heatmap + " << heatmap_format::HEADER_WORDS << " + ("
+                    << loopIndex(2 * run.id) << ") * " << wordsPerBitmap << " + ocl_heatmap_bin / 32;\n";
+                ss << "      uint ocl_heatmap_bit = 1u << (ocl_heatmap_bin % 32);\n";
+                ss << "      if (!(*ocl_heatmap_word & ocl_heatmap_bit)) atomic_or(ocl_heatmap_word, ocl_heatmap_bit);\n";
+                ss << "    }\n";
+                ss << "  }\n";
+            }
+            ss << "}\n";
+        }
+        // Every work-item drains what has been counted so far, so the sum over the work-group is exact
+        // no matter in which order work-items finish
+        for (const RecorderSlots::Run& run : recorderSlots.getRuns(currentFunctionName, RecorderSlots::ATOMIC)){
+            ss << "for (int update_recorder_i = 0; update_recorder_i < " << (run.length*2) << "; update_recorder_i++) { \n";
+            ss << "  int ocl_drained_count = atomic_xchg(&" << kernel_rewriter_constants::LOCAL_ATOMIC_COUNTER_NAME << "[" << loopIndex(2 * run.slot) << "], 0); \n";
+            if (accumulateLaunches){
+                ss << "  if (ocl_drained_count) atom_add(&" << kernel_rewriter_constants::GLOBAL_ATOMIC_COUNTER_NAME << "[" << loopIndex(2 * run.id) << "], (ulong)ocl_drained_count); \n";
+            } else {
+                ss << "  if (ocl_drained_count) atomic_add(&" << kernel_rewriter_constants::GLOBAL_ATOMIC_COUNTER_NAME << "[" << loopIndex(2 * run.id) << "], ocl_drained_count); \n";
+            }
+            ss << "}\n";
+        }
+        for (const RecorderSlots::Run& run : recorderSlots.getRuns(currentFunctionName, RecorderSlots::BLOCK)){
+            ss << "for (int update_recorder_i = 0; update_recorder_i < " << run.length << "; update_recorder_i++) { \n";
+            ss << "  uint ocl_drained_count = atomic_xchg(&" << kernel_rewriter_constants::LOCAL_BLOCK_COUNTER_NAME << "[" << loopIndex(run.slot) << "], 0); \n";
+            ss << "  if (ocl_drained_count) atom_add(&" << kernel_rewriter_constants::GLOBAL_BLOCK_COUNTER_NAME << "[" << loopIndex(run.id) << "], (ulong)ocl_drained_count); \n";
+            ss << "}\n";
+        }
+        if (timeRegions){
+            ss << "for (int update_recorder_i = 0; update_recorder_i < " << numRegions() << "; update_recorder_i++) { \n";
+            ss << "  ulong ocl_drained_time = atom_xchg(&" << kernel_rewriter_constants::LOCAL_REGION_TIMER_NAME << "[update_recorder_i], 0); \n";
+            ss << "  if (ocl_drained_time) atom_add(&" << kernel_rewriter_constants::GLOBAL_REGION_TIMER_NAME << "[update_recorder_i], ocl_drained_time); \n";
+            ss << "}\n";
+        }
         return ss.str();
     }
 
+    int numRegions(){
+        return countTimedFunctions + 2 * countBarriers;
+    }
+
     std::string correctSourceLine(std::string originalSourceLine, int offset){
         size_t p1, p2;
         p1 = originalSourceLine.substr(0, originalSourceLine.find_last_of(':')).find_last_of(':') + 1;
@@ -476,21 +1371,67 @@ public:
     ASTFrontendActionForKernelRewriter(){}
 
     void EndSourceFileAction() override {
+        writeOutputs(myRewriter);
+    }
+
+    // Writes the rewritten kernel, its data file and its metadata header
+    static void writeOutputs(Rewriter &myRewriter) {
         const RewriteBuffer *buffer = myRewriter.getRewriteBufferFor(myRewriter.getSourceMgr().getMainFileID());
         if (buffer == NULL){
             llvm::outs() << "Rewriter buffer is null. Cannot write in file.\n";
             return;
         }
         std::string rewriteBuffer = std::string(buffer->begin(), buffer->end());
+        kernelHash = hashKernel(myRewriter.getSourceMgr().getBufferData(myRewriter.getSourceMgr().getMainFileID()).str(), recorderLayout);
         std::string source = "";
         std::string line;
         std::istringstream bufferStream(rewriteBuffer);
 
+        if (countBlocks || timeRegions || countAtomics){
+            source.append(kernel_rewriter_constants::INT64_ATOMICS_PRAGMA);
+        }
+
+        source.append(kernel_rewriter_constants::WORK_ITEM_HELPERS);
+        source.append("\n");
+
+        if (traceEvents){
+            source.append(kernel_rewriter_constants::TRACE_EVENT_KINDS);
+            source.append(declTraceHelpers());
+            source.append("\n");
+        } else if (countBarriers){
+            source.append(kernel_rewriter_constants::TRACE_EVENT_KINDS);
+            source.append(kernel_rewriter_constants::NO_TRACE_EVENT_MACRO);
+            source.append("\n");
+        }
+
+        if (timeRegions){
+            source.append(declTimerHelpers());
+            source.append("\n");
+        } else if (countBarriers){
+            source.append(kernel_rewriter_constants::NO_TIMER_BARRIER_MACROS);
+            source.append("\n");
+        }
+
         if (countBarriers){
             source.append(kernel_rewriter_constants::NEW_BARRIER_MACRO);
             source.append("\n");
         }
 
+        if (!provenBarriers.empty() && (traceEvents || timeRegions)){
+            source.append(kernel_rewriter_constants::PROVEN_BARRIER_MACRO);
+            source.append("\n");
+        }
+
+        if (countAtomics){
+            source.append(declAtomicProbes());
+            source.append("\n");
+        }
+
+        if (passRecorderContext()){
+            source.append(declRecorderContextType());
+            source.append("\n");
+        }
+
         while(getline(bufferStream, line)){
             source.append(line);
             source.append("\n");
@@ -504,23 +1445,92 @@ public:
         
         // Write data file
         std::string dataFileName = outputFileName + ".dat";
+        if (timeRegions){
+            for (int i = 0; i < countBarriers; i++){
+                regionNameMap[barrierSegmentRegion(i)] = "before barrier " + std::to_string(i) + " at " + barrierLineMap[i];
+                regionNameMap[barrierSegmentRegion(i) + 1] = "waiting in barrier " + std::to_string(i);
+            }
+            hostCodeGenerator.setRegions(regionNameMap);
+        }
         hostCodeGenerator.generateHostCode(dataFileName);
         std::stringstream outputBuffer;
         fileWriter.open(dataFileName);
+        outputBuffer << "Kernel hash: 0x" << std::hex << kernelHash << std::dec << "\n";
+        if (!recorderLayout.empty()){
+            // Layout header of the instrumentation buffer, for tools allocating it without the metadata header
+            unsigned int layoutHeader[recorder_layout::HEADER_WORDS];
+            recorderLayout.writeHeader(layoutHeader);
+            outputBuffer << "Layout:";
+            for (unsigned int word : layoutHeader){
+                outputBuffer << " " << word;
+            }
+            outputBuffer << "\n";
+            outputBuffer << "Wide kinds: " << recorderLayout.wideKinds() << "\n";
+        }
         for (int i = 0; i < numConditions; i++){
             outputBuffer << "Condition ID: " << i << "\n";
             outputBuffer << "Source code line: " << conditionLineMap[i] << "\n";
             outputBuffer << "Condition: " << conditionStringMap[i] << "\n";
+            if (uniformConditions.count(i)){
+                outputBuffer << "Probe: uniform\n";
+            }
+            if (coveredBranches.count(2 * i) || coveredBranches.count(2 * i + 1)){
+                bool both = coveredBranches.count(2 * i) && coveredBranches.count(2 * i + 1);
+                outputBuffer << "Covered before: " << (both ? "both" : coveredBranches.count(2 * i) ? "true" : "false") << "\n";
+            }
+        }
+        for (int i = 0; i < numConstantConditions; i++){
+            outputBuffer << "Constant condition ID: " << i << "\n";
+            outputBuffer << "Source code line: " << constantConditionLineMap[i] << "\n";
+            outputBuffer << "Condition: " << constantConditionStringMap[i] << "\n";
+            outputBuffer << "Probe: constant " << (alwaysTrueConditions.count(i) ? "true" : "false") << "\n";
         }
         for (int i = 0; i < countBarriers; i++){
             outputBuffer << "Barrier ID: " << i << "\n";
             outputBuffer << "Source code line: " << barrierLineMap[i] << "\n";
+            if (provenBarriers.count(i)){
+                outputBuffer << "Probe: proven\n";
+            }
+        }
+        for (int i = 0; i < countAtomics; i++){
+            outputBuffer << "Atomic ID: " << i << "\n";
+            outputBuffer << "Source code line: " << atomicLineMap[i] << "\n";
+            outputBuffer << "Atomic: " << atomicStringMap[i] << "\n";
+        }
+        for (int i = 0; i < countBlocks; i++){
+            outputBuffer << "Block ID: " << i << "\n";
+            outputBuffer << "Function: " << blockFunctionMap[i] << "\n";
+            outputBuffer << "Source code line: " << blockLineMap[i] << "\n";
+            outputBuffer << "Weight: global load " << blockWeightMap[i].globalLoadBytes
+                << " bytes, global store " << blockWeightMap[i].globalStoreBytes
+                << " bytes, local load " << blockWeightMap[i].localLoadBytes
+                << " bytes, local store " << blockWeightMap[i].localStoreBytes
+                << " bytes, " << blockWeightMap[i].flops << " flops\n";
+            if (blockEdgeMap.count(i)){
+                outputBuffer << "Edge: " << blockEdgeMap[i].from << " " << blockEdgeMap[i].to << "\n";
+            }
+            if (blockBranchMap.count(i)){
+                outputBuffer << "Branch: " << blockBranchMap[i] << "\n";
+            }
+            if (blockEdgeMap.count(i) && !blockEdgeMap[i].counted){
+                outputBuffer << "Probe: derived\n";
+            }
+        }
+        for (auto it = regionNameMap.begin(); it != regionNameMap.end(); it++){
+            outputBuffer << "Region ID: " << it->first << "\n";
+            outputBuffer << "Region: " << it->second << "\n";
         }
         outputBuffer << "\n";
         fileWriter << outputBuffer.str();
         fileWriter.close();
 
-        if (UserConfig::hasFakeHeader(kernelSourceFile)){
+        // Write metadata header
+        std::string headerFileName = outputFileName + ".h";
+        fileWriter.open(headerFileName);
+        fileWriter << metadataHeader(headerFileName);
+        fileWriter.close();
+
+        if (!servingKernels && UserConfig::hasFakeHeader(kernelSourceFile)){
             UserConfig::removeFakeHeader(kernelSourceFile);
         }
 
@@ -535,6 +1545,7 @@ public:
             outputFileName = outputFileName.append(inputFileName.substr(inputFileName.find_last_of("/") + 1, inputFileName.size() - inputFileName.find_last_of("/") - 1));
             myRewriter.setSourceMgr(ci.getSourceManager(), ci.getLangOpts());
             originalRewriter.setSourceMgr(ci.getSourceManager(), ci.getLangOpts());
+            loadPriorCoverage(ci.getSourceManager());
             return llvm::make_unique<ASTConsumerForKernelRewriter>(myRewriter, originalRewriter);
     }
 
@@ -544,25 +1555,94 @@ private:
     // need original rewriter to retrieve correct text from original code
 };
 
-int rewriteOpenclKernel(ClangTool* tool, std::string newOutputDirectory, UserConfig* userConfig) {
+void initialiseRewriter(std::string newOutputDirectory, UserConfig* userConfig) {
     numConditions = 0;
     countConditions = 0;
+    conditionLineMap.clear();
+    conditionStringMap.clear();
+    setFunctions.clear();
+    recorderSlots = RecorderSlots();
     countBarriers = 0;
     numBarriers = 0;
+    barrierLineMap.clear();
+    countAtomics = 0;
+    numAtomics = 0;
+    atomicLineMap.clear();
+    atomicStringMap.clear();
+    profileAtomics = userConfig->isEnabled("atomic_contention");
+    atomicProbeTypes.clear();
+    countBlocks = 0;
+    numBlocks = 0;
+    blockLineMap.clear();
+    blockFunctionMap.clear();
+    blockWeightMap.clear();
+    profileRoofline = userConfig->isEnabled("roofline");
+    edgeProfiling = profileRoofline && userConfig->isEnabled("edge_profiling");
+    numEdgeNodes = 0;
+    blockEdgeMap.clear();
+    blockBranchMap.clear();
+    traceEvents = userConfig->isEnabled("trace");
+    traceCapacity = std::max(1, userConfig->getIntValue("trace_buffer_size", 1024));
+    traceGroupStride = std::max(1, userConfig->getIntValue("trace_group_stride", 1));
+    traceGroupSlots = std::max(1, userConfig->getIntValue("trace_group_slots", 16));
+    recordHeatmap = userConfig->isEnabled("heatmap");
+    heatmapBins = std::max(1, userConfig->getIntValue("heatmap_bins", 4096));
+    countTimedFunctions = 0;
+    numTimedFunctions = 0;
+    regionNameMap.clear();
+    accumulateLaunches = userConfig->isEnabled("accumulate_launches");
+    std::string clVersion = userConfig->getValue("cl_version");
+    if (clVersion.compare(0, 2, "CL") == 0) clVersion = clVersion.substr(2);
+    recorderContext = std::atof(clVersion.c_str()) >= 2.0;
+    timestampHook = userConfig->getValue("timestamp_hook");
+    timeRegions = userConfig->isEnabled("region_timers") && !timestampHook.empty();
+    if (userConfig->isEnabled("region_timers") && timestampHook.empty()){
+        std::cout << "\x1B[33mNo timestamp_hook in the config file, region timers are disabled.\x1B[0m\n";
+    }
+    uniformBranches = userConfig->isEnabled("uniform_branches");
+    uniformConditions.clear();
+    proveBarriers = userConfig->isEnabled("prove_barriers");
+    provenBarriers.clear();
+    foldConstantConditions = userConfig->isEnabled("fold_constant_conditions");
+    numConstantConditions = 0;
+    constantConditionLineMap.clear();
+    constantConditionStringMap.clear();
+    alwaysTrueConditions.clear();
+    priorCoverageFile = userConfig->getValue("prior_coverage");
+    coveredBranches.clear();
     numAddedLines = userConfig->getNumAddedLines();
     outputDirectory = newOutputDirectory;
     outputFileName = newOutputDirectory;
+    hostCodeGenerator = HostCodeGenerator();
+}
 
-    tool->run(newFrontendActionFactory<ASTFrontendActionForKernelInvastigator>().get());    
+FrontendAction* newInvestigatorAction(){
+    return new ASTFrontendActionForKernelInvastigator();
+}
 
-    if (countConditions == 0 && countBarriers == 0){
+int prepareRewriting(UserConfig* userConfig){
+    if (countConditions == 0 && countBarriers == 0 && countAtomics == 0 && countBlocks == 0){
         return error_code::NO_NEED_TO_TEST_COVERAGE;
     }
 
-    hostCodeGenerator.initialise(userConfig, countConditions, countBarriers);
+    recorderSlots.computeSlots(setFunctions);
+    hostCodeGenerator.initialise(userConfig, countConditions, countBarriers, countAtomics, countBlocks);
+    if (traceEvents){
+        hostCodeGenerator.setTrace(traceGroupSlots, traceCapacity, traceGroupStride);
+    }
+    if (recordHeatmap && countConditions){
+        hostCodeGenerator.setHeatmap(heatmapBins);
+    }
+    computeRecorderLayout();
+    hostCodeGenerator.setLayout(recorderLayout);
+    return error_code::STATUS_OK;
+}
 
-    tool->run(newFrontendActionFactory<ASTFrontendActionForKernelRewriter>().get());
+FrontendAction* newRewriterAction(){
+    return new ASTFrontendActionForKernelRewriter();
+}
 
+void writeHostCode(){
     if (hostCodeGenerator.isHostCodeComplete()){
         std::cout << "\x1B[32mReferable host code has been written in the output directory\x1B[0m\n";
         std::string hostCodeFile = outputDirectory + "hostcode.txt";
@@ -570,6 +1650,55 @@ int rewriteOpenclKernel(ClangTool* tool, std::string newOutputDirectory, UserCon
         hostCodeWriter << hostCodeGenerator.getGeneratedHostCode();
         hostCodeWriter.close();
     }
+}
 
-    return error_code::STATUS_OK;
+void setServingKernels(){
+    servingKernels = true;
+}
+
+// Both visitors over the AST of a single parse, for the plugin. Top-level declarations are kept until the
+// whole translation unit has been parsed, since the rewriter needs every count of the investigator.
+class ASTConsumerForKernelPlugin : public ASTConsumer{
+public:
+    ASTConsumerForKernelPlugin(CompilerInstance &ci, UserConfig* userConfig) : userConfig(userConfig) {
+        investigatorRewriter.setSourceMgr(ci.getSourceManager(), ci.getLangOpts());
+        myRewriter.setSourceMgr(ci.getSourceManager(), ci.getLangOpts());
+        originalRewriter.setSourceMgr(ci.getSourceManager(), ci.getLangOpts());
+    }
+
+    bool HandleTopLevelDecl(DeclGroupRef DR) override {
+        decls.insert(decls.end(), DR.begin(), DR.end());
+        return true;
+    }
+
+    void HandleTranslationUnit(ASTContext &context) override {
+        RecursiveASTVisitorForKernelInvastigator investigator(investigatorRewriter);
+        for (Decl* d : decls){
+            investigator.TraverseDecl(d);
+        }
+        if (prepareRewriting(userConfig) == error_code::NO_NEED_TO_TEST_COVERAGE){
+            std::cout << "\x1B[31mNo branch or barrier found in " << kernelSourceFile << ". Nothing has been instrumented.\x1B[0m\n";
+            return;
+        }
+        loadPriorCoverage(context.getSourceManager());
+        RecursiveASTVisitorForKernelRewriter rewriter(myRewriter, originalRewriter);
+        for (Decl* d : decls){
+            rewriter.TraverseDecl(d);
+        }
+        ASTFrontendActionForKernelRewriter::writeOutputs(myRewriter);
+        writeHostCode();
+    }
+
+private:
+    UserConfig* userConfig;
+    std::vector<Decl*> decls;
+    Rewriter investigatorRewriter;
+    Rewriter myRewriter;
+    Rewriter originalRewriter;
+};
+
+std::unique_ptr<ASTConsumer> newPluginConsumer(CompilerInstance& ci, StringRef file, UserConfig* userConfig){
+    kernelSourceFile = file.str();
+    outputFileName = outputDirectory + kernelSourceFile.substr(kernelSourceFile.find_last_of("/") + 1);
+    return llvm::make_unique<ASTConsumerForKernelPlugin>(ci, userConfig);
 }
@@ -3,10 +3,26 @@
 
 #include <string>
 #include <map>
+#include <memory>
 
-#include "clang/Tooling/Tooling.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendAction.h"
 #include "UserConfig.h"
 
+// The kernel is parsed twice by the openclbc tool: investigated to count the probes, then rewritten
+void initialiseRewriter(std::string newOutputDirectory, UserConfig* userConfig);
+clang::FrontendAction* newInvestigatorAction();
+// error_code::NO_NEED_TO_TEST_COVERAGE when the investigator found nothing to instrument
+int prepareRewriting(UserConfig* userConfig);
+clang::FrontendAction* newRewriterAction();
+// hostcode.txt in the output directory
+void writeHostCode();
 
-int rewriteOpenclKernel(clang::tooling::ClangTool* tool, std::string newOutputFileName, UserConfig* userconfig);
-#endif
\ No newline at end of file
+// openclbc --serve: kernel sources come from the clients, the files at their paths are never read nor written
+void setServingKernels();
+
+// Investigates and rewrites the kernel with the AST of a compilation, for the plugin, after initialiseRewriter
+std::unique_ptr<clang::ASTConsumer> newPluginConsumer(clang::CompilerInstance& ci, llvm::StringRef file, UserConfig* userConfig);
+
+#endif
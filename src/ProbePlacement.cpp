@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <memory>
+
+#include "clang/Analysis/CFG.h"
+
+#include "ProbePlacement.h"
+
+using namespace clang;
+
+namespace{
+
+// Union-find over the blocks of a graph
+class Partition{
+public:
+    explicit Partition(int size) : parent(size){
+        for (int i = 0; i < size; i++) parent[i] = i;
+    }
+
+    int find(int i){
+        while (parent[i] != i) i = parent[i] = parent[parent[i]];
+        return i;
+    }
+
+    // False if a and b were together already
+    bool unite(int a, int b){
+        a = find(a);
+        b = find(b);
+        if (a == b) return false;
+        parent[a] = b;
+        return true;
+    }
+
+private:
+    std::vector<int> parent;
+};
+
+// Short-circuit and conditional operators end blocks of their own, whose edges may leave the condition too
+void mapConditionOperators(const Stmt* s, const Stmt* owner, std::map<const Stmt*, const Stmt*>& owners){
+    if (!s) return;
+    if (isa<AbstractConditionalOperator>(s) || (isa<BinaryOperator>(s) && cast<BinaryOperator>(s)->isLogicalOp())){
+        owners[s] = owner;
+    }
+    for (const Stmt* child : s->children()){
+        mapConditionOperators(child, owner, owners);
+    }
+}
+
+// Ifs and loops own the blocks ending with their condition
+void mapOwners(const Stmt* s, std::map<const Stmt*, const Stmt*>& owners){
+    if (!s) return;
+    const Expr* condition = NULL;
+    if (const IfStmt* ifStatement = dyn_cast<IfStmt>(s)) condition = ifStatement->getCond();
+    else if (const ForStmt* forStatement = dyn_cast<ForStmt>(s)) condition = forStatement->getCond();
+    else if (const WhileStmt* whileStatement = dyn_cast<WhileStmt>(s)) condition = whileStatement->getCond();
+    if (condition || isa<ForStmt>(s)){
+        owners[s] = s;
+        mapConditionOperators(condition, s, owners);
+    }
+    for (const Stmt* child : s->children()){
+        mapOwners(child, owners);
+    }
+}
+
+// NULL if the block has no such successor or it cannot be reached
+const CFGBlock* successor(const CFGBlock* block, unsigned int i){
+    if (i >= block->succ_size()) return NULL;
+    return *(block->succ_begin() + i);
+}
+
+}
+
+ProbePlacement::ProbePlacement(FunctionDecl* function, ASTContext& context,
+    std::function<bool(const IfStmt*)> isProbed, int firstNode) : numNodes(0){
+    Stmt* body = function->getBody();
+    if (!body) return;
+    CFG::BuildOptions options;
+    // Constant conditions keep both sides, as in the source
+    options.PruneTriviallyFalseEdges = false;
+    std::unique_ptr<CFG> cfg = CFG::buildCFG(function, body, &context, options);
+    if (!cfg) return;
+    numNodes = cfg->getNumBlockIDs();
+
+    std::map<const Stmt*, const Stmt*> owners;
+    mapOwners(body, owners);
+
+    // Block every site is entered at
+    std::map<Site, const CFGBlock*> targets;
+    for (const CFGBlock* block : *cfg){
+        const Stmt* terminator = block->getTerminator().getStmt();
+        if (!terminator) continue;
+        if (const IfStmt* ifStatement = dyn_cast<IfStmt>(terminator)){
+            if (!isProbed(ifStatement)) continue;
+            const CFGBlock* thenTarget = successor(block, 0);
+            const CFGBlock* elseTarget = successor(block, 1);
+            // Sides entered at the same block (an empty then without else) cannot be told apart
+            if (!thenTarget || !elseTarget || thenTarget == elseTarget) return;
+            targets[Site(terminator, 0)] = thenTarget;
+            targets[Site(terminator, 1)] = elseTarget;
+        } else if (isa<ForStmt>(terminator) || isa<WhileStmt>(terminator)){
+            const CFGBlock* bodyTarget = successor(block, 0);
+            if (!bodyTarget || bodyTarget == successor(block, 1)) return;
+            targets[Site(terminator, 0)] = bodyTarget;
+        } else if (isa<DoStmt>(terminator)){
+            // The body of a do loop is entered from before the loop and from its condition, by no single edge
+            return;
+        }
+    }
+
+    // Edges leaving a condition towards one of its sites stand for the counter of the site, the others are contracted
+    std::vector<Site> sites;
+    std::map<Site, std::vector<std::pair<int, int> > > siteEdges;
+    Partition nodes(numNodes);
+    for (const CFGBlock* block : *cfg){
+        const Stmt* terminator = block->getTerminator().getStmt();
+        auto owner = terminator ? owners.find(terminator) : owners.end();
+        for (unsigned int i = 0; i < block->succ_size(); i++){
+            const CFGBlock* target = successor(block, i);
+            if (!target) continue;
+            Site site(NULL, 0);
+            for (int side = 0; side < 2 && owner != owners.end(); side++){
+                auto found = targets.find(Site(owner->second, side));
+                if (found != targets.end() && found->second == target) site = found->first;
+            }
+            if (site.first){
+                if (!siteEdges.count(site)) sites.push_back(site);
+                siteEdges[site].push_back(std::make_pair(block->getBlockID(), target->getBlockID()));
+            } else {
+                nodes.unite(block->getBlockID(), target->getBlockID());
+            }
+        }
+    }
+    Site entry(body, 0);
+    sites.push_back(entry);
+    siteEdges[entry].push_back(std::make_pair(cfg->getExit().getBlockID(), cfg->getEntry().getBlockID()));
+
+    // A site left by short-circuit operators has several edges, which must have become one
+    for (const Site& site : sites){
+        const std::vector<std::pair<int, int> >& parallel = siteEdges[site];
+        for (const std::pair<int, int>& edge : parallel){
+            if (nodes.find(edge.first) != nodes.find(parallel[0].first) || nodes.find(edge.second) != nodes.find(parallel[0].second)) return;
+        }
+    }
+
+    frequencies[entry] = 1;
+    estimate(body, 1);
+    std::stable_sort(sites.begin(), sites.end(), [this](const Site& a, const Site& b){
+        return frequencies[a] > frequencies[b];
+    });
+    Partition tree(numNodes);
+    for (const Site& site : sites){
+        int from = nodes.find(siteEdges[site][0].first);
+        int to = nodes.find(siteEdges[site][0].second);
+        Edge edge = {firstNode + from, firstNode + to, !tree.unite(from, to)};
+        edges[site] = edge;
+    }
+}
+
+bool ProbePlacement::getEdge(const Stmt* owner, int side, Edge& edge) const{
+    auto found = edges.find(Site(owner, side));
+    if (found == edges.end()) return false;
+    edge = found->second;
+    return true;
+}
+
+// Static estimate in the style of Ball and Larus: sides of an if are equally likely, loops run ten times
+void ProbePlacement::estimate(const Stmt* s, double frequency){
+    if (!s) return;
+    if (const IfStmt* ifStatement = dyn_cast<IfStmt>(s)){
+        estimate(ifStatement->getCond(), frequency);
+        frequencies[Site(s, 0)] = frequency / 2;
+        frequencies[Site(s, 1)] = frequency / 2;
+        estimate(ifStatement->getThen(), frequency / 2);
+        estimate(ifStatement->getElse(), frequency / 2);
+        return;
+    }
+    if (isa<ForStmt>(s) || isa<WhileStmt>(s) || isa<DoStmt>(s)){
+        frequency *= 10;
+        frequencies[Site(s, 0)] = frequency;
+    }
+    for (const Stmt* child : s->children()){
+        estimate(child, frequency);
+    }
+}
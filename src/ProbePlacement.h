@@ -0,0 +1,49 @@
+#ifndef OPENCLBC_PROBE_PLACEMENT_H
+#define OPENCLBC_PROBE_PLACEMENT_H
+
+#include <functional>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "clang/AST/AST.h"
+
+// Which block counters of a function can be left out because their counts follow from the others
+// (Knuth's spanning tree method, as in Ball and Larus). In the control flow graph of the function, every
+// counted block is entered by one edge once the edges no counter stands for are contracted: the body of
+// the function by an edge from its exit back to its entry, a side of an if by the edges leaving its condition
+// towards that side, a loop body by the edges leaving the loop condition towards it. What enters a node
+// leaves it, so the counts of the edges of a spanning tree follow from the counts of the others.
+// Edges are weighted by how often they are expected to run (a side of an if half as often as the if, a loop
+// body ten times as often as the loop), and the tree takes the heaviest ones.
+class ProbePlacement{
+public:
+    struct Edge{
+        int from;           // Nodes of the graph
+        int to;
+        bool counted;       // Off the spanning tree
+    };
+
+    // isProbed tells which ifs count their sides. Nodes are numbered from firstNode on, so that the graphs
+    // of all functions can be told apart.
+    ProbePlacement(clang::FunctionDecl* function, clang::ASTContext& context,
+        std::function<bool(const clang::IfStmt*)> isProbed, int firstNode);
+
+    // owner is the body of the function, an if (side 0 for then, 1 for else, given or not) or a loop.
+    // False if the block is not an edge of the graph, e.g. when the graph of the function could not be mapped
+    // to its blocks: it then has to be counted.
+    bool getEdge(const clang::Stmt* owner, int side, Edge& edge) const;
+
+    int getNumNodes() const { return numNodes; }
+
+private:
+    typedef std::pair<const clang::Stmt*, int> Site;
+
+    std::map<Site, Edge> edges;
+    std::map<Site, double> frequencies;
+    int numNodes;
+
+    void estimate(const clang::Stmt* s, double frequency);
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef OPENCLBC_RECORDER_LAYOUT_H
+#define OPENCLBC_RECORDER_LAYOUT_H
+
+#include "Constants.h"
+
+// Where every recorder lives in the instrumentation buffer, see recorder_layout.
+// Computed the same way by the rewriter, the host code generator and the host runtime.
+struct RecorderLayout{
+    unsigned int offset[recorder_layout::NUM_KINDS];
+    unsigned int numElements[recorder_layout::NUM_KINDS];
+    unsigned int elementWords[recorder_layout::NUM_KINDS];
+    unsigned int totalWords;
+
+    RecorderLayout(){
+        for (int kind = 0; kind < recorder_layout::NUM_KINDS; kind++){
+            offset[kind] = 0;
+            numElements[kind] = 0;
+            elementWords[kind] = 1;
+        }
+        totalWords = recorder_layout::HEADER_WORDS;
+    }
+
+    // Recorders have to be added in the order of the kinds
+    void add(recorder_layout::RecorderKind kind, unsigned int newNumElements, unsigned int newElementWords){
+        if (newNumElements == 0) return;
+        if (newElementWords == 2) totalWords = (totalWords + 1) & ~1u;
+        offset[kind] = totalWords;
+        numElements[kind] = newNumElements;
+        elementWords[kind] = newElementWords;
+        totalWords += newNumElements * newElementWords;
+    }
+
+    bool has(recorder_layout::RecorderKind kind) const{
+        return numElements[kind] != 0;
+    }
+
+    bool empty() const{
+        return totalWords == recorder_layout::HEADER_WORDS;
+    }
+
+    // Bit k is set when recorders of kind k have 64-bit elements
+    unsigned int wideKinds() const{
+        unsigned int mask = 0;
+        for (int kind = 0; kind < recorder_layout::NUM_KINDS; kind++){
+            if (numElements[kind] && elementWords[kind] == 2) mask |= 1u << kind;
+        }
+        return mask;
+    }
+
+    void writeHeader(unsigned int* header) const{
+        header[0] = recorder_layout::MAGIC;
+        header[1] = totalWords;
+        for (int kind = 0; kind < recorder_layout::NUM_KINDS; kind++){
+            header[2 + 2 * kind] = offset[kind];
+            header[3 + 2 * kind] = numElements[kind];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include <algorithm>
+
+#include "RecorderSlots.h"
+
+RecorderSlots::RecorderSlots(){
+    for (int kind = 0; kind < NUM_PROBE_KINDS; kind++){
+        numIds[kind] = 0;
+    }
+}
+
+void RecorderSlots::addFunction(const std::string& name, bool isKernel){
+    Function function;
+    function.name = name;
+    function.isKernel = isKernel;
+    for (int kind = 0; kind < NUM_PROBE_KINDS; kind++){
+        function.firstId[kind] = numIds[kind];
+        function.numProbes[kind] = 0;
+        function.helperSlot[kind] = 0;
+        function.numSlots[kind] = 0;
+    }
+    function.component = -1;
+    functionIndices[name] = functions.size();
+    functions.push_back(function);
+}
+
+void RecorderSlots::addProbes(ProbeKind kind, int count){
+    numIds[kind] += count;
+    if (!functions.empty()){
+        functions.back().numProbes[kind] += count;
+    }
+}
+
+void RecorderSlots::addCall(const std::string& callee){
+    if (!functions.empty()){
+        functions.back().callees.insert(callee);
+    }
+}
+
+int RecorderSlots::findHelper(const std::string& name, const std::set<std::string>& helpers) const{
+    auto it = functionIndices.find(name);
+    if (helpers.find(name) == helpers.end() || it == functionIndices.end() || functions[it->second].isKernel) return -1;
+    return it->second;
+}
+
+void RecorderSlots::computeSlots(const std::set<std::string>& helpers){
+    // Components of the call graph between helpers, joined over every call
+    std::vector<int> parent(functions.size());
+    for (size_t i = 0; i < functions.size(); i++){
+        parent[i] = i;
+    }
+    auto root = [&parent](int i){
+        while (parent[i] != i){
+            i = parent[i] = parent[parent[i]];
+        }
+        return i;
+    };
+    for (size_t i = 0; i < functions.size(); i++){
+        if (functions[i].isKernel) continue;
+        for (const std::string& callee : functions[i].callees){
+            int j = findHelper(callee, helpers);
+            if (j >= 0) parent[root(i)] = root(j);
+        }
+    }
+
+    // Components and the helper slots in each are numbered in order of appearance
+    std::map<int, int> componentIndices;
+    std::vector<std::vector<int> > numComponentSlots;
+    for (size_t i = 0; i < functions.size(); i++){
+        Function& function = functions[i];
+        function.component = -1;
+        if (function.isKernel || helpers.find(function.name) == helpers.end()) continue;
+        int r = root(i);
+        if (componentIndices.find(r) == componentIndices.end()){
+            componentIndices[r] = numComponentSlots.size();
+            numComponentSlots.push_back(std::vector<int>(NUM_PROBE_KINDS, 0));
+        }
+        function.component = componentIndices[r];
+        for (int kind = 0; kind < NUM_PROBE_KINDS; kind++){
+            function.helperSlot[kind] = numComponentSlots[function.component][kind];
+            numComponentSlots[function.component][kind] += function.numProbes[kind];
+        }
+    }
+
+    for (Function& kernel : functions){
+        if (!kernel.isKernel) continue;
+        // Helpers reachable from the kernel, depth first over the call graph
+        std::set<int> reached;
+        std::vector<std::string> pending(kernel.callees.begin(), kernel.callees.end());
+        while (!pending.empty()){
+            int index = findHelper(pending.back(), helpers);
+            pending.pop_back();
+            if (index < 0 || !reached.insert(index).second) continue;
+            const Function& helper = functions[index];
+            pending.insert(pending.end(), helper.callees.begin(), helper.callees.end());
+        }
+        kernel.reachableHelpers.assign(reached.begin(), reached.end());
+
+        for (int kind = 0; kind < NUM_PROBE_KINDS; kind++){
+            // First and last slot of the reached helpers of each component
+            std::map<int, std::pair<int, int> > bounds;
+            for (int index : kernel.reachableHelpers){
+                const Function& helper = functions[index];
+                if (!helper.numProbes[kind]) continue;
+                int first = helper.helperSlot[kind];
+                int last = first + helper.numProbes[kind];
+                auto it = bounds.find(helper.component);
+                if (it == bounds.end()){
+                    bounds[helper.component] = std::make_pair(first, last);
+                } else {
+                    it->second.first = std::min(it->second.first, first);
+                    it->second.second = std::max(it->second.second, last);
+                }
+            }
+            // Slots of a component below its first reached one are left out as long as its recorders start
+            // within those of the kernel
+            int end = kernel.numProbes[kind];
+            kernel.componentOffsets[kind].clear();
+            for (auto& bound : bounds){
+                int offset = end - std::min(bound.second.first, end);
+                kernel.componentOffsets[kind][bound.first] = offset;
+                end = offset + bound.second.second;
+            }
+            kernel.numSlots[kind] = end;
+        }
+    }
+}
+
+const RecorderSlots::Function* RecorderSlots::find(const std::string& name) const{
+    auto it = functionIndices.find(name);
+    return it == functionIndices.end() ? NULL : &functions[it->second];
+}
+
+int RecorderSlots::getSlot(const std::string& function, ProbeKind kind, int id) const{
+    const Function* f = find(function);
+    if (f == NULL) return id;
+    return (f->isKernel ? 0 : f->helperSlot[kind]) + id - f->firstId[kind];
+}
+
+int RecorderSlots::getNumSlots(const std::string& kernel, ProbeKind kind) const{
+    const Function* f = find(kernel);
+    return f == NULL ? numIds[kind] : f->numSlots[kind];
+}
+
+int RecorderSlots::getComponent(const std::string& helper) const{
+    const Function* f = find(helper);
+    return f == NULL || f->isKernel ? -1 : f->component;
+}
+
+std::vector<int> RecorderSlots::getComponents(const std::string& kernel) const{
+    std::vector<int> components;
+    const Function* f = find(kernel);
+    if (f == NULL) return components;
+    std::set<int> seen;
+    for (int index : f->reachableHelpers){
+        if (seen.insert(functions[index].component).second){
+            components.push_back(functions[index].component);
+        }
+    }
+    return components;
+}
+
+// Components without probes of the kind get the recorders from their start, which they never index
+int RecorderSlots::getComponentOffset(const std::string& kernel, int component, ProbeKind kind) const{
+    const Function* f = find(kernel);
+    if (f == NULL) return 0;
+    auto it = f->componentOffsets[kind].find(component);
+    return it == f->componentOffsets[kind].end() ? 0 : it->second;
+}
+
+std::vector<RecorderSlots::Run> RecorderSlots::getRuns(const std::string& kernel, ProbeKind kind) const{
+    std::vector<Run> runs;
+    const Function* f = find(kernel);
+    if (f == NULL) return runs;
+    if (f->numProbes[kind]){
+        runs.push_back(Run{0, f->firstId[kind], f->numProbes[kind]});
+    }
+    for (int index : f->reachableHelpers){
+        const Function& helper = functions[index];
+        if (!helper.numProbes[kind]) continue;
+        Run run = {getComponentOffset(kernel, helper.component, kind) + helper.helperSlot[kind], helper.firstId[kind], helper.numProbes[kind]};
+        if (!runs.empty() && runs.back().slot + runs.back().length == run.slot && runs.back().id + runs.back().length == run.id){
+            runs.back().length += run.length;
+        } else {
+            runs.push_back(run);
+        }
+    }
+    return runs;
+}
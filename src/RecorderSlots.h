@@ -0,0 +1,81 @@
+#ifndef OPENCLBC_RECORDER_SLOTS_H
+#define OPENCLBC_RECORDER_SLOTS_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Slots of the probes in the __local recorders of each kernel, so that a kernel of a file with many kernels only
+// reserves local memory for the probes it can reach: those of its body and those of the helper functions
+// reachable from it in the call graph. Probes keep their IDs, which index the instrumentation buffer.
+// The slots of a kernel body come first, numbered from 0, then the helper slots. A helper indexes the recorders it
+// is given at fixed slots and passes them on unchanged to the helpers it calls, so helpers linked by calls share
+// one numbering: helper slots are numbered per connected component of the call graph between helpers. A kernel
+// lays out only the components it reaches, one after the other, and gives the helpers of each component its
+// recorders from the offset of that component on.
+class RecorderSlots{
+public:
+    enum ProbeKind{
+        CONDITION, ATOMIC, BLOCK, BARRIER, NUM_PROBE_KINDS   // Barrier counters are only slotted by openclbc-ir
+    };
+
+    // Consecutive slots of a kernel standing for consecutive probe IDs
+    struct Run{
+        int slot;
+        int id;
+        int length;
+    };
+
+    RecorderSlots();
+
+    // Functions with a body are added in order of appearance, then the probes in them, which take the next IDs
+    // of their kind, and the functions they call
+    void addFunction(const std::string& name, bool isKernel);
+    void addProbes(ProbeKind kind, int count);
+    void addCall(const std::string& callee);
+
+    // Once every function is added; calls to functions other than helpers are not followed
+    void computeSlots(const std::set<std::string>& helpers);
+
+    // Slot of a probe of a function
+    int getSlot(const std::string& function, ProbeKind kind, int id) const;
+
+    // Slots a kernel reserves
+    int getNumSlots(const std::string& kernel, ProbeKind kind) const;
+
+    // Component of the call graph a helper belongs to, -1 for kernels and functions without a body
+    int getComponent(const std::string& helper) const;
+
+    // Components a kernel reaches, in order of appearance
+    std::vector<int> getComponents(const std::string& kernel) const;
+
+    // Offset of the recorders a kernel gives to the helpers of a component; helpers pass theirs on unchanged
+    int getComponentOffset(const std::string& kernel, int component, ProbeKind kind) const;
+
+    // Slots of a kernel with their probe IDs, to copy its recorders to the instrumentation buffer
+    std::vector<Run> getRuns(const std::string& kernel, ProbeKind kind) const;
+
+private:
+    struct Function{
+        std::string name;
+        bool isKernel;
+        int component;                      // Of a helper
+        int firstId[NUM_PROBE_KINDS];
+        int numProbes[NUM_PROBE_KINDS];
+        int helperSlot[NUM_PROBE_KINDS];    // First slot of a helper in its component
+        int numSlots[NUM_PROBE_KINDS];      // Reserved by a kernel
+        std::set<std::string> callees;
+        std::vector<int> reachableHelpers;  // Of a kernel, in order of appearance
+        std::map<int, int> componentOffsets[NUM_PROBE_KINDS];   // Of the components a kernel reaches
+    };
+
+    std::vector<Function> functions;
+    std::map<std::string, int> functionIndices;
+    int numIds[NUM_PROBE_KINDS];
+
+    const Function* find(const std::string& name) const;
+    int findHelper(const std::string& name, const std::set<std::string>& helpers) const;
+};
+
+#endif
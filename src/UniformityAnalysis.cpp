@@ -0,0 +1,282 @@
+#include <cstring>
+
+#include "UniformityAnalysis.h"
+
+using namespace clang;
+
+namespace{
+
+// Work-item builtins returning the same value to the whole work-group, and work-group collectives
+const char* const UNIFORM_BUILTINS[] = {"get_work_dim", "get_global_size", "get_local_size", "get_enqueued_local_size",
+    "get_num_groups", "get_group_id", "get_global_offset", "work_group_all", "work_group_any", "work_group_broadcast"};
+
+bool startsWith(const std::string& text, const char* prefix){
+    return text.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Jumps backwards or into other blocks are not worth following
+bool containsGoto(const Stmt* s){
+    if (!s) return false;
+    if (isa<GotoStmt>(s) || isa<IndirectGotoStmt>(s)) return true;
+    for (const Stmt* child : s->children()){
+        if (containsGoto(child)) return true;
+    }
+    return false;
+}
+
+bool isPrivateAddressSpace(QualType type){
+    LangAS addressSpace = type.getAddressSpace();
+    return addressSpace != LangAS::opencl_global && addressSpace != LangAS::opencl_local && addressSpace != LangAS::opencl_constant;
+}
+
+}
+
+UniformityAnalysis::UniformityAnalysis(FunctionDecl* kernel, ASTContext& context, const std::set<std::string>& userFunctions)
+    : context(context), userFunctions(userFunctions), divergentReturn(false){
+    Stmt* body = kernel->getBody();
+    if (!body || containsGoto(body)) return;
+    // Variables only ever become varying, so this ends after at most one pass per variable
+    size_t numVarying;
+    do {
+        numVarying = varyingVariables.size();
+        uniformControl.clear();
+        divergentReturn = false;
+        walk(body, false);
+    } while (varyingVariables.size() != numVarying);
+}
+
+// divergent: some work-items of a work-group may not execute s while others do
+void UniformityAnalysis::walk(const Stmt* s, bool divergent){
+    if (!s) return;
+    divergent = divergent || divergentReturn;
+    if (!divergent) uniformControl.insert(s);
+
+    if (const IfStmt* ifStatement = dyn_cast<IfStmt>(s)){
+        walk(ifStatement->getCond(), divergent);
+        bool sidesDivergent = divergent || !isUniform(ifStatement->getCond());
+        walk(ifStatement->getThen(), sidesDivergent);
+        walk(ifStatement->getElse(), sidesDivergent);
+    } else if (const ForStmt* forStatement = dyn_cast<ForStmt>(s)){
+        walk(forStatement->getInit(), divergent);
+        walkLoop(forStatement->getCond(), forStatement->getInc(), forStatement->getBody(), divergent);
+    } else if (const WhileStmt* whileStatement = dyn_cast<WhileStmt>(s)){
+        walkLoop(whileStatement->getCond(), NULL, whileStatement->getBody(), divergent);
+    } else if (const DoStmt* doStatement = dyn_cast<DoStmt>(s)){
+        walkLoop(doStatement->getCond(), NULL, doStatement->getBody(), divergent);
+    } else if (const SwitchStmt* switchStatement = dyn_cast<SwitchStmt>(s)){
+        walk(switchStatement->getCond(), divergent);
+        walk(switchStatement->getBody(), divergent || !isUniform(switchStatement->getCond())
+            || hasDivergentJump(switchStatement->getBody(), false, false, false));
+    } else if (const ReturnStmt* returnStatement = dyn_cast<ReturnStmt>(s)){
+        walk(returnStatement->getRetValue(), divergent);
+        if (divergent) divergentReturn = true;
+    } else if (const DeclStmt* declStatement = dyn_cast<DeclStmt>(s)){
+        for (const Decl* decl : declStatement->decls()){
+            const VarDecl* variable = dyn_cast<VarDecl>(decl);
+            if (!variable || !variable->hasInit()) continue;
+            walk(variable->getInit(), divergent);
+            if (divergent || !isUniform(variable->getInit())) varyingVariables.insert(variable);
+        }
+    } else if (const BinaryOperator* binaryOperator = dyn_cast<BinaryOperator>(s)){
+        walk(binaryOperator->getLHS(), divergent);
+        if (binaryOperator->isLogicalOp()){
+            // The right operand is only evaluated by some work-items if the left one varies
+            walk(binaryOperator->getRHS(), divergent || !isUniform(binaryOperator->getLHS()));
+        } else {
+            walk(binaryOperator->getRHS(), divergent);
+        }
+        if (binaryOperator->isAssignmentOp()){
+            assign(binaryOperator->getLHS(), isUniform(binaryOperator->getRHS())
+                && (!binaryOperator->isCompoundAssignmentOp() || isUniform(binaryOperator->getLHS())), divergent);
+        }
+    } else if (const ConditionalOperator* conditionalOperator = dyn_cast<ConditionalOperator>(s)){
+        walk(conditionalOperator->getCond(), divergent);
+        bool sidesDivergent = divergent || !isUniform(conditionalOperator->getCond());
+        walk(conditionalOperator->getTrueExpr(), sidesDivergent);
+        walk(conditionalOperator->getFalseExpr(), sidesDivergent);
+    } else if (const UnaryOperator* unaryOperator = dyn_cast<UnaryOperator>(s)){
+        const VarDecl* variable;
+        if (unaryOperator->getOpcode() == UO_AddrOf && isPrivateVariable(unaryOperator->getSubExpr(), variable)){
+            // Could be written through the pointer anywhere
+            varyingVariables.insert(variable);
+        }
+        walk(unaryOperator->getSubExpr(), divergent);
+        if (unaryOperator->isIncrementDecrementOp()){
+            assign(unaryOperator->getSubExpr(), isUniform(unaryOperator->getSubExpr()), divergent);
+        }
+    } else if (const ArraySubscriptExpr* subscript = dyn_cast<ArraySubscriptExpr>(s)){
+        // Indexing a private array does not let it escape
+        const Expr* base = subscript->getBase();
+        const ImplicitCastExpr* decay = dyn_cast<ImplicitCastExpr>(base);
+        walk(decay && decay->getCastKind() == CK_ArrayToPointerDecay ? decay->getSubExpr() : base, divergent);
+        walk(subscript->getIdx(), divergent);
+    } else {
+        const ImplicitCastExpr* castExpr = dyn_cast<ImplicitCastExpr>(s);
+        const VarDecl* variable;
+        if (castExpr && castExpr->getCastKind() == CK_ArrayToPointerDecay && isPrivateVariable(castExpr->getSubExpr(), variable)){
+            // A private array passed around as a pointer
+            varyingVariables.insert(variable);
+        }
+        for (const Stmt* child : s->children()){
+            walk(child, divergent);
+        }
+    }
+}
+
+// The body runs the same number of times for every work-item if the condition is uniform and no work-item
+// breaks out of the loop, continues or returns under a varying condition
+void UniformityAnalysis::walkLoop(const Expr* condition, const Expr* increment, const Stmt* body, bool divergent){
+    bool bodyDivergent = divergent || (condition && !isUniform(condition)) || hasDivergentJump(body, false, false, false);
+    walk(condition, bodyDivergent);
+    walk(body, bodyDivergent);
+    walk(increment, bodyDivergent);
+}
+
+// Assignment of a value to target, a variable or an element of a private array or vector
+void UniformityAnalysis::assign(const Expr* target, bool uniformValue, bool divergent){
+    const Expr* e = target->IgnoreParenImpCasts();
+    while (true){
+        if (const ArraySubscriptExpr* subscript = dyn_cast<ArraySubscriptExpr>(e)){
+            uniformValue = uniformValue && isUniform(subscript->getIdx());
+            e = subscript->getBase()->IgnoreParenImpCasts();
+        } else if (const MemberExpr* member = dyn_cast<MemberExpr>(e)){
+            if (member->isArrow()) return;
+            e = member->getBase()->IgnoreParenImpCasts();
+        } else if (const ExtVectorElementExpr* element = dyn_cast<ExtVectorElementExpr>(e)){
+            e = element->getBase()->IgnoreParenImpCasts();
+        } else {
+            break;
+        }
+    }
+    const VarDecl* variable;
+    if ((divergent || !uniformValue) && isPrivateVariable(e, variable)){
+        varyingVariables.insert(variable);
+    }
+}
+
+// A return, or a break or continue leaving the loop or switch s belongs to, under a varying condition.
+// inLoop and inSwitch tell whether s is nested in another loop or switch, which breaks would leave instead.
+bool UniformityAnalysis::hasDivergentJump(const Stmt* s, bool varying, bool inLoop, bool inSwitch) const{
+    if (!s) return false;
+    if (isa<ReturnStmt>(s)) return varying;
+    if (isa<BreakStmt>(s)) return varying && !inLoop && !inSwitch;
+    if (isa<ContinueStmt>(s)) return varying && !inLoop;
+    if (const IfStmt* ifStatement = dyn_cast<IfStmt>(s)){
+        bool sidesVarying = varying || !isUniform(ifStatement->getCond());
+        return hasDivergentJump(ifStatement->getThen(), sidesVarying, inLoop, inSwitch)
+            || hasDivergentJump(ifStatement->getElse(), sidesVarying, inLoop, inSwitch);
+    }
+    const Expr* condition = NULL;
+    const Stmt* body = NULL;
+    if (const ForStmt* forStatement = dyn_cast<ForStmt>(s)){
+        condition = forStatement->getCond();
+        body = forStatement->getBody();
+    } else if (const WhileStmt* whileStatement = dyn_cast<WhileStmt>(s)){
+        condition = whileStatement->getCond();
+        body = whileStatement->getBody();
+    } else if (const DoStmt* doStatement = dyn_cast<DoStmt>(s)){
+        condition = doStatement->getCond();
+        body = doStatement->getBody();
+    } else if (const SwitchStmt* switchStatement = dyn_cast<SwitchStmt>(s)){
+        return hasDivergentJump(switchStatement->getBody(), varying || !isUniform(switchStatement->getCond()), inLoop, true);
+    }
+    if (body){
+        return hasDivergentJump(body, varying || (condition && !isUniform(condition)), true, inSwitch);
+    }
+    if (isa<Expr>(s)) return false;
+    for (const Stmt* child : s->children()){
+        if (hasDivergentJump(child, varying, inLoop, inSwitch)) return true;
+    }
+    return false;
+}
+
+// e names a private variable, or an element of one
+bool UniformityAnalysis::isPrivateVariable(const Expr* e, const VarDecl*& variable) const{
+    e = e->IgnoreParenImpCasts();
+    while (true){
+        if (const ArraySubscriptExpr* subscript = dyn_cast<ArraySubscriptExpr>(e)) e = subscript->getBase()->IgnoreParenImpCasts();
+        else if (const MemberExpr* member = dyn_cast<MemberExpr>(e)) e = member->getBase()->IgnoreParenImpCasts();
+        else if (const ExtVectorElementExpr* element = dyn_cast<ExtVectorElementExpr>(e)) e = element->getBase()->IgnoreParenImpCasts();
+        else break;
+    }
+    const DeclRefExpr* reference = dyn_cast<DeclRefExpr>(e);
+    variable = reference ? dyn_cast<VarDecl>(reference->getDecl()) : NULL;
+    return variable && variable->hasLocalStorage() && isPrivateAddressSpace(variable->getType());
+}
+
+// Loads from private arrays follow their variable; __constant memory cannot change during a launch,
+// so a uniform address gives a uniform value. Anything else may be written by other work-items.
+bool UniformityAnalysis::isUniformLoad(const Expr* base, const Expr* index) const{
+    if (index && !isUniform(index)) return false;
+    const VarDecl* variable;
+    if (isa<DeclRefExpr>(base->IgnoreParenImpCasts()) && isPrivateVariable(base, variable)
+        && base->IgnoreParenImpCasts()->getType()->isArrayType()){
+        return !varyingVariables.count(variable);
+    }
+    QualType pointee = base->getType()->isPointerType() ? base->getType()->getPointeeType()
+        : base->getType()->isArrayType() ? context.getAsArrayType(base->getType())->getElementType() : QualType();
+    return !pointee.isNull() && pointee.getAddressSpace() == LangAS::opencl_constant && isUniform(base);
+}
+
+bool UniformityAnalysis::isUniformCall(const CallExpr* call) const{
+    const FunctionDecl* callee = call->getDirectCallee();
+    if (!callee) return false;
+    std::string name = callee->getNameAsString();
+    if (userFunctions.count(name)) return false;
+    bool uniformBuiltin = startsWith(name, "work_group_reduce_");
+    for (const char* builtin : UNIFORM_BUILTINS){
+        uniformBuiltin = uniformBuiltin || name == builtin;
+    }
+    if (!uniformBuiltin){
+        // Work-item IDs, atomics, images and sub-groups vary; so may builtins reading or writing memory
+        if (startsWith(name, "get_") || startsWith(name, "atom") || startsWith(name, "read_image") || startsWith(name, "sub_group_")
+            || startsWith(name, "work_group_") || startsWith(name, "vload") || startsWith(name, "async_")){
+            return false;
+        }
+        for (const Expr* argument : call->arguments()){
+            if (argument->getType()->isPointerType()) return false;
+        }
+    }
+    for (const Expr* argument : call->arguments()){
+        if (!isUniform(argument)) return false;
+    }
+    return true;
+}
+
+bool UniformityAnalysis::isUniform(const Expr* e) const{
+    if (!e) return true;
+    e = e->IgnoreParens();
+    if (!e->isValueDependent() && e->isEvaluatable(context)) return true;
+
+    if (const DeclRefExpr* reference = dyn_cast<DeclRefExpr>(e)){
+        const VarDecl* variable = dyn_cast<VarDecl>(reference->getDecl());
+        if (!variable) return true;     // Enum constants and functions
+        if (variable->getType().getAddressSpace() == LangAS::opencl_constant) return true;
+        if (!isPrivateAddressSpace(variable->getType()) || !variable->hasLocalStorage()) return false;
+        return !varyingVariables.count(variable);
+    }
+    if (const ArraySubscriptExpr* subscript = dyn_cast<ArraySubscriptExpr>(e)){
+        return isUniformLoad(subscript->getBase(), subscript->getIdx());
+    }
+    if (const UnaryOperator* unaryOperator = dyn_cast<UnaryOperator>(e)){
+        if (unaryOperator->getOpcode() == UO_Deref) return isUniformLoad(unaryOperator->getSubExpr(), NULL);
+        if (unaryOperator->getOpcode() == UO_AddrOf) return false;
+        return isUniform(unaryOperator->getSubExpr());
+    }
+    if (const MemberExpr* member = dyn_cast<MemberExpr>(e)){
+        return member->isArrow() ? isUniformLoad(member->getBase(), NULL) : isUniform(member->getBase());
+    }
+    if (const CallExpr* call = dyn_cast<CallExpr>(e)){
+        return isUniformCall(call);
+    }
+    if (const BinaryOperator* binaryOperator = dyn_cast<BinaryOperator>(e)){
+        if (binaryOperator->getOpcode() == BO_Comma || (binaryOperator->isAssignmentOp() && !binaryOperator->isCompoundAssignmentOp())){
+            return isUniform(binaryOperator->getRHS());
+        }
+    }
+    for (const Stmt* child : e->children()){
+        const Expr* operand = dyn_cast_or_null<Expr>(child);
+        if (child && (!operand || !isUniform(operand))) return false;
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef OPENCLBC_UNIFORMITY_ANALYSIS_H
+#define OPENCLBC_UNIFORMITY_ANALYSIS_H
+
+#include <set>
+#include <string>
+
+#include "clang/AST/AST.h"
+
+// Which values and statements of a kernel are the same for every work-item of a work-group.
+// A value is uniform when it only depends on kernel arguments, constants, __constant memory and
+// builtins such as get_group_id or get_local_size; get_local_id, other memory and user-defined functions
+// make it vary. A statement has uniform control when every work-item of a work-group reaches it, or none:
+// all the conditions it depends on are uniform and no work-item left the kernel or a loop before it
+// under a varying condition.
+// The analysis is flow-insensitive: a private variable is uniform only if every assignment to it is,
+// and its address is never taken. It is iterated until no more variables are found varying.
+class UniformityAnalysis{
+public:
+    // Analyses the body of a kernel; userFunctions are the functions defined in the kernel file
+    UniformityAnalysis(clang::FunctionDecl* kernel, clang::ASTContext& context, const std::set<std::string>& userFunctions);
+
+    bool isUniform(const clang::Expr* e) const;
+    bool hasUniformControl(const clang::Stmt* s) const { return uniformControl.count(s) != 0; }
+
+    // Every work-item of a work-group reaching the if takes the same side
+    bool isUniformBranch(const clang::IfStmt* s) const { return hasUniformControl(s) && isUniform(s->getCond()); }
+
+private:
+    clang::ASTContext& context;
+    const std::set<std::string>& userFunctions;
+    std::set<const clang::VarDecl*> varyingVariables;
+    std::set<const clang::Stmt*> uniformControl;
+    bool divergentReturn;       // A work-item may have returned before the statement being walked
+
+    void walk(const clang::Stmt* s, bool divergent);
+    void walkLoop(const clang::Expr* condition, const clang::Expr* increment, const clang::Stmt* body, bool divergent);
+    void assign(const clang::Expr* target, bool uniformValue, bool divergent);
+    bool hasDivergentJump(const clang::Stmt* s, bool varying, bool inLoop, bool inSwitch) const;
+    bool isPrivateVariable(const clang::Expr* e, const clang::VarDecl*& variable) const;
+    bool isUniformLoad(const clang::Expr* base, const clang::Expr* index) const;
+    bool isUniformCall(const clang::CallExpr* call) const;
+};
+
+#endif
@@ -161,6 +161,20 @@ std::string UserConfig::getValue(std::string key){
     return result;
 }
 
+int UserConfig::getIntValue(std::string key, int defaultValue){
+    std::string value = this->getValue(key);
+    try {
+        return value.empty() ? defaultValue : std::stoi(value);
+    } catch (const std::exception&) {
+        return defaultValue;
+    }
+}
+
+bool UserConfig::isEnabled(std::string key){
+    std::string value = this->getValue(key);
+    return value == "true" || value == "yes" || value == "on" || value == "1";
+}
+
 int UserConfig::getNumAddedLines(){
     return numAddedLines;
 }
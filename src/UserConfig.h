@@ -25,6 +25,12 @@ public:
 
     std::string getValue(std::string key);
 
+    // Integer value of key, or defaultValue if it is missing or not a number
+    int getIntValue(std::string key, int defaultValue);
+
+    // Whether an on/off option is switched on (true, yes, on or 1)
+    bool isEnabled(std::string key);
+
     int getNumAddedLines();
 
     bool isEmpty();
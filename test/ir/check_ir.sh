@@ -0,0 +1,89 @@
+#!/bin/sh
+# Checks openclbc-ir against the source rewriter on test/pi_ocl/pi_ocl.cl, on a PoCL device:
+# the kernel is compiled to SPIR bitcode with the in-tree clang and instrumented by openclbc-ir, the module
+# is checked with the verifier, then both instrumented kernels run on the same input and the branch sides
+# taken on each source line with an if are compared. Probes do not match one to one (the IR backend also
+# probes loop branches and selects, and conditions may be inverted), so a line is compared by the number of
+# its sides taken.
+#
+# Usage: test/ir/check_ir.sh bindir [workdir]
+# bindir holds openclbc, openclbc-ir, openclbc-fuzz, openclbc-run-corpus and openclbc-export, and clang and
+# opt when LLVM is built in the same tree (otherwise they are taken from the PATH).
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 bindir [workdir]" >&2
+    exit 1
+fi
+BIN=$(cd "$1" && pwd)
+WORK=${2:-$(mktemp -d)}
+SOURCE=$(cd "$(dirname "$0")/../pi_ocl" && pwd)/pi_ocl.cl
+CLANG=clang
+OPT=opt
+[ -x "$BIN/clang" ] && CLANG="$BIN/clang"
+[ -x "$BIN/opt" ] && OPT="$BIN/opt"
+
+rm -rf "$WORK/src" "$WORK/ir" "$WORK/corpus"
+mkdir -p "$WORK/src" "$WORK/ir" "$WORK/corpus"
+# openclbc gives the kernel a fake header while it runs, so it works on a copy
+cp "$SOURCE" "$WORK/pi_ocl.cl"
+
+"$CLANG" -cl-std=CL1.2 -target spir64 -O2 -g -emit-llvm -Xclang -finclude-default-header \
+    -c "$WORK/pi_ocl.cl" -o "$WORK/pi_ocl.bc"
+"$BIN/openclbc-ir" "$WORK/pi_ocl.bc" -o "$WORK/ir"
+"$OPT" -verify -disable-output "$WORK/ir/pi_ocl.cl.bc"
+"$BIN/openclbc" "$WORK/pi_ocl.cl" -o "$WORK/src" --
+
+# 8 work-groups of 8 work-items; fixed ranges make every input the same
+for backend in src ir; do
+    if [ $backend = src ]; then
+        kernel="$WORK/src/pi_ocl.cl"
+        options=""
+    else
+        kernel="$WORK/ir/pi_ocl.cl.bc"
+        options="-x spir -spir-std=1.2"
+    fi
+    cat > "$WORK/$backend.schema" <<EOF
+kernel: pi
+source: $kernel
+build_options: $options
+global: 64
+local: 8
+arg: int 16 16
+arg: float 0.001 0.001
+arg: local 32
+arg: out float[8]
+EOF
+done
+"$BIN/openclbc-fuzz" "$WORK/src.schema" -corpus "$WORK/corpus" -runs 1 -seed 1 > /dev/null
+
+for backend in src ir; do
+    if [ $backend = src ]; then data="$WORK/src/pi_ocl.cl.dat"; else data="$WORK/ir/pi_ocl.cl.dat"; fi
+    "$BIN/openclbc-run-corpus" "$WORK/$backend.schema" -partitions 1 -o "$WORK/$backend.ocbd" "$WORK/corpus/input-0"
+    "$BIN/openclbc-export" -f lcov -o "$WORK/$backend.info" "$data" "$WORK/$backend.ocbd"
+    # line sides: the most sides taken by a condition of the line
+    awk -F'[:,]' '/^BRDA:/ { taken[$2 "," $3] += ($5 == "1") }
+        END { for (c in taken) { split(c, key, ","); if (taken[c] > most[key[1]]) most[key[1]] = taken[c]; seen[key[1]] = 1 }
+              for (l in seen) print l, most[l] + 0 }' "$WORK/$backend.info" | sort -n > "$WORK/$backend.lines"
+done
+
+status=0
+if [ ! -s "$WORK/src.lines" ]; then
+    echo "The source rewriter found no condition in pi_ocl.cl"
+    status=1
+fi
+while read -r line sides; do
+    irSides=$(awk -v line="$line" '$1 == line { print $2 }' "$WORK/ir.lines")
+    if [ -z "$irSides" ]; then
+        echo "pi_ocl.cl:$line: no branch probe in the IR"
+        status=1
+    elif [ "$irSides" != "$sides" ]; then
+        echo "pi_ocl.cl:$line: $sides sides taken with the source rewriter, $irSides with openclbc-ir"
+        status=1
+    fi
+done < "$WORK/src.lines"
+if [ $status = 0 ]; then
+    echo "openclbc-ir agrees with the source rewriter on $(wc -l < "$WORK/src.lines") conditions"
+fi
+exit $status
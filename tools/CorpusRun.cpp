@@ -0,0 +1,237 @@
+// Run an instrumented kernel over a corpus of inputs (e.g. the corpus of openclbc-fuzz) in parallel.
+// The CPU device is split with clCreateSubDevices into partitions of equal compute units; the program is
+// built once for all of them and every partition runs inputs in its own thread, with its own command queue
+// and instrumentation buffer. Each partition merges the results of its inputs, and the partitions are merged
+// at the end. Devices that cannot be partitioned get one command queue per partition instead.
+//
+// Usage: openclbc-run-corpus schema.txt [-partitions n] [-o merged.ocbd] [-dumps dir] [-benchmark] input...
+// -dumps writes the dump of every input and a runtimes.txt for openclbc-minimize; -benchmark runs the corpus
+// with 1, 2, 4... partitions up to the number of compute units and prints the throughput of each.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../runtime/CoverageDump.h"
+#include "KernelHarness.h"
+
+struct CorpusResult{
+    std::vector<cl_uint> merged;        // Instrumentation buffer merged over all inputs
+    std::vector<double> seconds;        // Per input
+    size_t numFailures = 0;
+    double elapsed = 0;
+};
+
+cl_uint computeUnits(cl_device_id device){
+    cl_uint units = 1;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+    return std::max(units, 1u);
+}
+
+// One device per partition, the same device repeated if it cannot be partitioned
+std::vector<cl_device_id> partitionDevice(cl_device_id device, cl_uint numPartitions, bool& partitioned){
+    std::vector<cl_device_id> devices(numPartitions, device);
+    partitioned = false;
+    if (numPartitions < 2) return devices;
+    cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY,
+        (cl_device_partition_property)std::max(computeUnits(device) / numPartitions, 1u), 0};
+    cl_uint numDevices = 0;
+    std::vector<cl_device_id> subDevices(numPartitions);
+    if (clCreateSubDevices(device, properties, numPartitions, subDevices.data(), &numDevices) == CL_SUCCESS
+        && numDevices == numPartitions){
+        partitioned = true;
+        return subDevices;
+    }
+    for (cl_uint i = 0; i < numDevices; i++){
+        clReleaseDevice(subDevices[i]);
+    }
+    return devices;
+}
+
+bool readInput(const std::string& inputFileName, size_t inputSize, std::vector<unsigned char>& input, std::string& error){
+    std::ifstream inputFile(inputFileName, std::ios::binary);
+    if (!inputFile){
+        error = "cannot open " + inputFileName;
+        return false;
+    }
+    input.assign(std::istreambuf_iterator<char>(inputFile), std::istreambuf_iterator<char>());
+    if (input.size() != inputSize){
+        error = inputFileName + " has " + std::to_string(input.size()) + " bytes, the schema needs " + std::to_string(inputSize);
+        return false;
+    }
+    return true;
+}
+
+std::string baseName(const std::string& path){
+    return path.substr(path.find_last_of('/') + 1);
+}
+
+bool runCorpus(const KernelSchema& schema, cl_device_id device, cl_uint numPartitions, const std::vector<std::string>& inputFileNames,
+    const std::string& dumpDirectory, CorpusResult& result, std::string& error){
+    bool partitioned;
+    std::vector<cl_device_id> devices = partitionDevice(device, numPartitions, partitioned);
+    std::vector<cl_device_id> uniqueDevices = partitioned ? devices : std::vector<cl_device_id>(1, device);
+    cl_int err;
+    cl_context context = clCreateContext(NULL, uniqueDevices.size(), uniqueDevices.data(), NULL, NULL, &err);
+    cl_program program = err == CL_SUCCESS ? buildKernelProgram(schema, context, uniqueDevices, error) : NULL;
+    if (err != CL_SUCCESS) error = "cannot create a context, error " + std::to_string(err);
+
+    std::vector<KernelHarness> harnesses(numPartitions);
+    bool initialised = program != NULL;
+    for (cl_uint p = 0; p < numPartitions && initialised; p++){
+        initialised = harnesses[p].initialise(schema, context, program, devices[p], error);
+    }
+    if (program) clReleaseProgram(program);
+    if (context) clReleaseContext(context);
+    if (initialised){
+        const KernelProbes& probes = harnesses[0].getProbes();
+        std::vector<std::vector<cl_uint> > merged(numPartitions);
+        std::atomic<size_t> nextInput(0);
+        std::atomic<size_t> numFailures(0);
+        result.seconds.assign(inputFileNames.size(), 0.0);
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (cl_uint p = 0; p < numPartitions; p++){
+            threads.push_back(std::thread([&, p](){
+                std::vector<unsigned char> input;
+                std::vector<cl_uint> words;
+                std::string inputError;
+                for (size_t i = nextInput++; i < inputFileNames.size(); i = nextInput++){
+                    auto inputStart = std::chrono::steady_clock::now();
+                    if (!readInput(inputFileNames[i], schema.inputSize, input, inputError)
+                        || !harnesses[p].run(input, inputError) || !harnesses[p].readInstrumentation(words, inputError)){
+                        fprintf(stderr, "%s: %s\n", inputFileNames[i].c_str(), inputError.c_str());
+                        numFailures++;
+                        continue;
+                    }
+                    result.seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - inputStart).count();
+                    if (!dumpDirectory.empty()){
+                        openclbc::writeCoverageDump(dumpDirectory + "/" + baseName(inputFileNames[i]) + ".ocbd", probes.kernelHash,
+                            probes.wideKinds, words.data());
+                    }
+                    if (merged[p].empty()) merged[p] = words;
+                    else openclbc::mergeCoverageBuffer(merged[p].data(), words.data(), probes.wideKinds);
+                }
+            }));
+        }
+        for (auto& thread : threads){
+            thread.join();
+        }
+        result.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        result.numFailures = numFailures;
+        result.merged.clear();
+        for (auto& partial : merged){
+            if (partial.empty()) continue;
+            if (result.merged.empty()) result.merged = partial;
+            else openclbc::mergeCoverageBuffer(result.merged.data(), partial.data(), probes.wideKinds);
+        }
+    }
+    harnesses.clear();
+    if (partitioned){
+        for (cl_device_id subDevice : devices){
+            clReleaseDevice(subDevice);
+        }
+    }
+    return initialised;
+}
+
+int main(int argc, const char** argv){
+    std::string schemaFileName, outputFileName, dumpDirectory;
+    cl_uint numPartitions = 0;
+    bool benchmark = false;
+    std::vector<std::string> inputFileNames;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-partitions") == 0 && i + 1 < argc){
+            numPartitions = std::stoul(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+            outputFileName = argv[++i];
+        } else if (strcmp(argv[i], "-dumps") == 0 && i + 1 < argc){
+            dumpDirectory = argv[++i];
+        } else if (strcmp(argv[i], "-benchmark") == 0){
+            benchmark = true;
+        } else if (schemaFileName.empty()){
+            schemaFileName = argv[i];
+        } else {
+            inputFileNames.push_back(argv[i]);
+        }
+    }
+    if (schemaFileName.empty() || inputFileNames.empty()){
+        std::cerr << "Usage: " << argv[0] << " schema.txt [-partitions n] [-o merged.ocbd] [-dumps dir] [-benchmark] input...\n";
+        return 1;
+    }
+
+    KernelSchema schema;
+    std::string error;
+    if (!schema.load(schemaFileName, error)){
+        std::cerr << error << "\n";
+        return 1;
+    }
+    cl_device_id device = findDevice();
+    if (!device){
+        std::cerr << "No OpenCL device found\n";
+        return 1;
+    }
+    cl_uint units = computeUnits(device);
+
+    CorpusResult result;
+    if (benchmark){
+        // Outputs are only written by normal runs
+        double baseline = 0;
+        printf("%-12s %-12s %-12s %s\n", "partitions", "seconds", "inputs/s", "speedup");
+        for (cl_uint partitions = 1; ; partitions = std::min(partitions * 2, units)){
+            if (!runCorpus(schema, device, partitions, inputFileNames, "", result, error)){
+                std::cerr << error << "\n";
+                return 1;
+            }
+            double throughput = inputFileNames.size() / result.elapsed;
+            if (partitions == 1) baseline = throughput;
+            printf("%-12u %-12.3f %-12.1f %.2fx\n", partitions, result.elapsed, throughput, throughput / baseline);
+            if (partitions == units) break;
+        }
+        return 0;
+    }
+
+    if (!runCorpus(schema, device, numPartitions ? numPartitions : units, inputFileNames, dumpDirectory, result, error)){
+        std::cerr << error << "\n";
+        return 1;
+    }
+    if (!dumpDirectory.empty()){
+        std::ofstream runtimes(dumpDirectory + "/runtimes.txt");
+        for (size_t i = 0; i < inputFileNames.size(); i++){
+            runtimes << dumpDirectory << "/" << baseName(inputFileNames[i]) << ".ocbd " << result.seconds[i] << "\n";
+        }
+    }
+    if (result.merged.empty()){
+        std::cerr << "No input ran\n";
+        return 1;
+    }
+    const cl_uint* buffer = result.merged.data();
+    unsigned int numBranches = buffer[3 + 2 * recorder_layout::BRANCH];
+    unsigned int coveredBranches = 0;
+    for (unsigned int i = 0; i < numBranches; i++){
+        coveredBranches += buffer[buffer[2 + 2 * recorder_layout::BRANCH] + i] != 0;
+    }
+    printf("Ran %lu inputs in %.3f s (%.1f inputs/s), %lu failed\n", (unsigned long)(inputFileNames.size() - result.numFailures),
+        result.elapsed, (inputFileNames.size() - result.numFailures) / result.elapsed, (unsigned long)result.numFailures);
+    if (numBranches){
+        printf("Total branch coverage: %-4.2f (%u of %u branches)\n", 100.0 * coveredBranches / numBranches, coveredBranches, numBranches);
+    }
+    if (!outputFileName.empty()){
+        KernelProbes probes;
+        if (!probes.load(schema.sourceFile + ".dat", error)
+            || !openclbc::writeCoverageDump(outputFileName, probes.kernelHash, probes.wideKinds, buffer)){
+            std::cerr << "Cannot write " << outputFileName << "\n";
+            return 1;
+        }
+    }
+    return result.numFailures ? 1 : 0;
+}
@@ -0,0 +1,503 @@
+// Export kernel coverage to the formats of host coverage dashboards: LCOV tracefiles (BRDA/DA records),
+// Cobertura XML or JSON. Every kernel is given as its data file and a dump of its results (merged with
+// openclbc-merge or accumulated with accumulation_file).
+// Data files are read whole and probes refer into them, so the only structures built are one record per
+// probe and per source line; output goes through a single large buffer, written as it fills.
+//
+// Usage: openclbc-export [-f lcov|cobertura|json] [-o output] kernel.cl.dat kernel.cl.ocbd...
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/Constants.h"
+
+// Part of a data file
+struct Text{
+    const char* data;
+    size_t size;
+
+    bool operator<(const Text& other) const{
+        int order = memcmp(data, other.data, std::min(size, other.size));
+        return order < 0 || (order == 0 && size < other.size);
+    }
+    bool operator==(const Text& other) const{
+        return size == other.size && memcmp(data, other.data, size) == 0;
+    }
+};
+
+struct Probe{
+    Text file;
+    unsigned int line;
+    unsigned int column;
+    Text text;
+};
+
+struct Kernel{
+    std::string name;
+    std::vector<char> data;
+    unsigned long long hash = 0;
+    std::vector<Probe> conditions;
+    std::vector<Probe> barriers;
+    std::vector<Probe> atomics;
+    std::vector<Probe> blocks;
+    std::vector<unsigned int> buffer;   // Instrumentation buffer from the dump, starting with its layout header
+    unsigned int wideKinds = 0;
+
+    bool has(recorder_layout::RecorderKind kind) const{
+        return buffer[3 + 2 * kind] != 0;
+    }
+    unsigned long long value(recorder_layout::RecorderKind kind, size_t i) const{
+        if (i >= buffer[3 + 2 * kind]) return 0;
+        const unsigned int* recorder = buffer.data() + buffer[2 + 2 * kind];
+        if ((wideKinds >> kind) & 1u) return recorder[2 * i] | ((unsigned long long)recorder[2 * i + 1] << 32);
+        return recorder[i];
+    }
+};
+
+bool readFile(const char* path, std::vector<char>& contents){
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    contents.resize(size > 0 ? size : 0);
+    bool complete = size >= 0 && fread(contents.data(), 1, contents.size(), file) == contents.size();
+    fclose(file);
+    return complete;
+}
+
+bool startsWith(const char* line, size_t length, const char* prefix, size_t prefixLength){
+    return length >= prefixLength && memcmp(line, prefix, prefixLength) == 0;
+}
+
+// file:line:column, as written by the rewriter
+void parseSourceLine(Text sourceLine, Probe& probe){
+    const char* end = sourceLine.data + sourceLine.size;
+    const char* columnStart = end;
+    while (columnStart > sourceLine.data && columnStart[-1] != ':') columnStart--;
+    const char* lineStart = columnStart > sourceLine.data ? columnStart - 1 : columnStart;
+    while (lineStart > sourceLine.data && lineStart[-1] != ':') lineStart--;
+    probe.file = {sourceLine.data, lineStart > sourceLine.data ? (size_t)(lineStart - 1 - sourceLine.data) : sourceLine.size};
+    probe.line = (unsigned int)strtoul(lineStart, NULL, 10);
+    probe.column = (unsigned int)strtoul(columnStart, NULL, 10);
+}
+
+bool loadKernel(const char* dataFileName, const char* dumpFileName, Kernel& kernel){
+    kernel.name = dataFileName;
+    if (kernel.name.size() > 4 && kernel.name.compare(kernel.name.size() - 4, 4, ".dat") == 0){
+        kernel.name.resize(kernel.name.size() - 4);
+    }
+    if (!readFile(dataFileName, kernel.data)){
+        std::cerr << "Cannot read " << dataFileName << "\n";
+        return false;
+    }
+    std::vector<Probe>* section = NULL;
+    const char* line = kernel.data.data();
+    const char* end = line + kernel.data.size();
+    while (line < end){
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if (!lineEnd) lineEnd = end;
+        size_t length = lineEnd - line;
+        std::vector<Probe>* entry = NULL;
+        if (startsWith(line, length, "Condition ID: ", 14)) entry = &kernel.conditions;
+        else if (startsWith(line, length, "Barrier ID: ", 12)) entry = &kernel.barriers;
+        else if (startsWith(line, length, "Atomic ID: ", 11)) entry = &kernel.atomics;
+        else if (startsWith(line, length, "Block ID: ", 10)) entry = &kernel.blocks;
+        else if (startsWith(line, length, "Region ID: ", 11)) section = NULL;
+        else if (startsWith(line, length, "Constant condition ID: ", 23)) section = NULL;
+        else if (startsWith(line, length, "Kernel hash: ", 13)) kernel.hash = strtoull(line + 13, NULL, 16);
+        if (entry){
+            section = entry;
+            Probe probe = {{line, 0}, 0, 0, {line, 0}};
+            section->push_back(probe);
+        } else if (section && !section->empty()){
+            Probe& probe = section->back();
+            if (startsWith(line, length, "Source code line: ", 18)){
+                parseSourceLine({line + 18, length - 18}, probe);
+            } else if (startsWith(line, length, "Condition: ", 11)){
+                probe.text = {line + 11, length - 11};
+            } else if (startsWith(line, length, "Atomic: ", 8) || startsWith(line, length, "Function: ", 10)){
+                const char* colon = (const char*)memchr(line, ':', length);
+                probe.text = {colon + 2, (size_t)(lineEnd - colon - 2)};
+            }
+        }
+        line = lineEnd + 1;
+    }
+
+    std::vector<char> dump;
+    if (!readFile(dumpFileName, dump) || dump.size() < dump_format::HEADER_WORDS * sizeof(unsigned int)){
+        std::cerr << "Cannot read " << dumpFileName << "\n";
+        return false;
+    }
+    unsigned int header[dump_format::HEADER_WORDS];
+    memcpy(header, dump.data(), sizeof(header));
+    unsigned long long dumpHash = header[2] | ((unsigned long long)header[3] << 32);
+    if (header[0] != dump_format::FILE_MAGIC || header[1] != dump_format::VERSION
+        || dump.size() != (dump_format::HEADER_WORDS + (size_t)header[5]) * sizeof(unsigned int)){
+        std::cerr << dumpFileName << " is not an OpenCLBC dump or truncated\n";
+        return false;
+    }
+    if (dumpHash != kernel.hash){
+        std::cerr << dumpFileName << " was not written by the kernel of " << dataFileName << "\n";
+        return false;
+    }
+    kernel.wideKinds = header[4];
+    kernel.buffer.resize(header[5]);
+    memcpy(kernel.buffer.data(), dump.data() + sizeof(header), header[5] * sizeof(unsigned int));
+    return true;
+}
+
+// Buffered output; nothing is kept once written
+class Output{
+public:
+    explicit Output(FILE* file) : file(file), buffer(1 << 20), used(0) {}
+    ~Output(){ flush(); }
+
+    Output& operator<<(const char* text){
+        put(text, strlen(text));
+        return *this;
+    }
+    Output& operator<<(const std::string& text){
+        put(text.data(), text.size());
+        return *this;
+    }
+    Output& operator<<(Text text){
+        put(text.data, text.size);
+        return *this;
+    }
+    Output& operator<<(unsigned long long value){
+        char digits[20];
+        int n = 0;
+        do {
+            digits[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        while (n) put(&digits[--n], 1);
+        return *this;
+    }
+    Output& operator<<(unsigned int value){
+        return *this << (unsigned long long)value;
+    }
+    Output& operator<<(double value){
+        char text[32];
+        put(text, snprintf(text, sizeof(text), "%.4f", value));
+        return *this;
+    }
+
+    // Text inside a JSON string or an XML attribute
+    void escaped(Text text, bool xml){
+        for (size_t i = 0; i < text.size; i++){
+            char c = text.data[i];
+            if (xml && c == '&') *this << "&amp;";
+            else if (xml && c == '<') *this << "&lt;";
+            else if (xml && c == '>') *this << "&gt;";
+            else if (xml && c == '"') *this << "&quot;";
+            else if (!xml && (c == '"' || c == '\\')){
+                put("\\", 1);
+                put(&c, 1);
+            } else if ((unsigned char)c < 0x20){
+                *this << (xml ? " " : "\\u0020");
+            } else {
+                put(&c, 1);
+            }
+        }
+    }
+
+    bool flush(){
+        bool written = fwrite(buffer.data(), 1, used, file) == used;
+        used = 0;
+        return written;
+    }
+
+private:
+    FILE* file;
+    std::vector<char> buffer;
+    size_t used;
+
+    void put(const char* data, size_t size){
+        if (used + size > buffer.size()) flush();
+        if (size > buffer.size()){
+            fwrite(data, 1, size, file);
+            return;
+        }
+        memcpy(buffer.data() + used, data, size);
+        used += size;
+    }
+};
+
+// A condition or a block at a source location, for the line-based formats
+struct LineRecord{
+    Text file;
+    unsigned int line;
+    unsigned int column;
+    bool isBlock;
+    const Kernel* kernel;
+    unsigned int id;
+
+    bool operator<(const LineRecord& other) const{
+        if (!(file == other.file)) return file < other.file;
+        if (line != other.line) return line < other.line;
+        if (column != other.column) return column < other.column;
+        return isBlock < other.isBlock;
+    }
+};
+
+// All conditions and blocks of a source line
+struct LineSummary{
+    const LineRecord* begin;
+    const LineRecord* end;
+    unsigned long long hits;
+    unsigned int branches;
+    unsigned int coveredBranches;
+};
+
+std::vector<LineRecord> collectRecords(const std::vector<Kernel>& kernels){
+    std::vector<LineRecord> records;
+    for (const Kernel& kernel : kernels){
+        for (unsigned int i = 0; i < kernel.conditions.size(); i++){
+            const Probe& probe = kernel.conditions[i];
+            records.push_back({probe.file, probe.line, probe.column, false, &kernel, i});
+        }
+        if (!kernel.has(recorder_layout::BLOCK)) continue;
+        for (unsigned int i = 0; i < kernel.blocks.size(); i++){
+            const Probe& probe = kernel.blocks[i];
+            records.push_back({probe.file, probe.line, probe.column, true, &kernel, i});
+        }
+    }
+    std::sort(records.begin(), records.end());
+    return records;
+}
+
+// Whether both sides of the conditions at a location were taken, over all kernels
+void conditionSides(const LineRecord* begin, const LineRecord* end, bool taken[2]){
+    taken[0] = taken[1] = false;
+    for (const LineRecord* record = begin; record != end; record++){
+        for (int side = 0; side < 2; side++){
+            taken[side] = taken[side] || record->kernel->value(recorder_layout::BRANCH, 2 * record->id + side) != 0;
+        }
+    }
+}
+
+// Records of the same kind at the same location as the first one
+const LineRecord* sameLocation(const LineRecord* record, const LineRecord* end){
+    const LineRecord* next = record + 1;
+    while (next != end && next->isBlock == record->isBlock && next->column == record->column) next++;
+    return next;
+}
+
+// Conditions at the same location (a header included by several kernels) are ORed. A line is hit as many
+// times as its most executed block; without block counts, once if any of its branches was taken.
+std::vector<LineSummary> summariseLines(const std::vector<LineRecord>& records){
+    std::vector<LineSummary> lines;
+    const LineRecord* end = records.data() + records.size();
+    for (const LineRecord* begin = records.data(); begin != end;){
+        LineSummary summary = {begin, begin, 0, 0, 0};
+        while (summary.end != end && summary.end->file == begin->file && summary.end->line == begin->line) summary.end++;
+        bool counted = false;
+        for (const LineRecord* record = begin; record != summary.end;){
+            const LineRecord* next = sameLocation(record, summary.end);
+            if (record->isBlock){
+                for (const LineRecord* block = record; block != next; block++){
+                    summary.hits = std::max(summary.hits, block->kernel->value(recorder_layout::BLOCK, block->id));
+                }
+                counted = true;
+            } else {
+                bool taken[2];
+                conditionSides(record, next, taken);
+                summary.branches += 2;
+                summary.coveredBranches += taken[0] + taken[1];
+            }
+            record = next;
+        }
+        if (!counted) summary.hits = summary.coveredBranches != 0;
+        lines.push_back(summary);
+        begin = summary.end;
+    }
+    return lines;
+}
+
+void exportLcov(const std::vector<LineSummary>& lines, Output& output){
+    for (size_t i = 0; i < lines.size();){
+        Text file = lines[i].begin->file;
+        unsigned int linesFound = 0, linesHit = 0, branchesFound = 0, branchesHit = 0;
+        output << "TN:\nSF:" << file << "\n";
+        for (; i < lines.size() && lines[i].begin->file == file; i++){
+            const LineSummary& summary = lines[i];
+            // The column identifies the condition, so tracefiles of kernels sharing a file merge
+            for (const LineRecord* record = summary.begin; record != summary.end;){
+                const LineRecord* next = sameLocation(record, summary.end);
+                if (!record->isBlock){
+                    bool taken[2];
+                    conditionSides(record, next, taken);
+                    for (int side = 0; side < 2; side++){
+                        output << "BRDA:" << summary.begin->line << "," << record->column << "," << (unsigned int)side << ",";
+                        if (taken[0] || taken[1]) output << (unsigned int)taken[side] << "\n";
+                        else output << "-\n";
+                    }
+                }
+                record = next;
+            }
+            output << "DA:" << summary.begin->line << "," << summary.hits << "\n";
+            linesFound++;
+            linesHit += summary.hits != 0;
+            branchesFound += summary.branches;
+            branchesHit += summary.coveredBranches;
+        }
+        output << "LF:" << linesFound << "\nLH:" << linesHit << "\nBRF:" << branchesFound << "\nBRH:" << branchesHit
+            << "\nend_of_record\n";
+    }
+}
+
+double rate(unsigned int covered, unsigned int total){
+    return total ? (double)covered / total : 1.0;
+}
+
+void exportCobertura(const std::vector<LineSummary>& lines, Output& output){
+    unsigned int linesHit = 0, branches = 0, coveredBranches = 0;
+    for (const LineSummary& summary : lines){
+        linesHit += summary.hits != 0;
+        branches += summary.branches;
+        coveredBranches += summary.coveredBranches;
+    }
+    output << "<?xml version=\"1.0\" ?>\n"
+        << "<!DOCTYPE coverage SYSTEM \"http://cobertura.sourceforge.net/xml/coverage-04.dtd\">\n"
+        << "<coverage line-rate=\"" << rate(linesHit, lines.size()) << "\" branch-rate=\"" << rate(coveredBranches, branches)
+        << "\" lines-covered=\"" << linesHit << "\" lines-valid=\"" << (unsigned int)lines.size()
+        << "\" branches-covered=\"" << coveredBranches << "\" branches-valid=\"" << branches
+        << "\" complexity=\"0\" version=\"openclbc\" timestamp=\"" << (unsigned long long)time(NULL) << "\">\n"
+        << "<sources><source>.</source></sources>\n<packages>\n<package name=\"kernels\" line-rate=\""
+        << rate(linesHit, lines.size()) << "\" branch-rate=\"" << rate(coveredBranches, branches) << "\" complexity=\"0\">\n<classes>\n";
+    for (size_t i = 0; i < lines.size();){
+        Text file = lines[i].begin->file;
+        size_t fileEnd = i;
+        unsigned int fileLinesHit = 0, fileBranches = 0, fileCoveredBranches = 0;
+        for (; fileEnd < lines.size() && lines[fileEnd].begin->file == file; fileEnd++){
+            fileLinesHit += lines[fileEnd].hits != 0;
+            fileBranches += lines[fileEnd].branches;
+            fileCoveredBranches += lines[fileEnd].coveredBranches;
+        }
+        output << "<class name=\"";
+        output.escaped(file, true);
+        output << "\" filename=\"";
+        output.escaped(file, true);
+        output << "\" line-rate=\"" << rate(fileLinesHit, fileEnd - i) << "\" branch-rate=\"" << rate(fileCoveredBranches, fileBranches)
+            << "\" complexity=\"0\">\n<methods/>\n<lines>\n";
+        for (; i < fileEnd; i++){
+            const LineSummary& summary = lines[i];
+            output << "<line number=\"" << summary.begin->line << "\" hits=\"" << summary.hits;
+            if (summary.branches){
+                output << "\" branch=\"true\" condition-coverage=\"" << (unsigned int)(100 * summary.coveredBranches / summary.branches)
+                    << "% (" << summary.coveredBranches << "/" << summary.branches << ")\"/>\n";
+            } else {
+                output << "\" branch=\"false\"/>\n";
+            }
+        }
+        output << "</lines>\n</class>\n";
+    }
+    output << "</classes>\n</package>\n</packages>\n</coverage>\n";
+}
+
+void exportProbe(const Probe& probe, unsigned int id, Output& output){
+    output << "{\"id\": " << id << ", \"file\": \"";
+    output.escaped(probe.file, false);
+    output << "\", \"line\": " << probe.line << ", \"column\": " << probe.column;
+    if (probe.text.size){
+        output << ", \"text\": \"";
+        output.escaped(probe.text, false);
+        output << "\"";
+    }
+}
+
+// One object per kernel, probes in the order of their IDs
+void exportJson(const std::vector<Kernel>& kernels, Output& output){
+    output << "{\"kernels\": [";
+    for (size_t k = 0; k < kernels.size(); k++){
+        const Kernel& kernel = kernels[k];
+        char hash[24];
+        snprintf(hash, sizeof(hash), "%016llx", kernel.hash);
+        output << (k ? ",\n" : "\n") << "{\"kernel\": \"";
+        output.escaped({kernel.name.data(), kernel.name.size()}, false);
+        output << "\", \"hash\": \"" << hash << "\",\n\"conditions\": [";
+        for (unsigned int i = 0; i < kernel.conditions.size(); i++){
+            output << (i ? ",\n" : "\n");
+            exportProbe(kernel.conditions[i], i, output);
+            output << ", \"true\": " << kernel.value(recorder_layout::BRANCH, 2 * i)
+                << ", \"false\": " << kernel.value(recorder_layout::BRANCH, 2 * i + 1) << "}";
+        }
+        output << "],\n\"barriers\": [";
+        for (unsigned int i = 0; i < kernel.barriers.size(); i++){
+            output << (i ? ",\n" : "\n");
+            exportProbe(kernel.barriers[i], i, output);
+            output << ", \"divergent\": " << (kernel.value(recorder_layout::BARRIER, i) ? "true" : "false") << "}";
+        }
+        output << "],\n\"atomics\": [";
+        for (unsigned int i = 0; kernel.has(recorder_layout::ATOMIC) && i < kernel.atomics.size(); i++){
+            output << (i ? ",\n" : "\n");
+            exportProbe(kernel.atomics[i], i, output);
+            output << ", \"executions\": " << kernel.value(recorder_layout::ATOMIC, 2 * i)
+                << ", \"contended\": " << kernel.value(recorder_layout::ATOMIC, 2 * i + 1) << "}";
+        }
+        output << "],\n\"blocks\": [";
+        for (unsigned int i = 0; kernel.has(recorder_layout::BLOCK) && i < kernel.blocks.size(); i++){
+            output << (i ? ",\n" : "\n");
+            exportProbe(kernel.blocks[i], i, output);
+            output << ", \"executions\": " << kernel.value(recorder_layout::BLOCK, i) << "}";
+        }
+        output << "]}";
+    }
+    output << "\n]}\n";
+}
+
+int main(int argc, const char** argv){
+    std::string format = "lcov";
+    const char* outputFileName = NULL;
+    std::vector<const char*> inputFileNames;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc){
+            format = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+            outputFileName = argv[++i];
+        } else {
+            inputFileNames.push_back(argv[i]);
+        }
+    }
+    if (inputFileNames.empty() || inputFileNames.size() % 2 || (format != "lcov" && format != "cobertura" && format != "json")){
+        std::cerr << "Usage: " << argv[0] << " [-f lcov|cobertura|json] [-o output] kernel.cl.dat kernel.cl.ocbd...\n";
+        return 1;
+    }
+
+    std::vector<Kernel> kernels(inputFileNames.size() / 2);
+    for (size_t k = 0; k < kernels.size(); k++){
+        if (!loadKernel(inputFileNames[2 * k], inputFileNames[2 * k + 1], kernels[k])) return 1;
+    }
+
+    FILE* outputFile = outputFileName ? fopen(outputFileName, "wb") : stdout;
+    if (!outputFile){
+        std::cerr << "Cannot write " << outputFileName << "\n";
+        return 1;
+    }
+    bool written;
+    {
+        Output output(outputFile);
+        if (format == "json"){
+            exportJson(kernels, output);
+        } else {
+            std::vector<LineRecord> records = collectRecords(kernels);
+            std::vector<LineSummary> lines = summariseLines(records);
+            if (format == "lcov") exportLcov(lines, output);
+            else exportCobertura(lines, output);
+        }
+        written = output.flush();
+    }
+    if (outputFile != stdout) written = fclose(outputFile) == 0 && written;
+    if (!written){
+        std::cerr << "Cannot write " << (outputFileName ? outputFileName : "the output") << "\n";
+        return 1;
+    }
+    return 0;
+}
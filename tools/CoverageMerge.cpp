@@ -0,0 +1,232 @@
+// Merge binary coverage dumps written by instrumented programs into one dump.
+// Flags (branches, barriers, heatmap bitmaps) are ORed, counters and timers summed, the trace of the first
+// dump is kept. Dumps are memory-mapped and split between threads, each merging its share into a private
+// accumulator with loops over whole recorders, then the accumulators are combined.
+// Dumps of different kernels or instrumentation settings (different kernel hashes) are refused.
+//
+// Usage: openclbc-merge -o merged.ocbd [-j threads] dump.ocbd...
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../runtime/CoverageDump.h"
+
+struct DumpHeader{
+    unsigned long long kernelHash;
+    unsigned int wideKinds;
+    unsigned int numWords;
+};
+
+class MappedDump{
+public:
+    const unsigned int* words = NULL;
+    size_t size = 0;
+
+    ~MappedDump(){
+        if (words) munmap((void*)words, size);
+    }
+
+    bool map(const char* path, std::string& error){
+        int fd = open(path, O_RDONLY);
+        if (fd < 0){
+            error = std::string(path) + ": cannot open";
+            return false;
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size < (off_t)(dump_format::HEADER_WORDS * sizeof(unsigned int))){
+            close(fd);
+            error = std::string(path) + ": not an OpenCLBC dump";
+            return false;
+        }
+        size = status.st_size;
+        void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED){
+            error = std::string(path) + ": cannot map";
+            return false;
+        }
+        words = (const unsigned int*)mapping;
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        if (words[0] != dump_format::FILE_MAGIC || words[1] != dump_format::VERSION
+            || size != (dump_format::HEADER_WORDS + (size_t)words[5]) * sizeof(unsigned int)
+            || words[5] < recorder_layout::HEADER_WORDS || buffer()[0] != recorder_layout::MAGIC){
+            error = std::string(path) + ": not an OpenCLBC dump or truncated";
+            return false;
+        }
+        return true;
+    }
+
+    DumpHeader header() const{
+        DumpHeader result;
+        result.kernelHash = words[2] | ((unsigned long long)words[3] << 32);
+        result.wideKinds = words[4];
+        result.numWords = words[5];
+        return result;
+    }
+
+    const unsigned int* buffer() const{
+        return words + dump_format::HEADER_WORDS;
+    }
+};
+
+void mergeDump(const std::vector<openclbc::DumpSpan>& spans, const unsigned int* source, unsigned long long* accumulator, bool first){
+    for (const openclbc::DumpSpan& span : spans){
+        const unsigned int* src = source + span.begin;
+        unsigned long long* acc = accumulator + span.begin;
+        size_t length = span.end - span.begin;
+        switch (span.op){
+            case openclbc::KEEP_FIRST:
+                if (first){
+                    for (size_t i = 0; i < length; i++) acc[i] = src[i];
+                }
+                break;
+            case openclbc::MERGE_OR:
+                for (size_t i = 0; i < length; i++) acc[i] |= src[i];
+                break;
+            case openclbc::MERGE_MAX:
+                for (size_t i = 0; i < length; i++) acc[i] = std::max(acc[i], (unsigned long long)src[i]);
+                break;
+            case openclbc::MERGE_SUM32:
+                for (size_t i = 0; i < length; i++) acc[i] += src[i];
+                break;
+            case openclbc::MERGE_SUM64:
+                for (size_t i = 0; i + 1 < length; i += 2) acc[i] += src[i] | ((unsigned long long)src[i + 1] << 32);
+                break;
+        }
+    }
+}
+
+// Same as mergeDump, for two accumulators
+void combine(const std::vector<openclbc::DumpSpan>& spans, const unsigned long long* partial, unsigned long long* accumulator){
+    for (const openclbc::DumpSpan& span : spans){
+        for (size_t i = span.begin; i < span.end; i++){
+            switch (span.op){
+                case openclbc::KEEP_FIRST: break;
+                case openclbc::MERGE_OR: accumulator[i] |= partial[i]; break;
+                case openclbc::MERGE_MAX: accumulator[i] = std::max(accumulator[i], partial[i]); break;
+                case openclbc::MERGE_SUM32:
+                case openclbc::MERGE_SUM64: accumulator[i] += partial[i]; break;
+            }
+        }
+    }
+}
+
+int main(int argc, const char** argv){
+    std::string outputFileName;
+    unsigned int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<const char*> inputFileNames;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+            outputFileName = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc){
+            numThreads = std::max(1, atoi(argv[++i]));
+        } else {
+            inputFileNames.push_back(argv[i]);
+        }
+    }
+    if (outputFileName.empty() || inputFileNames.empty()){
+        std::cerr << "Usage: " << argv[0] << " -o merged.ocbd [-j threads] dump.ocbd...\n";
+        return 1;
+    }
+
+    // The first dump gives the kernel every other dump must match
+    DumpHeader reference;
+    std::vector<openclbc::DumpSpan> spans;
+    {
+        MappedDump first;
+        std::string error;
+        if (!first.map(inputFileNames[0], error)){
+            std::cerr << error << "\n";
+            return 1;
+        }
+        reference = first.header();
+        spans = openclbc::planDumpMerge(first.buffer(), reference.wideKinds);
+    }
+
+    numThreads = std::min<size_t>(numThreads, inputFileNames.size());
+    std::vector<std::vector<unsigned long long> > partials(numThreads, std::vector<unsigned long long>(reference.numWords, 0));
+    std::vector<std::string> errors(numThreads);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < numThreads; t++){
+        threads.push_back(std::thread([&, t](){
+            size_t begin = inputFileNames.size() * t / numThreads;
+            size_t end = inputFileNames.size() * (t + 1) / numThreads;
+            for (size_t f = begin; f < end; f++){
+                MappedDump dump;
+                if (!dump.map(inputFileNames[f], errors[t])) return;
+                DumpHeader header = dump.header();
+                if (header.kernelHash != reference.kernelHash || header.wideKinds != reference.wideKinds
+                    || header.numWords != reference.numWords){
+                    char message[256];
+                    snprintf(message, sizeof(message), ": kernel hash %016llx does not match %016llx of ",
+                        header.kernelHash, reference.kernelHash);
+                    errors[t] = inputFileNames[f] + std::string(message) + inputFileNames[0];
+                    return;
+                }
+                mergeDump(spans, dump.buffer(), partials[t].data(), f == begin);
+            }
+        }));
+    }
+    for (auto& thread : threads){
+        thread.join();
+    }
+    for (auto& error : errors){
+        if (!error.empty()){
+            std::cerr << error << "\n";
+            return 1;
+        }
+    }
+    // Thread 0 has the first dumps, so its trace is kept
+    std::vector<unsigned long long>& merged = partials[0];
+    for (unsigned int t = 1; t < numThreads; t++){
+        combine(spans, partials[t].data(), merged.data());
+    }
+
+    std::vector<unsigned int> output(dump_format::HEADER_WORDS + reference.numWords, 0);
+    output[0] = dump_format::FILE_MAGIC;
+    output[1] = dump_format::VERSION;
+    output[2] = (unsigned int)reference.kernelHash;
+    output[3] = (unsigned int)(reference.kernelHash >> 32);
+    output[4] = reference.wideKinds;
+    output[5] = reference.numWords;
+    unsigned int* buffer = output.data() + dump_format::HEADER_WORDS;
+    for (const openclbc::DumpSpan& span : spans){
+        for (size_t i = span.begin; i < span.end; i++){
+            if (span.op == openclbc::MERGE_SUM64){
+                buffer[i] = (unsigned int)merged[i];
+                buffer[i + 1] = (unsigned int)(merged[i] >> 32);
+                i++;
+            } else {
+                buffer[i] = merged[i] > 0xffffffffull ? 0xffffffffu : (unsigned int)merged[i];
+            }
+        }
+    }
+    FILE* outputFile = fopen(outputFileName.c_str(), "wb");
+    if (!outputFile || fwrite(output.data(), sizeof(unsigned int), output.size(), outputFile) != output.size()){
+        std::cerr << "Cannot write " << outputFileName << "\n";
+        if (outputFile) fclose(outputFile);
+        return 1;
+    }
+    fclose(outputFile);
+
+    unsigned int numBranches = buffer[3 + 2 * recorder_layout::BRANCH];
+    unsigned int coveredBranches = 0;
+    for (unsigned int i = 0; i < numBranches; i++){
+        if (buffer[buffer[2 + 2 * recorder_layout::BRANCH] + i]) coveredBranches++;
+    }
+    printf("Merged %lu dumps into %s\n", (unsigned long)inputFileNames.size(), outputFileName.c_str());
+    if (numBranches){
+        printf("Total branch coverage: %-4.2f (%u of %u branches)\n", 100.0 * coveredBranches / numBranches, coveredBranches, numBranches);
+    }
+    return 0;
+}
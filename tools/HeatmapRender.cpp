@@ -0,0 +1,113 @@
+// Render a .heatmap file written by the generated host code.
+// For every condition, each work-group (or bin of work-groups) is classified as
+//   not reached, true branch only, false branch only, or divergent (both branches taken).
+// The result is written as a CSV table and as one PPM image per condition, where work-groups are laid out
+// as in the NDRange: x along dimension 0, y along dimensions 1 and 2.
+//
+// Usage: openclbc-heatmap kernel.cl.heatmap [output prefix]
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/Constants.h"
+
+bool testBit(const unsigned int* bitmap, unsigned int bit){
+    return (bitmap[bit / 32] >> (bit % 32)) & 1u;
+}
+
+int main(int argc, const char** argv){
+    if (argc < 2 || argc > 3){
+        std::cerr << "Usage: " << argv[0] << " kernel.cl.heatmap [output prefix]\n";
+        return 1;
+    }
+    std::string inputFileName(argv[1]);
+    std::string outputPrefix = argc == 3 ? std::string(argv[2]) : inputFileName.substr(0, inputFileName.find_last_of('.'));
+
+    FILE* heatmapFile = fopen(argv[1], "rb");
+    if (!heatmapFile){
+        std::cerr << "Cannot open " << argv[1] << "\n";
+        return 1;
+    }
+    unsigned int fileHeader[2];
+    unsigned int header[heatmap_format::HEADER_WORDS];
+    if (fread(fileHeader, sizeof(unsigned int), 2, heatmapFile) != 2 || fileHeader[0] != heatmap_format::FILE_MAGIC
+        || fread(header, sizeof(unsigned int), heatmap_format::HEADER_WORDS, heatmapFile) != heatmap_format::HEADER_WORDS){
+        std::cerr << argv[1] << " is not an OpenCLBC heatmap file\n";
+        fclose(heatmapFile);
+        return 1;
+    }
+    unsigned int numConditions = fileHeader[1];
+    unsigned int groupsX = std::max(1u, header[0]), groupsY = std::max(1u, header[1]), groupsZ = std::max(1u, header[2]);
+    unsigned int numBins = header[3];
+    if (numBins == 0){
+        std::cerr << "No work-group finished the kernel, nothing to render\n";
+        fclose(heatmapFile);
+        return 1;
+    }
+    unsigned int wordsPerBitmap = (numBins + 31) / 32;
+    std::vector<unsigned int> bitmaps((size_t)numConditions * 2 * wordsPerBitmap);
+    if (fread(bitmaps.data(), sizeof(unsigned int), bitmaps.size(), heatmapFile) != bitmaps.size()){
+        std::cerr << argv[1] << " is truncated\n";
+        fclose(heatmapFile);
+        return 1;
+    }
+    fclose(heatmapFile);
+
+    // One bin per work-group when they fit, otherwise consecutive work-groups share a bin and
+    // rows of bins stand for rows of work-groups
+    unsigned long long numGroups = (unsigned long long)groupsX * groupsY * groupsZ;
+    bool binned = numGroups > numBins;
+    unsigned int usedBins = binned ? numBins : (unsigned int)numGroups;
+    unsigned int width = binned ? std::max(1u, (unsigned int)(groupsX * (unsigned long long)numBins / numGroups)) : groupsX;
+    unsigned int height = (usedBins + width - 1) / width;
+    if (binned){
+        std::cout << numGroups << " work-groups were binned into " << numBins << " bins, increase heatmap_bins for full resolution\n";
+    }
+
+    // Colours of not reached, true only, false only and divergent bins
+    const unsigned char colours[4][3] = {{40, 40, 40}, {60, 180, 75}, {0, 130, 200}, {230, 25, 75}};
+
+    FILE* csvFile = fopen((outputPrefix + ".csv").c_str(), "w");
+    if (!csvFile){
+        std::cerr << "Cannot write " << outputPrefix << ".csv\n";
+        return 1;
+    }
+    fprintf(csvFile, "condition,bin,group_x,group_y,group_z,true_taken,false_taken\n");
+
+    for (unsigned int condition = 0; condition < numConditions; condition++){
+        const unsigned int* trueBitmap = &bitmaps[(size_t)(2 * condition) * wordsPerBitmap];
+        const unsigned int* falseBitmap = &bitmaps[(size_t)(2 * condition + 1) * wordsPerBitmap];
+        std::vector<unsigned char> image((size_t)width * height * 3, 255);
+        unsigned int reached = 0, divergent = 0;
+
+        for (unsigned int bin = 0; bin < usedBins; bin++){
+            bool takenTrue = testBit(trueBitmap, bin);
+            bool takenFalse = testBit(falseBitmap, bin);
+            int kind = (takenTrue ? 1 : 0) + (takenFalse ? 2 : 0);
+            std::copy(colours[kind], colours[kind] + 3, &image[(size_t)bin * 3]);
+            if (kind) reached++;
+            if (kind == 3) divergent++;
+            if (kind){
+                // Position of the first work-group of the bin
+                unsigned long long group = binned ? (unsigned long long)bin * numGroups / numBins : bin;
+                fprintf(csvFile, "%u,%u,%llu,%llu,%llu,%d,%d\n", condition, bin,
+                    group % groupsX, group / groupsX % groupsY, group / groupsX / groupsY, takenTrue ? 1 : 0, takenFalse ? 1 : 0);
+            }
+        }
+
+        std::string imageFileName = outputPrefix + "_condition_" + std::to_string(condition) + ".ppm";
+        FILE* imageFile = fopen(imageFileName.c_str(), "wb");
+        if (imageFile){
+            fprintf(imageFile, "P6\n%u %u\n255\n", width, height);
+            fwrite(image.data(), 1, image.size(), imageFile);
+            fclose(imageFile);
+        }
+        printf("Condition %u: reached by %u of %u %s, divergent in %u (%.2f%%)\n", condition, reached, usedBins,
+            binned ? "bins" : "work-groups", divergent, reached ? 100.0 * divergent / reached : 0.0);
+    }
+    fclose(csvFile);
+    return 0;
+}
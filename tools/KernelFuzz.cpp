@@ -0,0 +1,194 @@
+// Coverage-guided fuzzer for kernels instrumented by openclbc, meant for a CPU device such as PoCL.
+// Inputs (buffer contents and scalar arguments, see KernelHarness.h for the schema) are mutated and run;
+// the branch and barrier recorders of each run are packed into a bitmap of features (branch sides taken,
+// barriers found divergent) and inputs reaching a feature no earlier input reached are kept in the corpus.
+// Branch sides left without probe because a previous run covered them (prior_coverage) start as covered.
+//
+// Usage: openclbc-fuzz schema.txt [-corpus dir] [-runs n] [-time seconds] [-seed n]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+
+#include "KernelHarness.h"
+
+// Flags of a run as bits, from bit offset on
+void packFeatures(const cl_uint* flags, size_t numFlags, std::vector<uint64_t>& bitmap, size_t offset){
+    for (size_t i = 0; i < numFlags; i++){
+        bitmap[(offset + i) >> 6] |= (uint64_t)(flags[i] != 0) << ((offset + i) & 63);
+    }
+}
+
+// Whole words at a time, which compilers vectorise
+bool hasNewFeatures(const std::vector<uint64_t>& features, const std::vector<uint64_t>& covered){
+    uint64_t fresh = 0;
+    for (size_t i = 0; i < features.size(); i++){
+        fresh |= features[i] & ~covered[i];
+    }
+    return fresh != 0;
+}
+
+size_t countFeatures(const std::vector<uint64_t>& bitmap, size_t begin, size_t end){
+    size_t count = 0;
+    for (size_t i = begin; i < end; i++){
+        count += (bitmap[i >> 6] >> (i & 63)) & 1;
+    }
+    return count;
+}
+
+bool saveInput(const std::string& corpusDirectory, const std::string& name, const std::vector<unsigned char>& input){
+    if (corpusDirectory.empty()) return true;
+    std::ofstream inputFile(corpusDirectory + "/" + name, std::ios::binary);
+    inputFile.write((const char*)input.data(), input.size());
+    return (bool)inputFile;
+}
+
+// Inputs of the right size already in the corpus directory
+void loadCorpus(const std::string& corpusDirectory, size_t inputSize, std::vector<std::vector<unsigned char> >& corpus){
+    DIR* directory = opendir(corpusDirectory.c_str());
+    if (!directory) return;
+    while (struct dirent* entry = readdir(directory)){
+        if (entry->d_name[0] == '.') continue;
+        std::ifstream inputFile(corpusDirectory + "/" + entry->d_name, std::ios::binary);
+        std::vector<unsigned char> input((std::istreambuf_iterator<char>(inputFile)), std::istreambuf_iterator<char>());
+        if (input.size() == inputSize) corpus.push_back(input);
+    }
+    closedir(directory);
+}
+
+int main(int argc, const char** argv){
+    std::string schemaFileName, corpusDirectory;
+    unsigned long long maxRuns = 0;
+    double maxSeconds = 0;
+    unsigned int seed = std::random_device()();
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-corpus") == 0 && i + 1 < argc){
+            corpusDirectory = argv[++i];
+        } else if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc){
+            maxRuns = std::stoull(argv[++i]);
+        } else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc){
+            maxSeconds = std::stod(argv[++i]);
+        } else if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc){
+            seed = std::stoul(argv[++i]);
+        } else {
+            schemaFileName = argv[i];
+        }
+    }
+    if (schemaFileName.empty()){
+        std::cerr << "Usage: " << argv[0] << " schema.txt [-corpus dir] [-runs n] [-time seconds] [-seed n]\n";
+        return 1;
+    }
+
+    KernelSchema schema;
+    KernelHarness harness;
+    std::string error;
+    if (!schema.load(schemaFileName, error) || !harness.initialise(schema, NULL, error)){
+        std::cerr << error << "\n";
+        return 1;
+    }
+    size_t numBranches = harness.getNumBranches();
+    size_t numFeatures = numBranches + harness.getNumBarriers();
+    if (numFeatures == 0){
+        std::cerr << schema.sourceFile << " has no branch or barrier recorder to guide fuzzing\n";
+        return 1;
+    }
+
+    std::mt19937 random(seed);
+    std::vector<std::vector<unsigned char> > corpus;
+    loadCorpus(corpusDirectory, schema.inputSize, corpus);
+    size_t numSeeds = corpus.size();
+    if (corpus.empty()){
+        corpus.push_back(harness.randomInput(random));
+    }
+
+    std::vector<uint64_t> covered((numFeatures + 63) / 64, 0);
+    std::vector<uint64_t> features(covered.size());
+    // Branch sides covered in the run the kernel was rewritten after (prior_coverage) have no probe to set
+    const std::vector<bool>& coveredBefore = harness.getProbes().coveredBefore;
+    for (size_t i = 0; i < numBranches && i < coveredBefore.size(); i++){
+        covered[i >> 6] |= (uint64_t)coveredBefore[i] << (i & 63);
+    }
+    auto runInput = [&](const std::vector<unsigned char>& input) -> bool{
+        if (!harness.run(input, error)) return false;
+        std::fill(features.begin(), features.end(), 0);
+        packFeatures(harness.getBranches(), numBranches, features, 0);
+        packFeatures(harness.getBarriers(), harness.getNumBarriers(), features, numBranches);
+        return true;
+    };
+    auto report = [&](const char* event, unsigned long long runs, double seconds){
+        printf("#%llu %s: %lu/%lu branch sides, %lu divergent barriers, corpus %lu, %.0f runs/s\n", runs, event,
+            (unsigned long)countFeatures(covered, 0, numBranches), (unsigned long)numBranches,
+            (unsigned long)countFeatures(covered, numBranches, numFeatures), (unsigned long)corpus.size(),
+            seconds > 0 ? runs / seconds : 0.0);
+        fflush(stdout);
+    };
+
+    // Seeds set the initial coverage
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& input : corpus){
+        if (!runInput(input)){
+            std::cerr << error << "\n";
+            return 1;
+        }
+        for (size_t w = 0; w < covered.size(); w++) covered[w] |= features[w];
+    }
+    if (numSeeds == 0) saveInput(corpusDirectory, "input-0", corpus[0]);
+    unsigned long long runs = corpus.size();
+    report("start", runs, 0);
+
+    double nextReport = 1.0;
+    std::vector<unsigned char> input;
+    while (!maxRuns || runs < maxRuns){
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (maxSeconds && seconds >= maxSeconds) break;
+        if (seconds >= nextReport){
+            report("pulse", runs, seconds);
+            nextReport = seconds * 2;
+        }
+
+        input = corpus[random() % corpus.size()];
+        const std::vector<unsigned char>& other = corpus[random() % corpus.size()];
+        for (unsigned int m = 1u << (random() % 4); m; m--){
+            harness.mutate(input, other, random);
+        }
+        runs++;
+        if (!runInput(input)){
+            // Kept next to the corpus, a failing launch is worth a look too
+            std::cerr << "#" << runs << " " << error << "\n";
+            saveInput(corpusDirectory, "failure-" + std::to_string(runs), input);
+            continue;
+        }
+        if (!hasNewFeatures(features, covered)) continue;
+
+        for (size_t i = numBranches; i < numFeatures; i++){
+            if (((features[i >> 6] & ~covered[i >> 6]) >> (i & 63)) & 1){
+                size_t barrier = i - numBranches;
+                printf("Barrier %lu is divergent: %s\n", (unsigned long)barrier, barrier < harness.getProbes().barrierLines.size()
+                    ? harness.getProbes().barrierLines[barrier].c_str() : "");
+            }
+        }
+        for (size_t w = 0; w < covered.size(); w++) covered[w] |= features[w];
+        corpus.push_back(input);
+        saveInput(corpusDirectory, "input-" + std::to_string(corpus.size() - 1), input);
+        report("new", runs, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    report("done", runs, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    const std::vector<std::string>& conditionLines = harness.getProbes().conditionLines;
+    for (size_t i = 0; i < numBranches; i++){
+        if (!((covered[i >> 6] >> (i & 63)) & 1)){
+            printf("Not covered: %s branch of condition %lu at %s\n", i % 2 ? "false" : "true", (unsigned long)(i / 2),
+                i / 2 < conditionLines.size() ? conditionLines[i / 2].c_str() : "?");
+        }
+    }
+    return 0;
+}
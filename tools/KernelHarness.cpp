@@ -0,0 +1,509 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#include "KernelHarness.h"
+
+namespace {
+
+const ScalarType scalarTypes[] = {
+    {"char", 1, false, true}, {"uchar", 1, false, false}, {"short", 2, false, true}, {"ushort", 2, false, false},
+    {"int", 4, false, true}, {"uint", 4, false, false}, {"long", 8, false, true}, {"ulong", 8, false, false},
+    {"float", 4, true, true}, {"double", 8, true, true}};
+
+const ScalarType* findScalarType(const std::string& name){
+    for (const ScalarType& type : scalarTypes){
+        if (name == type.name) return &type;
+    }
+    return NULL;
+}
+
+// "key: value" as in openclbc configuration files
+bool splitLine(const std::string& line, std::string& key, std::string& value){
+    size_t colon = line.find(':');
+    if (colon == std::string::npos || line.compare(0, 1, "#") == 0) return false;
+    key = line.substr(0, colon);
+    key.erase(0, key.find_first_not_of(" \t"));
+    key.erase(key.find_last_not_of(" \t") + 1);
+    value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    return true;
+}
+
+// Written by openclbc-ir next to its .dat file, named after the kernel source
+bool isBitcode(const std::string& fileName){
+    return fileName.size() > 3 && fileName.compare(fileName.size() - 3, 3, ".bc") == 0;
+}
+
+// type[n] for buffers, type for scalars
+bool parseArgument(const std::string& value, ArgumentSpec& argument){
+    std::istringstream fields(value);
+    std::string field;
+    fields >> field;
+    argument.kind = ArgumentSpec::SCALAR;
+    argument.numElements = 1;
+    argument.type = NULL;
+    if (field == "local"){
+        argument.kind = ArgumentSpec::LOCAL_MEMORY;
+        return (bool)(fields >> argument.numElements);
+    }
+    if (field == "out"){
+        argument.kind = ArgumentSpec::OUTPUT_BUFFER;
+        fields >> field;
+    }
+    size_t bracket = field.find('[');
+    if (bracket != std::string::npos){
+        if (argument.kind == ArgumentSpec::SCALAR) argument.kind = ArgumentSpec::INPUT_BUFFER;
+        argument.numElements = std::stoul(field.substr(bracket + 1));
+        field = field.substr(0, bracket);
+    } else if (argument.kind == ArgumentSpec::OUTPUT_BUFFER){
+        return false;
+    }
+    argument.type = findScalarType(field);
+    argument.hasRange = (bool)(fields >> argument.minValue >> argument.maxValue);
+    return argument.type != NULL && argument.numElements != 0;
+}
+
+}
+
+bool KernelSchema::load(const std::string& schemaFileName, std::string& error){
+    std::ifstream schemaFile(schemaFileName);
+    if (!schemaFile){
+        error = "cannot open " + schemaFileName;
+        return false;
+    }
+    std::string line, key, value;
+    int lineNumber = 0;
+    while (std::getline(schemaFile, line)){
+        lineNumber++;
+        if (!splitLine(line, key, value)) continue;
+        if (key == "kernel"){
+            kernelName = value;
+        } else if (key == "source"){
+            sourceFile = value;
+        } else if (key == "build_options"){
+            buildOptions = value;
+        } else if (key == "global" || key == "local"){
+            std::istringstream sizes(value);
+            size_t* target = key == "global" ? globalSize : localSize;
+            cl_uint dims = 0;
+            while (dims < 3 && sizes >> target[dims]) dims++;
+            if (key == "global") workDim = dims;
+        } else if (key == "arg"){
+            ArgumentSpec argument;
+            if (!parseArgument(value, argument)){
+                error = schemaFileName + ":" + std::to_string(lineNumber) + ": cannot parse argument \"" + value + "\"";
+                return false;
+            }
+            argument.inputOffset = inputSize;
+            argument.inputSize = (argument.kind == ArgumentSpec::INPUT_BUFFER || argument.kind == ArgumentSpec::SCALAR)
+                ? argument.numElements * argument.type->size : 0;
+            inputSize += argument.inputSize;
+            arguments.push_back(argument);
+        }
+    }
+    if (kernelName.empty() || sourceFile.empty() || workDim == 0){
+        error = schemaFileName + " needs kernel, source and global";
+        return false;
+    }
+    return true;
+}
+
+bool KernelProbes::load(const std::string& dataFileName, std::string& error){
+    std::ifstream dataFile(dataFileName);
+    if (!dataFile){
+        error = "cannot open " + dataFileName;
+        return false;
+    }
+    std::vector<std::string>* lines = NULL;
+    bool inBlock = false;
+    bool hasEdges = false;
+    bool hasLayout = false;
+    int condition = -1;
+    std::string line;
+    while (std::getline(dataFile, line)){
+        if (line.compare(0, 13, "Kernel hash: ") == 0){
+            kernelHash = std::stoull(line.substr(13), NULL, 16);
+        } else if (line.compare(0, 8, "Layout: ") == 0){
+            std::istringstream words(line.substr(8));
+            unsigned int n = 0;
+            while (n < recorder_layout::HEADER_WORDS && words >> layoutHeader[n]) n++;
+            hasLayout = n == recorder_layout::HEADER_WORDS && layoutHeader[0] == recorder_layout::MAGIC;
+        } else if (line.compare(0, 12, "Wide kinds: ") == 0){
+            wideKinds = std::stoul(line.substr(12));
+        } else if (line.compare(0, 14, "Condition ID: ") == 0){
+            lines = &conditionLines;
+            condition = std::stoi(line.substr(14));
+        } else if (line.compare(0, 16, "Covered before: ") == 0 && condition >= 0){
+            std::string sides = line.substr(16);
+            if (coveredBefore.size() < 2 * (size_t)(condition + 1)) coveredBefore.resize(2 * (condition + 1), false);
+            coveredBefore[2 * condition] = sides != "false";
+            coveredBefore[2 * condition + 1] = sides != "true";
+        } else if (line.compare(0, 12, "Barrier ID: ") == 0){
+            lines = &barrierLines;
+        } else if (line.compare(0, 18, "Source code line: ") == 0 && lines){
+            lines->push_back(line.substr(18));
+            lines = NULL;
+        } else if (line.compare(0, 10, "Block ID: ") == 0){
+            openclbc::ProfileEdge edge = {-1, -1, -1, true};
+            profileEdges.push_back(edge);
+            inBlock = true;
+            lines = NULL;
+            condition = -1;
+        } else if (line.find(" ID: ") != std::string::npos){
+            inBlock = false;
+            lines = NULL;
+            condition = -1;
+        } else if (inBlock && line.compare(0, 6, "Edge: ") == 0){
+            sscanf(line.c_str(), "Edge: %d %d", &profileEdges.back().from, &profileEdges.back().to);
+            hasEdges = true;
+        } else if (inBlock && line.compare(0, 8, "Branch: ") == 0){
+            profileEdges.back().branch = std::stoi(line.substr(8));
+            hasEdges = true;
+        } else if (inBlock && line == "Probe: derived"){
+            profileEdges.back().counted = false;
+        }
+    }
+    if (!hasEdges) profileEdges.clear();
+    coveredBefore.resize(2 * conditionLines.size(), false);
+    if (!hasLayout){
+        error = dataFileName + " has no instrumentation buffer layout, rewrite the kernel with this version of openclbc";
+        return false;
+    }
+    return true;
+}
+
+KernelHarness::KernelHarness() : schema(NULL), device(NULL), context(NULL), queue(NULL), program(NULL), kernel(NULL),
+    instrumentation(NULL), recorderOffset(0), barrierOffset(0), numBranches(0), numBarriers(0) {}
+
+KernelHarness::~KernelHarness(){
+    release();
+}
+
+void KernelHarness::release(){
+    for (cl_mem buffer : buffers){
+        if (buffer) clReleaseMemObject(buffer);
+    }
+    buffers.clear();
+    if (instrumentation) clReleaseMemObject(instrumentation);
+    if (kernel) clReleaseKernel(kernel);
+    if (program) clReleaseProgram(program);
+    if (queue) clReleaseCommandQueue(queue);
+    if (context) clReleaseContext(context);
+    instrumentation = NULL;
+    kernel = NULL;
+    program = NULL;
+    queue = NULL;
+    context = NULL;
+}
+
+cl_device_id findDevice(){
+    cl_uint numPlatforms = 0;
+    clGetPlatformIDs(0, NULL, &numPlatforms);
+    std::vector<cl_platform_id> platforms(numPlatforms);
+    if (numPlatforms) clGetPlatformIDs(numPlatforms, platforms.data(), NULL);
+    cl_device_id device = NULL;
+    for (cl_device_type type : {(cl_device_type)CL_DEVICE_TYPE_CPU, (cl_device_type)CL_DEVICE_TYPE_ALL}){
+        for (cl_platform_id platform : platforms){
+            if (!device && clGetDeviceIDs(platform, type, 1, &device, NULL) != CL_SUCCESS) device = NULL;
+        }
+    }
+    return device;
+}
+
+cl_program buildKernelProgram(const KernelSchema& schema, cl_context context, const std::vector<cl_device_id>& devices,
+    std::string& error){
+    std::ifstream sourceFile(schema.sourceFile, std::ios::binary);
+    if (!sourceFile){
+        error = "cannot open " + schema.sourceFile;
+        return NULL;
+    }
+    std::stringstream source;
+    source << sourceFile.rdbuf();
+    std::string sourceText = source.str();
+    const char* sourceData = sourceText.c_str();
+    cl_int err;
+    cl_program program;
+    if (isBitcode(schema.sourceFile)){
+        // The same bitcode for every device
+        std::vector<size_t> lengths(devices.size(), sourceText.size());
+        std::vector<const unsigned char*> binaries(devices.size(), (const unsigned char*)sourceData);
+        program = clCreateProgramWithBinary(context, devices.size(), devices.data(), lengths.data(), binaries.data(), NULL, &err);
+    } else {
+        program = clCreateProgramWithSource(context, 1, &sourceData, NULL, &err);
+    }
+    if (err != CL_SUCCESS){
+        error = "cannot create a program, error " + std::to_string(err);
+        return NULL;
+    }
+    err = clBuildProgram(program, devices.size(), devices.data(), schema.buildOptions.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS){
+        size_t logSize = 0;
+        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+        std::string log(logSize, '\0');
+        clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
+        error = "cannot build " + schema.sourceFile + ", error " + std::to_string(err) + "\n" + log;
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+bool KernelHarness::initialise(const KernelSchema& newSchema, cl_device_id newDevice, std::string& error){
+    if (!newDevice) newDevice = findDevice();
+    if (!newDevice){
+        error = "no OpenCL device found";
+        return false;
+    }
+    cl_int err;
+    cl_context newContext = clCreateContext(NULL, 1, &newDevice, NULL, NULL, &err);
+    if (err != CL_SUCCESS){
+        error = "cannot create a context, error " + std::to_string(err);
+        return false;
+    }
+    cl_program newProgram = buildKernelProgram(newSchema, newContext, std::vector<cl_device_id>(1, newDevice), error);
+    bool initialised = newProgram && initialise(newSchema, newContext, newProgram, newDevice, error);
+    if (newProgram) clReleaseProgram(newProgram);
+    clReleaseContext(newContext);
+    return initialised;
+}
+
+bool KernelHarness::initialise(const KernelSchema& newSchema, cl_context sharedContext, cl_program sharedProgram,
+    cl_device_id newDevice, std::string& error){
+    release();
+    schema = &newSchema;
+    probes = KernelProbes();
+    std::string dataFileName = schema->sourceFile;
+    if (isBitcode(dataFileName)) dataFileName.resize(dataFileName.size() - 3);
+    if (!probes.load(dataFileName + ".dat", error)) return false;
+    const unsigned int* header = probes.layoutHeader;
+    numBranches = header[3 + 2 * recorder_layout::BRANCH];
+    numBarriers = header[3 + 2 * recorder_layout::BARRIER];
+    // The branch recorder is followed by the barrier recorder, so one read gets both
+    recorderOffset = numBranches ? header[2 + 2 * recorder_layout::BRANCH] : header[2 + 2 * recorder_layout::BARRIER];
+    barrierOffset = numBarriers ? header[2 + 2 * recorder_layout::BARRIER] : recorderOffset + numBranches;
+    recorders.assign(barrierOffset - recorderOffset + numBarriers, 0);
+
+    device = newDevice;
+    context = sharedContext;
+    program = sharedProgram;
+    clRetainContext(context);
+    clRetainProgram(program);
+    cl_int err;
+    queue = clCreateCommandQueue(context, device, 0, &err);
+    if (err != CL_SUCCESS){
+        error = "cannot create a command queue, error " + std::to_string(err);
+        return false;
+    }
+    kernel = clCreateKernel(program, schema->kernelName.c_str(), &err);
+    if (err != CL_SUCCESS){
+        error = "cannot create kernel " + schema->kernelName + ", error " + std::to_string(err);
+        return false;
+    }
+
+    buffers.assign(schema->arguments.size(), NULL);
+    for (size_t i = 0; i < schema->arguments.size() && err == CL_SUCCESS; i++){
+        const ArgumentSpec& argument = schema->arguments[i];
+        if (argument.kind == ArgumentSpec::INPUT_BUFFER || argument.kind == ArgumentSpec::OUTPUT_BUFFER){
+            buffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, argument.numElements * argument.type->size, NULL, &err);
+            if (err == CL_SUCCESS) err = clSetKernelArg(kernel, i, sizeof(cl_mem), &buffers[i]);
+        } else if (argument.kind == ArgumentSpec::LOCAL_MEMORY){
+            err = clSetKernelArg(kernel, i, argument.numElements, NULL);
+        }
+    }
+    // The instrumentation buffer is the last kernel argument
+    if (err == CL_SUCCESS){
+        instrumentation = clCreateBuffer(context, CL_MEM_READ_WRITE, header[1] * sizeof(cl_uint), NULL, &err);
+    }
+    if (err == CL_SUCCESS){
+        err = clEnqueueWriteBuffer(queue, instrumentation, CL_TRUE, 0, recorder_layout::HEADER_WORDS * sizeof(cl_uint),
+            header, 0, NULL, NULL);
+    }
+    if (err == CL_SUCCESS){
+        cl_uint index = (cl_uint)schema->arguments.size();
+        err = clSetKernelArg(kernel, index, sizeof(cl_mem), &instrumentation);
+    }
+    if (err != CL_SUCCESS){
+        error = "cannot set up the kernel arguments, error " + std::to_string(err) + ", check the schema against the kernel";
+        return false;
+    }
+    lastInput.clear();
+    return true;
+}
+
+bool KernelHarness::run(const std::vector<unsigned char>& input, std::string& error){
+    cl_int err = CL_SUCCESS;
+    bool firstRun = lastInput.size() != input.size();
+    for (size_t i = 0; i < schema->arguments.size() && err == CL_SUCCESS; i++){
+        const ArgumentSpec& argument = schema->arguments[i];
+        const unsigned char* value = input.data() + argument.inputOffset;
+        if (argument.kind == ArgumentSpec::OUTPUT_BUFFER){
+            cl_uchar zero = 0;
+            err = clEnqueueFillBuffer(queue, buffers[i], &zero, 1, 0, argument.numElements * argument.type->size, 0, NULL, NULL);
+        } else if (argument.inputSize && (firstRun || memcmp(value, lastInput.data() + argument.inputOffset, argument.inputSize) != 0)){
+            if (argument.kind == ArgumentSpec::SCALAR){
+                err = clSetKernelArg(kernel, i, argument.inputSize, value);
+            } else {
+                // run waits for the queue before returning, so the input can be changed afterwards
+                err = clEnqueueWriteBuffer(queue, buffers[i], CL_FALSE, 0, argument.inputSize, value, 0, NULL, NULL);
+            }
+        }
+    }
+    size_t headerBytes = recorder_layout::HEADER_WORDS * sizeof(cl_uint);
+    if (err == CL_SUCCESS && probes.layoutHeader[1] > recorder_layout::HEADER_WORDS){
+        cl_uint zero = 0;
+        err = clEnqueueFillBuffer(queue, instrumentation, &zero, sizeof(cl_uint), headerBytes,
+            probes.layoutHeader[1] * sizeof(cl_uint) - headerBytes, 0, NULL, NULL);
+    }
+    if (err == CL_SUCCESS){
+        err = clEnqueueNDRangeKernel(queue, kernel, schema->workDim, NULL, schema->globalSize,
+            schema->localSize[0] ? schema->localSize : NULL, 0, NULL, NULL);
+    }
+    if (err == CL_SUCCESS && !recorders.empty() && probes.profileEdges.empty()){
+        err = clEnqueueReadBuffer(queue, instrumentation, CL_TRUE, recorderOffset * sizeof(cl_uint),
+            recorders.size() * sizeof(cl_uint), recorders.data(), 0, NULL, NULL);
+    } else if (err == CL_SUCCESS && !recorders.empty()){
+        // Branch flags follow from the block counts, so the whole buffer is needed
+        std::vector<cl_uint> words(probes.layoutHeader[1]);
+        err = clEnqueueReadBuffer(queue, instrumentation, CL_TRUE, 0, words.size() * sizeof(cl_uint), words.data(), 0, NULL, NULL);
+        if (err == CL_SUCCESS){
+            openclbc::reconstructBlockCounts(words.data(), probes.profileEdges.data(), probes.profileEdges.size());
+            std::copy(words.begin() + recorderOffset, words.begin() + recorderOffset + recorders.size(), recorders.begin());
+        }
+    }
+    if (err == CL_SUCCESS) err = clFinish(queue);
+    if (err != CL_SUCCESS){
+        error = "kernel run failed, error " + std::to_string(err);
+        lastInput.clear();
+        return false;
+    }
+    lastInput = input;
+    return true;
+}
+
+bool KernelHarness::readInstrumentation(std::vector<cl_uint>& words, std::string& error){
+    words.resize(probes.layoutHeader[1]);
+    cl_int err = clEnqueueReadBuffer(queue, instrumentation, CL_TRUE, 0, words.size() * sizeof(cl_uint), words.data(), 0, NULL, NULL);
+    if (err != CL_SUCCESS){
+        error = "cannot read the instrumentation buffer, error " + std::to_string(err);
+        return false;
+    }
+    if (!probes.profileEdges.empty()){
+        openclbc::reconstructBlockCounts(words.data(), probes.profileEdges.data(), probes.profileEdges.size());
+    }
+    return true;
+}
+
+long double KernelHarness::readElement(const ArgumentSpec& argument, const unsigned char* element) const{
+    const ScalarType& type = *argument.type;
+    if (type.isFloat){
+        if (type.size == 4){
+            float value;
+            memcpy(&value, element, 4);
+            return value;
+        }
+        double value;
+        memcpy(&value, element, 8);
+        return value;
+    }
+    unsigned long long bits = 0;
+    memcpy(&bits, element, type.size);
+    if (type.isSigned && type.size < 8 && (bits >> (8 * type.size - 1)) & 1) bits |= ~0ull << (8 * type.size);
+    return type.isSigned ? (long double)(long long)bits : (long double)bits;
+}
+
+// Clamped to the range of the argument and of its type
+void KernelHarness::writeElement(const ArgumentSpec& argument, unsigned char* element, long double value) const{
+    const ScalarType& type = *argument.type;
+    if (argument.hasRange) value = std::min(std::max(value, (long double)argument.minValue), (long double)argument.maxValue);
+    if (type.isFloat){
+        if (std::isnan(value)) value = argument.hasRange ? argument.minValue : 0.0;
+        if (type.size == 4){
+            float narrow = (float)value;
+            memcpy(element, &narrow, 4);
+        } else {
+            double narrow = (double)value;
+            memcpy(element, &narrow, 8);
+        }
+        return;
+    }
+    long double low = type.isSigned ? -std::ldexp(1.0L, 8 * type.size - 1) : 0.0L;
+    long double high = type.isSigned ? std::ldexp(1.0L, 8 * type.size - 1) - 1 : std::ldexp(1.0L, 8 * type.size) - 1;
+    value = std::min(std::max(std::round(value), low), high);
+    unsigned long long bits = type.isSigned ? (unsigned long long)(long long)value : (unsigned long long)value;
+    memcpy(element, &bits, type.size);
+}
+
+void KernelHarness::randomElement(const ArgumentSpec& argument, unsigned char* element, std::mt19937& random) const{
+    if (argument.hasRange){
+        if (argument.type->isFloat){
+            writeElement(argument, element, std::uniform_real_distribution<double>(argument.minValue, argument.maxValue)(random));
+        } else {
+            writeElement(argument, element, (long double)std::uniform_int_distribution<long long>(
+                (long long)argument.minValue, (long long)argument.maxValue)(random));
+        }
+        return;
+    }
+    for (size_t b = 0; b < argument.type->size; b++){
+        element[b] = (unsigned char)random();
+    }
+    if (argument.type->isFloat) writeElement(argument, element, readElement(argument, element));
+}
+
+std::vector<unsigned char> KernelHarness::randomInput(std::mt19937& random) const{
+    std::vector<unsigned char> input(schema->inputSize);
+    for (const ArgumentSpec& argument : schema->arguments){
+        for (size_t e = 0; argument.inputSize && e < argument.numElements; e++){
+            randomElement(argument, input.data() + argument.inputOffset + e * argument.type->size, random);
+        }
+    }
+    return input;
+}
+
+// Bit flips, random and boundary values, small increments, copies within the argument and from another input
+void KernelHarness::mutate(std::vector<unsigned char>& input, const std::vector<unsigned char>& other, std::mt19937& random) const{
+    std::vector<const ArgumentSpec*> candidates;
+    for (const ArgumentSpec& argument : schema->arguments){
+        if (argument.inputSize) candidates.push_back(&argument);
+    }
+    if (candidates.empty()) return;
+    const ArgumentSpec& argument = *candidates[random() % candidates.size()];
+    size_t elementSize = argument.type->size;
+    unsigned char* elements = input.data() + argument.inputOffset;
+    size_t e = random() % argument.numElements;
+    unsigned char* element = elements + e * elementSize;
+    switch (random() % 6){
+        case 0:
+            element[random() % elementSize] ^= (unsigned char)(1u << (random() % 8));
+            writeElement(argument, element, readElement(argument, element));
+            break;
+        case 1:
+            randomElement(argument, element, random);
+            break;
+        case 2:{
+            const long double boundaries[] = {0.0L, 1.0L, -1.0L,
+                argument.hasRange ? argument.minValue : 0.0L, argument.hasRange ? argument.maxValue : 0.0L,
+                argument.hasRange ? argument.minValue + 1.0L : 0.0L, argument.hasRange ? argument.maxValue - 1.0L : 0.0L};
+            writeElement(argument, element, boundaries[random() % 7]);
+            break;
+        }
+        case 3:{
+            long double delta = 1 + random() % 16;
+            writeElement(argument, element, readElement(argument, element) + (random() % 2 ? delta : -delta));
+            break;
+        }
+        case 4:
+        case 5:{
+            // A run of elements, from elsewhere in the argument or from the same argument of another input
+            size_t length = 1 + random() % std::max<size_t>(1, std::min<size_t>(argument.numElements - e, 64));
+            const unsigned char* source = random() % 2 || other.size() != input.size()
+                ? elements + (random() % (argument.numElements - length + 1)) * elementSize
+                : other.data() + argument.inputOffset + e * elementSize;
+            memmove(element, source, length * elementSize);
+            break;
+        }
+    }
+}
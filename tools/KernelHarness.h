@@ -0,0 +1,154 @@
+#ifndef OPENCLBC_KERNEL_HARNESS_H
+#define OPENCLBC_KERNEL_HARNESS_H
+
+// Runs a kernel instrumented by openclbc on generated inputs. The arguments are described by a schema file,
+// one "key: value" line per setting and one "arg:" line per kernel argument, in order:
+//     kernel: gameoflife
+//     source: output/gameoflife.cl        (the instrumented kernel; its .dat file is read next to it)
+//     build_options: -DBLOCK=8
+// The source may also be the SPIR bitcode written by openclbc-ir, e.g. output/gameoflife.cl.bc, loaded as a
+// binary (give PoCL build_options: -x spir -spir-std=1.2); its .dat file is then output/gameoflife.cl.dat.
+//     global: 64 64
+//     local: 8 8
+//     arg: int[4096] 0 1                  (__global buffer of 4096 ints, values between 0 and 1)
+//     arg: out int[4096]                  (__global buffer written by the kernel, cleared before each run)
+//     arg: local 256                      (bytes of __local memory)
+//     arg: int 1 64                       (scalar between 1 and 64)
+// Ranges are optional. An input is the contents of every buffer and scalar, back to back.
+//
+// The context, program, kernel and buffers are created once; a run only writes the arguments that changed
+// since the previous run, clears the recorders and reads back the branch and barrier recorders.
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../src/RecorderLayout.h"
+#include "../runtime/EdgeProfile.h"
+
+#ifndef CL_TARGET_OPENCL_VERSION
+#define CL_TARGET_OPENCL_VERSION 120
+#endif
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+struct ScalarType{
+    const char* name;
+    size_t size;
+    bool isFloat;
+    bool isSigned;
+};
+
+struct ArgumentSpec{
+    enum Kind{
+        INPUT_BUFFER,
+        OUTPUT_BUFFER,
+        LOCAL_MEMORY,
+        SCALAR
+    };
+    Kind kind;
+    const ScalarType* type;     // NULL for local memory
+    size_t numElements;         // Bytes for local memory
+    bool hasRange;
+    double minValue;
+    double maxValue;
+    size_t inputOffset;         // Where the argument is in an input
+    size_t inputSize;           // 0 for local memory and output buffers
+};
+
+struct KernelSchema{
+    std::string kernelName;
+    std::string sourceFile;
+    std::string buildOptions;
+    cl_uint workDim = 0;
+    size_t globalSize[3] = {1, 1, 1};
+    size_t localSize[3] = {0, 0, 0};   // 0: chosen by the implementation
+    std::vector<ArgumentSpec> arguments;
+    size_t inputSize = 0;
+
+    bool load(const std::string& schemaFileName, std::string& error);
+};
+
+// What the .dat file written with the kernel tells about its instrumentation
+struct KernelProbes{
+    unsigned long long kernelHash = 0;
+    unsigned int layoutHeader[recorder_layout::HEADER_WORDS] = {0};
+    unsigned int wideKinds = 0;
+    std::vector<std::string> conditionLines;
+    std::vector<bool> coveredBefore;                   // Per branch side, left without probe by prior_coverage
+    std::vector<std::string> barrierLines;
+    std::vector<openclbc::ProfileEdge> profileEdges;   // Per block, empty unless rewritten with edge_profiling
+
+    bool load(const std::string& dataFileName, std::string& error);
+};
+
+// The first CPU device, or the first device of any type; NULL if there is none
+cl_device_id findDevice();
+
+// The instrumented kernel of a schema, built for devices of the context
+cl_program buildKernelProgram(const KernelSchema& schema, cl_context context, const std::vector<cl_device_id>& devices,
+    std::string& error);
+
+class KernelHarness{
+public:
+    KernelHarness();
+    ~KernelHarness();
+
+    // With its own context and program; device may be NULL to use findDevice()
+    bool initialise(const KernelSchema& schema, cl_device_id device, std::string& error);
+
+    // Sharing a context and a program built for several devices, e.g. sub-devices of one CPU. Each harness
+    // has its own kernel, command queue and buffers, so harnesses can run in parallel threads.
+    bool initialise(const KernelSchema& schema, cl_context context, cl_program program, cl_device_id device,
+        std::string& error);
+
+    // Launch the kernel on an input of schema.inputSize bytes and wait for its recorders
+    bool run(const std::vector<unsigned char>& input, std::string& error);
+
+    // After run: a flag per branch side (2 per condition, true side first) and per barrier (set if divergent)
+    const cl_uint* getBranches() const { return recorders.data(); }
+    const cl_uint* getBarriers() const { return recorders.data() + (barrierOffset - recorderOffset); }
+    size_t getNumBranches() const { return numBranches; }
+    size_t getNumBarriers() const { return numBarriers; }
+
+    // Read the whole instrumentation buffer, layout header included, e.g. to write a dump
+    bool readInstrumentation(std::vector<cl_uint>& words, std::string& error);
+
+    const KernelProbes& getProbes() const { return probes; }
+
+    // Random input within the ranges of the schema
+    std::vector<unsigned char> randomInput(std::mt19937& random) const;
+
+    // Change a few elements of one argument of an input, keeping them within their ranges
+    void mutate(std::vector<unsigned char>& input, const std::vector<unsigned char>& other, std::mt19937& random) const;
+
+private:
+    const KernelSchema* schema;
+    KernelProbes probes;
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    std::vector<cl_mem> buffers;                // Per argument, NULL for scalars and local memory
+    cl_mem instrumentation;
+    std::vector<unsigned char> lastInput;       // Arguments already on the device
+    std::vector<cl_uint> recorders;             // Branch and barrier recorders, read back after every run
+    size_t recorderOffset;                      // In words, from the start of the instrumentation buffer
+    size_t barrierOffset;
+    size_t numBranches;
+    size_t numBarriers;
+
+    KernelHarness(const KernelHarness&);
+    KernelHarness& operator=(const KernelHarness&);
+
+    void release();
+    long double readElement(const ArgumentSpec& argument, const unsigned char* element) const;
+    void writeElement(const ArgumentSpec& argument, unsigned char* element, long double value) const;
+    void randomElement(const ArgumentSpec& argument, unsigned char* element, std::mt19937& random) const;
+};
+
+#endif
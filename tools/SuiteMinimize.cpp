@@ -0,0 +1,237 @@
+// Pick a small, cheap subset of a test suite keeping all its kernel coverage. Every test is given as the dump
+// it wrote (see writeCoverageDump); its features are the branch sides it took and the barriers it found
+// divergent. Tests are chosen greedily by new features per second of runtime (weighted set cover), then
+// tests whose features are all covered by other chosen ones are dropped, most expensive first.
+// Features are packed 64 to a word and scored with popcount, and the greedy choice is lazy: since a
+// test can only lose new features as others are chosen, its last score is an upper bound and it is only
+// rescored when it reaches the top of the queue.
+// The flags of branch sides left without probe because a previous run covered them (prior_coverage) are never
+// set; given the .dat file of the kernel, such sides count as covered by the suite but by none of its tests.
+//
+// Usage: openclbc-minimize [-weights runtimes.txt] [-data kernel.dat] [-o selected.txt] dump.ocbd...
+// runtimes.txt has one "dump seconds" line per test; tests not listed weigh 1.
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "../src/Constants.h"
+
+struct Test{
+    std::string dumpFileName;
+    double weight;
+};
+
+size_t popcount(uint64_t word){
+    return std::bitset<64>(word).count();
+}
+
+// Branch sides taken, then divergent barriers, of one dump
+bool loadFeatures(const std::string& dumpFileName, unsigned long long& kernelHash, size_t& numFeatures, uint64_t* features,
+    size_t numWords, std::string& error){
+    std::ifstream dumpFile(dumpFileName, std::ios::binary);
+    unsigned int header[dump_format::HEADER_WORDS];
+    if (!dumpFile.read((char*)header, sizeof(header)) || header[0] != dump_format::FILE_MAGIC || header[1] != dump_format::VERSION){
+        error = dumpFileName + " is not an OpenCLBC dump";
+        return false;
+    }
+    std::vector<unsigned int> buffer(header[5]);
+    if (buffer.size() < recorder_layout::HEADER_WORDS || !dumpFile.read((char*)buffer.data(), buffer.size() * sizeof(unsigned int))){
+        error = dumpFileName + " is truncated";
+        return false;
+    }
+    unsigned long long hash = header[2] | ((unsigned long long)header[3] << 32);
+    size_t numBranches = buffer[3 + 2 * recorder_layout::BRANCH];
+    size_t numBarriers = buffer[3 + 2 * recorder_layout::BARRIER];
+    if (!features){
+        kernelHash = hash;
+        numFeatures = numBranches + numBarriers;
+        return true;
+    }
+    if (hash != kernelHash || numBranches + numBarriers != numFeatures){
+        error = dumpFileName + " was written by another kernel than the first dump";
+        return false;
+    }
+    const unsigned int* recorders[] = {buffer.data() + buffer[2 + 2 * recorder_layout::BRANCH],
+        buffer.data() + buffer[2 + 2 * recorder_layout::BARRIER]};
+    size_t counts[] = {numBranches, numBarriers};
+    memset(features, 0, numWords * sizeof(uint64_t));
+    for (size_t r = 0, bit = 0; r < 2; r++){
+        for (size_t i = 0; i < counts[r]; i++, bit++){
+            features[bit >> 6] |= (uint64_t)(recorders[r][i] != 0) << (bit & 63);
+        }
+    }
+    return true;
+}
+
+// Branch sides listed as "Covered before" in the .dat file of the kernel
+bool loadCoveredBefore(const std::string& dataFileName, size_t numFeatures, uint64_t* covered, std::string& error){
+    std::ifstream dataFile(dataFileName);
+    if (!dataFile){
+        error = "cannot open " + dataFileName;
+        return false;
+    }
+    long condition = -1;
+    std::string line;
+    while (std::getline(dataFile, line)){
+        if (line.compare(0, 14, "Condition ID: ") == 0){
+            condition = std::stol(line.substr(14));
+        } else if (line.find(" ID: ") != std::string::npos){
+            condition = -1;
+        } else if (line.compare(0, 16, "Covered before: ") == 0 && condition >= 0){
+            std::string sides = line.substr(16);
+            size_t bit = 2 * condition;
+            if (bit + 1 >= numFeatures){
+                error = dataFileName + " does not describe the kernel of the dumps";
+                return false;
+            }
+            covered[bit >> 6] |= (uint64_t)(sides != "false") << (bit & 63);
+            covered[(bit + 1) >> 6] |= (uint64_t)(sides != "true") << ((bit + 1) & 63);
+        }
+    }
+    return true;
+}
+
+int main(int argc, const char** argv){
+    const char* weightsFileName = NULL;
+    const char* dataFileName = NULL;
+    const char* outputFileName = NULL;
+    std::vector<Test> tests;
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-weights") == 0 && i + 1 < argc){
+            weightsFileName = argv[++i];
+        } else if (strcmp(argv[i], "-data") == 0 && i + 1 < argc){
+            dataFileName = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc){
+            outputFileName = argv[++i];
+        } else {
+            tests.push_back({argv[i], 1.0});
+        }
+    }
+    if (tests.empty()){
+        std::cerr << "Usage: " << argv[0] << " [-weights runtimes.txt] [-data kernel.dat] [-o selected.txt] dump.ocbd...\n";
+        return 1;
+    }
+    if (weightsFileName){
+        std::ifstream weightsFile(weightsFileName);
+        if (!weightsFile){
+            std::cerr << "Cannot open " << weightsFileName << "\n";
+            return 1;
+        }
+        std::map<std::string, double> weights;
+        std::string dumpFileName;
+        double seconds;
+        while (weightsFile >> dumpFileName >> seconds){
+            weights[dumpFileName] = seconds;
+        }
+        for (Test& test : tests){
+            auto weight = weights.find(test.dumpFileName);
+            // Free tests would always be chosen first, whatever they cover
+            if (weight != weights.end()) test.weight = std::max(weight->second, 1e-9);
+        }
+    }
+
+    std::string error;
+    unsigned long long kernelHash = 0;
+    size_t numFeatures = 0;
+    if (!loadFeatures(tests[0].dumpFileName, kernelHash, numFeatures, NULL, 0, error)){
+        std::cerr << error << "\n";
+        return 1;
+    }
+    size_t numWords = (numFeatures + 63) / 64;
+    std::vector<uint64_t> features(tests.size() * numWords);
+    std::vector<uint64_t> all(numWords, 0);
+    for (size_t t = 0; t < tests.size(); t++){
+        if (!loadFeatures(tests[t].dumpFileName, kernelHash, numFeatures, &features[t * numWords], numWords, error)){
+            std::cerr << error << "\n";
+            return 1;
+        }
+        for (size_t w = 0; w < numWords; w++) all[w] |= features[t * numWords + w];
+    }
+    std::vector<uint64_t> coveredBefore(numWords, 0);
+    if (dataFileName && !loadCoveredBefore(dataFileName, numFeatures, coveredBefore.data(), error)){
+        std::cerr << error << "\n";
+        return 1;
+    }
+    size_t numCoveredBefore = 0;
+    for (size_t w = 0; w < numWords; w++){
+        numCoveredBefore += popcount(coveredBefore[w] & ~all[w]);
+        all[w] |= coveredBefore[w];
+    }
+
+    // Greedy: the test with the most new features per second, rescored lazily
+    std::vector<uint64_t> covered(numWords, 0);
+    auto newFeatures = [&](size_t t){
+        size_t count = 0;
+        const uint64_t* test = &features[t * numWords];
+        for (size_t w = 0; w < numWords; w++) count += popcount(test[w] & ~covered[w]);
+        return count;
+    };
+    std::priority_queue<std::pair<double, size_t> > queue;
+    for (size_t t = 0; t < tests.size(); t++){
+        size_t count = newFeatures(t);
+        if (count) queue.push({count / tests[t].weight, t});
+    }
+    std::vector<size_t> selected;
+    while (!queue.empty()){
+        size_t t = queue.top().second;
+        queue.pop();
+        size_t count = newFeatures(t);
+        if (!count) continue;
+        double score = count / tests[t].weight;
+        if (!queue.empty() && score < queue.top().first){
+            queue.push({score, t});
+            continue;
+        }
+        selected.push_back(t);
+        for (size_t w = 0; w < numWords; w++) covered[w] |= features[t * numWords + w];
+    }
+
+    // Drop tests made redundant by later choices, most expensive first
+    std::vector<unsigned int> coverCount(numFeatures, 0);
+    for (size_t t : selected){
+        for (size_t i = 0; i < numFeatures; i++) coverCount[i] += (features[t * numWords + (i >> 6)] >> (i & 63)) & 1;
+    }
+    std::sort(selected.begin(), selected.end(), [&](size_t a, size_t b){ return tests[a].weight > tests[b].weight; });
+    std::vector<size_t> kept;
+    for (size_t t : selected){
+        bool redundant = true;
+        for (size_t i = 0; i < numFeatures && redundant; i++){
+            if ((features[t * numWords + (i >> 6)] >> (i & 63)) & 1) redundant = coverCount[i] > 1;
+        }
+        if (redundant){
+            for (size_t i = 0; i < numFeatures; i++) coverCount[i] -= (features[t * numWords + (i >> 6)] >> (i & 63)) & 1;
+        } else {
+            kept.push_back(t);
+        }
+    }
+    std::sort(kept.begin(), kept.end());
+
+    FILE* outputFile = outputFileName ? fopen(outputFileName, "w") : stdout;
+    if (!outputFile){
+        std::cerr << "Cannot write " << outputFileName << "\n";
+        return 1;
+    }
+    double totalWeight = 0, keptWeight = 0;
+    for (const Test& test : tests) totalWeight += test.weight;
+    for (size_t t : kept){
+        keptWeight += tests[t].weight;
+        fprintf(outputFile, "%s\n", tests[t].dumpFileName.c_str());
+    }
+    if (outputFile != stdout) fclose(outputFile);
+    size_t coveredFeatures = 0;
+    for (uint64_t word : all) coveredFeatures += popcount(word);
+    fprintf(stderr, "Kept %lu of %lu tests (weight %.3f of %.3f), covering all %lu features of the suite out of %lu",
+        (unsigned long)kept.size(), (unsigned long)tests.size(), keptWeight, totalWeight,
+        (unsigned long)coveredFeatures, (unsigned long)numFeatures);
+    fprintf(stderr, numCoveredBefore ? " (%lu covered in a previous run)\n" : "\n", (unsigned long)numCoveredBefore);
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Convert a .trace file written by the generated host code to the Chrome trace event format,
+// which chrome://tracing and Perfetto can open.
+// Every sampled work-group is shown as a process and every work-item as a thread. OpenCL C has no
+// portable clock, so events are placed on the timeline by their sequence number in the work-group.
+//
+// Usage: openclbc-trace2json kernel.cl.trace [kernel.cl.dat] > kernel.json
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../src/Constants.h"
+
+// Source lines of the conditions and barriers, read from the data file written with the kernel
+void loadLabels(const char* dataFileName, std::map<unsigned int, std::string>& conditionLines,
+    std::map<unsigned int, std::string>& barrierLines){
+    std::ifstream dataFile(dataFileName);
+    std::string line;
+    std::map<unsigned int, std::string>* labels = NULL;
+    unsigned int id = 0;
+    while (std::getline(dataFile, line)){
+        if (line.compare(0, 14, "Condition ID: ") == 0){
+            labels = &conditionLines;
+            id = std::stoul(line.substr(14));
+        } else if (line.compare(0, 12, "Barrier ID: ") == 0){
+            labels = &barrierLines;
+            id = std::stoul(line.substr(12));
+        } else if (line.compare(0, 18, "Source code line: ") == 0 && labels){
+            (*labels)[id] = line.substr(18);
+            labels = NULL;
+        } else if (line.find(" ID: ") != std::string::npos){
+            labels = NULL;
+        }
+    }
+}
+
+std::string escapeJson(const std::string& text){
+    std::string result;
+    for (char c : text){
+        if (c == '"' || c == '\\') result.push_back('\\');
+        result.push_back(c);
+    }
+    return result;
+}
+
+int main(int argc, const char** argv){
+    if (argc < 2 || argc > 3){
+        std::cerr << "Usage: " << argv[0] << " kernel.cl.trace [kernel.cl.dat]\n";
+        return 1;
+    }
+
+    FILE* traceFile = fopen(argv[1], "rb");
+    if (!traceFile){
+        std::cerr << "Cannot open " << argv[1] << "\n";
+        return 1;
+    }
+    unsigned int header[4];
+    if (fread(header, sizeof(unsigned int), 4, traceFile) != 4 || header[0] != trace_format::FILE_MAGIC){
+        std::cerr << argv[1] << " is not an OpenCLBC trace file\n";
+        fclose(traceFile);
+        return 1;
+    }
+    unsigned int numSlots = header[1], capacity = header[2], groupStride = header[3];
+    unsigned int slotWords = trace_format::SLOT_HEADER_WORDS + trace_format::EVENT_WORDS * capacity;
+    std::vector<unsigned int> buffer((size_t)numSlots * slotWords);
+    if (fread(buffer.data(), sizeof(unsigned int), buffer.size(), traceFile) != buffer.size()){
+        std::cerr << argv[1] << " is truncated\n";
+        fclose(traceFile);
+        return 1;
+    }
+    fclose(traceFile);
+
+    std::map<unsigned int, std::string> conditionLines, barrierLines;
+    if (argc == 3){
+        loadLabels(argv[2], conditionLines, barrierLines);
+    }
+
+    std::string output;
+    output.reserve(buffer.size() * 24);
+    output.append("{\"traceEvents\":[\n");
+    bool first = true;
+    unsigned long long totalDropped = 0;
+    char event[512];
+    for (unsigned int slot = 0; slot < numSlots; slot++){
+        const unsigned int* slotBuffer = &buffer[(size_t)slot * slotWords];
+        unsigned int numEvents = std::min(slotBuffer[0], capacity);
+        unsigned int dropped = slotBuffer[1];
+        if (numEvents == 0) continue;
+        totalDropped += dropped;
+
+        snprintf(event, sizeof(event), "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"work-group %u (%u events dropped)\"}}",
+            first ? "" : ",\n", slot, slot * groupStride, dropped);
+        output.append(event);
+        first = false;
+
+        for (unsigned int i = 0; i < numEvents; i++){
+            const unsigned int* entry = slotBuffer + trace_format::SLOT_HEADER_WORDS + trace_format::EVENT_WORDS * i;
+            unsigned int id = entry[0] & trace_format::EVENT_ID_MASK;
+            unsigned int localId = entry[1];
+            unsigned int sequence = entry[2];
+            if (entry[0] & (trace_format::BARRIER_ENTRY | trace_format::BARRIER_EXIT)){
+                // Barrier waits are slices from entry to exit on the thread of the work-item
+                std::string name = "barrier " + std::to_string(id);
+                if (barrierLines.count(id)) name += " " + barrierLines[id];
+                snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"cat\":\"barrier\",\"ph\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%u}",
+                    escapeJson(name).c_str(), (entry[0] & trace_format::BARRIER_ENTRY) ? "B" : "E", slot, localId, sequence);
+            } else {
+                // Branch probes: even IDs are true branches, odd IDs false branches
+                std::string name = "condition " + std::to_string(id / 2) + ((id % 2) ? " false" : " true");
+                if (conditionLines.count(id / 2)) name += " " + conditionLines[id / 2];
+                snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"cat\":\"branch\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%u,\"tid\":%u,\"ts\":%u}",
+                    escapeJson(name).c_str(), slot, localId, sequence);
+            }
+            output.append(event);
+        }
+    }
+    output.append("\n],\"displayTimeUnit\":\"ns\"}\n");
+    fwrite(output.data(), 1, output.size(), stdout);
+
+    if (totalDropped){
+        std::cerr << totalDropped << " events were dropped, increase trace_buffer_size to keep them\n";
+    }
+    return 0;
+}